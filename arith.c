@@ -0,0 +1,416 @@
+#include "main.h"
+
+/*
+ * Arithmetic, for $((...)), (( )) and for (( ; ; )).
+ *
+ * Expressions are evaluated straight from their text by recursive
+ * descent, with the operators and precedence of C, on longs (64 bits
+ * on the platforms the shell runs on). Overflow wraps around. Variables
+ * are read and assigned in place, so counting doesn't leave the shell.
+ */
+
+typedef struct {
+	const char *start, *pos, *end;
+	bool skip; /* On the side not taken of &&, || or ?:, so no side effects */
+	bool error;
+	int depth; /* Of variables whose values are expressions themselves */
+} Arith;
+
+#define MAX_DEPTH 32
+
+/* Binary operators, longer ones first, and their precedence */
+static const struct {
+	const char *op;
+	int prec;
+} binary_ops[] = {
+	{ "||", 0 },
+	{ "&&", 1 },
+	{ "==", 5 }, { "!=", 5 },
+	{ "<=", 6 }, { ">=", 6 },
+	{ "<<", 7 }, { ">>", 7 },
+	{ "|", 2 },
+	{ "^", 3 },
+	{ "&", 4 },
+	{ "<", 6 }, { ">", 6 },
+	{ "+", 8 }, { "-", 8 },
+	{ "*", 9 }, { "/", 9 }, { "%", 9 }
+};
+#define NUM_BINARY_OPS ((int) (sizeof(binary_ops) / sizeof(*binary_ops)))
+
+/* Assignment operators, which are the binary ones followed by = */
+static const char *const assign_ops[] = {
+	"=", "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", "&=", "^=", "|=", NULL
+};
+
+static bool evaluate(const char *, size_t, int, long *);
+static long comma(Arith *);
+static long assignment(Arith *);
+
+static long fail(Arith *a, const char *message) {
+	if (!a->error) {
+		fprintf(stderr, SMSH ": %.*s: %s\n", (int) (a->end - a->start), a->start, message);
+	}
+	a->error = true;
+	return 0;
+}
+
+static void skip_blanks(Arith *a) {
+	while (a->pos < a->end && isspace((unsigned char) *a->pos)) {
+		a->pos++;
+	}
+}
+
+static bool accept(Arith *a, char c) {
+	skip_blanks(a);
+	if (a->pos < a->end && c == *a->pos) {
+		a->pos++;
+		return true;
+	}
+	return false;
+}
+
+/* Whether op is next, and not just the start of another operator */
+static bool at_op(Arith *a, const char *op) {
+	size_t len = strlen(op);
+	const char *next = a->pos + len;
+
+	if ((size_t) (a->end - a->pos) < len || 0 != strncmp(a->pos, op, len)) {
+		return false;
+	}
+	if (next < a->end && '=' == *next && '=' != op[len - 1]) {
+		/* A compound assignment, such as += */
+		return false;
+	}
+	if (next < a->end && 1 == len && *op == *next && !strchr("+-", *op)) {
+		/* The first half of an operator such as && */
+		return false;
+	}
+	return true;
+}
+
+/* Returns the index of the binary operator that's next, or -1 */
+static int next_binary(Arith *a) {
+	int i;
+
+	skip_blanks(a);
+	if (a->pos == a->end || !strchr("|&^=!<>+-*/%", *a->pos)) {
+		return -1;
+	}
+	for (i = 0; i < NUM_BINARY_OPS; i++) {
+		if (at_op(a, binary_ops[i].op)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static size_t scan_name(Arith *a) {
+	const char *name = a->pos;
+	while (a->pos < a->end && is_name_char(*a->pos, a->pos == name)) {
+		a->pos++;
+	}
+	return (size_t) (a->pos - name);
+}
+
+static long get(Arith *a, const char *name, size_t len) {
+	const char *value = get_var_n(name, len);
+	char *end;
+	long n;
+
+	if (!value || !*value) {
+		return 0;
+	}
+	n = strtol(value, &end, 0);
+	if (!*end) {
+		return n;
+	}
+	/* The value is an expression of its own, such as x=1+2 */
+	if (!evaluate(value, strlen(value), a->depth + 1, &n)) {
+		a->error = true;
+	}
+	return n;
+}
+
+static long set(Arith *a, const char *name, size_t len, long value) {
+	char buf[256], num[32];
+
+	if (a->skip || a->error) {
+		return value;
+	}
+	if (len >= sizeof(buf)) {
+		return fail(a, "variable name too long");
+	}
+	memcpy(buf, name, len);
+	buf[len] = 0;
+	sprintf(num, "%ld", value);
+	set_var(buf, num);
+	return value;
+}
+
+/* Applies a binary operator, or the one of a compound assignment */
+static long apply(Arith *a, const char *op, long left, long right) {
+	unsigned long l = (unsigned long) left, r = (unsigned long) right;
+
+	switch (op[0]) {
+		case '*':
+			if ('*' == op[1]) {
+				unsigned long result = 1;
+				if (right < 0) {
+					return a->skip ? 0 : fail(a, "exponent less than 0");
+				}
+				for (; r; r >>= 1) {
+					if (r & 1) {
+						result *= l;
+					}
+					l *= l;
+				}
+				return (long) result;
+			}
+			return (long) (l * r);
+		case '/':
+		case '%':
+			if (0 == right) {
+				return a->skip ? 0 : fail(a, "division by zero");
+			}
+			if (-1 == right) {
+				/* LONG_MIN / -1 overflows, and traps */
+				return '/' == op[0] ? (long) (0 - l) : 0;
+			}
+			return '/' == op[0] ? left / right : left % right;
+		case '+': return (long) (l + r);
+		case '-': return (long) (l - r);
+		case '<':
+			if ('<' == op[1]) {
+				return (long) (l << (r & 63));
+			}
+			return '=' == op[1] ? left <= right : left < right;
+		case '>':
+			if ('>' == op[1]) {
+				return left >> (r & 63);
+			}
+			return '=' == op[1] ? left >= right : left > right;
+		case '=': return left == right;
+		case '!': return left != right;
+		case '&': return '&' == op[1] ? left && right : left & right;
+		case '|': return '|' == op[1] ? left || right : left | right;
+		case '^': return left ^ right;
+	}
+	return fail(a, "syntax error");
+}
+
+static long primary(Arith *a) {
+	skip_blanks(a);
+	if (a->pos >= a->end) {
+		return fail(a, "operand expected");
+	}
+	if (accept(a, '(')) {
+		long value = comma(a);
+		if (!accept(a, ')')) {
+			return fail(a, "')' expected");
+		}
+		return value;
+	}
+	if (isdigit((unsigned char) *a->pos)) {
+		char *end;
+		long value = strtol(a->pos, &end, 0);
+		a->pos = end;
+		if (a->pos < a->end && (isalnum((unsigned char) *a->pos) || '_' == *a->pos)) {
+			return fail(a, "invalid number");
+		}
+		return value;
+	}
+	if (is_name_char(*a->pos, true)) {
+		const char *name = a->pos;
+		size_t len = scan_name(a);
+		long value = get(a, name, len);
+
+		skip_blanks(a);
+		if (a->end - a->pos >= 2 && ('+' == a->pos[0] || '-' == a->pos[0]) &&
+				a->pos[0] == a->pos[1]) {
+			/* Postfix ++ or -- */
+			long step = '+' == a->pos[0] ? 1 : -1;
+			a->pos += 2;
+			set(a, name, len, apply(a, "+", value, step));
+		}
+		return value;
+	}
+	return fail(a, "syntax error");
+}
+
+static long unary(Arith *a) {
+	skip_blanks(a);
+	if (a->end - a->pos >= 2 && ('+' == a->pos[0] || '-' == a->pos[0]) &&
+			a->pos[0] == a->pos[1]) {
+		const char *name = a->pos + 2;
+		while (name < a->end && isspace((unsigned char) *name)) {
+			name++;
+		}
+		if (name < a->end && is_name_char(*name, true)) {
+			/* Prefix ++ or --, rather than two signs */
+			long step = '+' == a->pos[0] ? 1 : -1;
+			size_t len;
+
+			a->pos = name;
+			len = scan_name(a);
+			return set(a, name, len, apply(a, "+", get(a, name, len), step));
+		}
+	}
+	if (accept(a, '!')) {
+		return !unary(a);
+	}
+	if (accept(a, '~')) {
+		return ~unary(a);
+	}
+	if (accept(a, '-')) {
+		return apply(a, "-", 0, unary(a));
+	}
+	if (accept(a, '+')) {
+		return unary(a);
+	}
+	return primary(a);
+}
+
+/* ** is right-associative and binds tighter than everything but unary */
+static long power(Arith *a) {
+	long base = unary(a);
+	skip_blanks(a);
+	if (at_op(a, "**")) {
+		a->pos += 2;
+		return apply(a, "**", base, power(a));
+	}
+	return base;
+}
+
+/* Binary operators of at least the given precedence, by precedence climbing */
+static long binary(Arith *a, int prec) {
+	bool skip = a->skip;
+	long left = power(a);
+	int i;
+
+	while (!a->error && 0 <= (i = next_binary(a)) && binary_ops[i].prec >= prec) {
+		const char *op = binary_ops[i].op;
+		long right;
+
+		a->pos += strlen(op);
+		/* The right side of && and || only matters sometimes */
+		if (0 == strcmp(op, "&&")) {
+			a->skip = skip || !left;
+		} else if (0 == strcmp(op, "||")) {
+			a->skip = skip || left;
+		}
+		right = binary(a, binary_ops[i].prec + 1);
+		a->skip = skip;
+		left = apply(a, op, left, right);
+	}
+	return left;
+}
+
+static long conditional(Arith *a) {
+	long cond = binary(a, 0), then, otherwise;
+	bool skip = a->skip;
+
+	if (!accept(a, '?')) {
+		return cond;
+	}
+	a->skip = skip || !cond;
+	then = comma(a);
+	if (!accept(a, ':')) {
+		return fail(a, "':' expected");
+	}
+	a->skip = skip || cond;
+	otherwise = assignment(a);
+	a->skip = skip;
+	return cond ? then : otherwise;
+}
+
+static long assignment(Arith *a) {
+	const char *start, *name;
+	size_t len;
+
+	skip_blanks(a);
+	start = name = a->pos;
+	if (a->pos < a->end && is_name_char(*a->pos, true)) {
+		const char *const *op;
+
+		len = scan_name(a);
+		skip_blanks(a);
+		for (op = assign_ops; *op; op++) {
+			size_t op_len = strlen(*op);
+			long value;
+
+			if ((size_t) (a->end - a->pos) < op_len || 0 != strncmp(a->pos, *op, op_len) ||
+					(1 == op_len && a->pos + 1 < a->end && '=' == a->pos[1])) {
+				continue;
+			}
+			a->pos += op_len;
+			value = assignment(a);
+			if (1 < op_len) {
+				value = apply(a, *op, get(a, name, len), value);
+			}
+			return set(a, name, len, value);
+		}
+	}
+	/* Not an assignment after all */
+	a->pos = start;
+	return conditional(a);
+}
+
+static long comma(Arith *a) {
+	long value = assignment(a);
+	while (!a->error && accept(a, ',')) {
+		value = assignment(a);
+	}
+	return value;
+}
+
+static bool evaluate(const char *expr, size_t len, int depth, long *result) {
+	Arith a;
+
+	a.start = a.pos = expr;
+	a.end = expr + len;
+	a.skip = a.error = false;
+	a.depth = depth;
+	*result = 0;
+
+	if (MAX_DEPTH < depth) {
+		fail(&a, "expression recursion level exceeded");
+		return false;
+	}
+	skip_blanks(&a);
+	if (a.pos == a.end) {
+		/* An empty expression is 0 */
+		return true;
+	}
+	*result = comma(&a);
+	skip_blanks(&a);
+	if (!a.error && a.pos != a.end) {
+		fail(&a, "syntax error");
+	}
+	return !a.error;
+}
+
+/* Evaluates the first len characters of expr, expanding any parameters
+ * in it first. Returns false, having reported why, on errors. */
+bool arith(const char *expr, size_t len, long *result) {
+	char *copy, *expanded;
+	size_t i;
+	bool ok;
+
+	for (i = 0; i < len && !strchr("$'\"\\", expr[i]); i++);
+	if (i == len) {
+		/* Nothing to expand, which is the common case in loops */
+		return evaluate(expr, len, 0, result);
+	}
+
+	if (!(copy = malloc(len + 1))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(copy, expr, len);
+	copy[len] = 0;
+	expanded = expand_word(copy, false);
+	ok = evaluate(expanded, strlen(expanded), 0, result);
+	free(expanded);
+	free(copy);
+	return ok;
+}
@@ -0,0 +1,56 @@
+/* For clock_gettime */
+#define _DEFAULT_SOURCE
+#include "../main.h"
+
+/*
+ * Times parsing the same command line over and over, as parse_commands
+ * and free_node do it and as parse_line does through the parse cache.
+ *
+ *     make bench/parse && bench/parse [runs] [line]
+ *
+ * Runs 1000000 times by default, on a pipeline.
+ */
+
+#define DEFAULT_LINE "ls -l \"$HOME\" | grep -v '^total' | sort -k5 -n | head -n 5"
+
+static double elapsed_ns(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double) (now.tv_sec - start->tv_sec) * 1e9 + (double) (now.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv) {
+	long runs = argc > 1 ? atol(argv[1]) : 1000000, i;
+	const char *line = argc > 2 ? argv[2] : DEFAULT_LINE;
+	struct timespec start;
+	bool incomplete, cached;
+	Node *tree;
+
+	if (runs <= 0) {
+		fprintf(stderr, "usage: %s [runs] [line]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!(tree = parse_commands(line, &incomplete))) {
+		fprintf(stderr, "%s: the line doesn't parse\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	free_node(tree);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < runs; i++) {
+		if ((tree = parse_commands(line, &incomplete))) {
+			free_node(tree);
+		}
+	}
+	printf("parse_commands: %.0f ns per line\n", elapsed_ns(&start) / (double) runs);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < runs; i++) {
+		if ((tree = parse_line(line, &incomplete, &cached)) && !cached) {
+			free_node(tree);
+		}
+	}
+	printf("parse_line:     %.0f ns per line\n", elapsed_ns(&start) / (double) runs);
+	parse_stats();
+	return EXIT_SUCCESS;
+}
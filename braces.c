@@ -0,0 +1,321 @@
+#include "main.h"
+
+/*
+ * Brace expansion: a{b,c}d and sequences such as {1..10} or {a..z..2}.
+ *
+ * A word is split into its brace groups and the text between them, and
+ * the words are produced one at a time by counting through the groups
+ * like an odometer. Sequences are never written out, so looping over
+ * {1..1000000} takes no more memory than {1..2}. Lists are written by
+ * hand and stay small, so their alternatives, which may have braces of
+ * their own, are expanded up front.
+ */
+
+static char *copy(const char *src, size_t len) {
+	char *dst = malloc(len + 1);
+	if (!dst) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(dst, src, len);
+	dst[len] = 0;
+	return dst;
+}
+
+/* Skips a quote, an escaped character or a ${ } or $( ) expansion,
+ * none of which braces are expanded within. src points at its start. */
+static const char *skip_quoted(const char *src) {
+	char open, close;
+	int depth = 0;
+
+	switch (*src) {
+		case '\\':
+			return src[1] ? src + 2 : src + 1;
+		case '\'':
+		case '"':
+			for (open = *src++; *src && open != *src; src++) {
+				if ('"' == open && '\\' == *src && src[1]) {
+					src++;
+				}
+			}
+			return *src ? src + 1 : src;
+		case '$':
+			if ('{' != src[1] && '(' != src[1]) {
+				return src + 1;
+			}
+			open = src[1];
+			close = '{' == open ? '}' : ')';
+			for (src++; *src; src++) {
+				if (open == *src) {
+					depth++;
+				} else if (close == *src && 0 == --depth) {
+					return src + 1;
+				}
+			}
+			return src;
+	}
+	return src + 1;
+}
+
+/* Finds the } of the { that src points at, or the end of the word */
+static const char *find_close(const char *src) {
+	int depth = 0;
+
+	while (*src) {
+		if ('{' == *src) {
+			depth++;
+		} else if ('}' == *src && 0 == --depth) {
+			return src;
+		}
+		src = strchr("\\'\"$", *src) ? skip_quoted(src) : src + 1;
+	}
+	return src;
+}
+
+/* Parses an endpoint of a sequence, either a number or a letter */
+static bool endpoint(const char *src, size_t len, bool letter, long *value) {
+	char buf[32], *end;
+
+	if (letter) {
+		*value = (unsigned char) *src;
+		return 1 == len && isalpha((unsigned char) *src);
+	}
+	if (0 == len || len >= sizeof(buf)) {
+		return false;
+	}
+	memcpy(buf, src, len);
+	buf[len] = 0;
+	*value = strtol(buf, &end, 10);
+	return !*end && (isdigit((unsigned char) buf[0]) ||
+		('-' == buf[0] && isdigit((unsigned char) buf[1])));
+}
+
+/* Whether the text inside the braces is a sequence, x..y[..step] */
+static bool parse_sequence(BraceGroup *group, const char *src, const char *end) {
+	const char *dots = strstr(src, ".."), *step_dots;
+	long first, last, step = 1;
+	unsigned long distance;
+	bool letters = isalpha((unsigned char) *src);
+
+	if (!dots || dots >= end) {
+		return false;
+	}
+	step_dots = strstr(dots + 2, "..");
+	if (!step_dots || step_dots >= end) {
+		step_dots = end;
+	} else if (!endpoint(step_dots + 2, (size_t) (end - step_dots - 2), false, &step)) {
+		return false;
+	}
+	if (!endpoint(src, (size_t) (dots - src), letters, &first) ||
+			!endpoint(dots + 2, (size_t) (step_dots - dots - 2), letters, &last)) {
+		return false;
+	}
+
+	if (step < 0) {
+		step = -step;
+	} else if (0 == step) {
+		step = 1;
+	}
+	distance = last >= first ? (unsigned long) last - (unsigned long) first :
+		(unsigned long) first - (unsigned long) last;
+	group->first = first;
+	group->step = last >= first ? step : -step;
+	group->count = distance / (unsigned long) step + 1;
+	group->letters = letters;
+	group->width = 0;
+	if (!letters) {
+		/* A leading zero on either end pads all numbers to the longest */
+		size_t first_len = (size_t) (dots - src), last_len = (size_t) (step_dots - dots - 2);
+		const char *a = '-' == *src ? src + 1 : src, *b = '-' == dots[2] ? dots + 3 : dots + 2;
+		if (('0' == a[0] && isdigit((unsigned char) a[1])) ||
+				('0' == b[0] && isdigit((unsigned char) b[1]))) {
+			group->width = (int) (first_len > last_len ? first_len : last_len);
+		}
+	}
+	return true;
+}
+
+/* Whether the text inside the braces is a list, a,b[,c...]. The
+ * alternatives are brace expanded themselves. */
+static bool parse_list(BraceGroup *group, const char *src, const char *end, bool escape) {
+	const char *alt = src, *pos = src;
+	size_t cap = 4;
+	int depth = 0;
+	bool comma = false;
+
+	for (; pos < end; pos = strchr("\\'\"$", *pos) ? skip_quoted(pos) : pos + 1) {
+		if ('{' == *pos) {
+			depth++;
+		} else if ('}' == *pos) {
+			depth--;
+		} else if (',' == *pos && 0 == depth) {
+			comma = true;
+		}
+	}
+	if (!comma) {
+		return false;
+	}
+
+	group->count = 0;
+	depth = 0;
+	if (!(group->words = malloc(cap * sizeof(*group->words)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (pos = src; ; pos = strchr("\\'\"$", *pos) ? skip_quoted(pos) : pos + 1) {
+		if (pos >= end || (',' == *pos && 0 == depth)) {
+			char *text = copy(alt, (size_t) ((pos < end ? pos : end) - alt));
+			Braces braces;
+			const char *word;
+			bool nested = start_braces(&braces, text, escape);
+
+			while (NULL != (word = nested ? next_brace(&braces) : text)) {
+				if (group->count + 1 >= cap) {
+					cap *= 2;
+					if (!(group->words = realloc(group->words, cap * sizeof(*group->words)))) {
+						perror("realloc");
+						exit(EXIT_FAILURE);
+					}
+				}
+				group->words[group->count++] = copy(word, strlen(word));
+				if (!nested) {
+					break;
+				}
+			}
+			if (nested) {
+				end_braces(&braces);
+			}
+			free(text);
+			if (pos >= end) {
+				break;
+			}
+			alt = pos + 1;
+		} else if ('{' == *pos) {
+			depth++;
+		} else if ('}' == *pos) {
+			depth--;
+		}
+	}
+	group->words[group->count] = NULL;
+	return true;
+}
+
+/* Sets up the brace expansion of a word, which must outlive it. Returns
+ * false if there's nothing to expand. Letters that expansion would
+ * otherwise interpret, such as \ in {Z..a}, are escaped if asked to. */
+bool start_braces(Braces *braces, const char *word, bool escape) {
+	const char *src = word, *text = word;
+	size_t cap = 0;
+
+	memset(braces, 0, sizeof(*braces));
+	braces->escape = escape;
+
+	while (*src) {
+		BraceGroup *group;
+		const char *close;
+
+		if ('{' != *src) {
+			src = strchr("\\'\"$", *src) ? skip_quoted(src) : src + 1;
+			continue;
+		}
+		close = find_close(src);
+		if (!*close) {
+			break;
+		}
+		if (braces->num_groups == cap) {
+			cap = cap ? cap * 2 : 2;
+			if (!(braces->groups = realloc(braces->groups, cap * sizeof(*braces->groups)))) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		group = &braces->groups[braces->num_groups];
+		memset(group, 0, sizeof(*group));
+		if (!parse_sequence(group, src + 1, close) &&
+				!parse_list(group, src + 1, close, escape)) {
+			/* Just a brace; braces within it may still be expanded */
+			src++;
+			continue;
+		}
+		group->text = text;
+		group->text_len = (size_t) (src - text);
+		braces->num_groups++;
+		text = src = close + 1;
+	}
+	braces->rest = text;
+
+	if (0 == braces->num_groups) {
+		free(braces->groups);
+		return false;
+	}
+	return true;
+}
+
+static void append(Braces *braces, size_t *len, const char *src, size_t n) {
+	if (*len + n + 1 > braces->cap) {
+		while (*len + n + 1 > braces->cap) {
+			braces->cap = braces->cap ? braces->cap * 2 : 64;
+		}
+		if (!(braces->word = realloc(braces->word, braces->cap))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(braces->word + *len, src, n);
+	*len += n;
+	braces->word[*len] = 0;
+}
+
+/* Returns the next word, valid until the following call, or NULL */
+const char *next_brace(Braces *braces) {
+	size_t len = 0, i;
+
+	if (braces->done) {
+		return NULL;
+	}
+	for (i = 0; i < braces->num_groups; i++) {
+		BraceGroup *group = &braces->groups[i];
+		char value[32];
+		long n = group->first + (long) group->index * group->step;
+
+		append(braces, &len, group->text, group->text_len);
+		if (group->words) {
+			append(braces, &len, group->words[group->index], strlen(group->words[group->index]));
+		} else if (group->letters) {
+			if (braces->escape && !isalnum((unsigned char) n)) {
+				append(braces, &len, "\\", 1);
+			}
+			value[0] = (char) n;
+			append(braces, &len, value, 1);
+		} else {
+			sprintf(value, "%0*ld", group->width, n);
+			append(braces, &len, value, strlen(value));
+		}
+	}
+	append(braces, &len, braces->rest, strlen(braces->rest));
+
+	/* Move on to the next word, the last group changing the fastest */
+	for (i = braces->num_groups; 0 < i; i--) {
+		BraceGroup *group = &braces->groups[i - 1];
+		if (++group->index < group->count) {
+			break;
+		}
+		group->index = 0;
+	}
+	braces->done = 0 == i;
+	return braces->word;
+}
+
+void end_braces(Braces *braces) {
+	size_t i, j;
+
+	for (i = 0; i < braces->num_groups; i++) {
+		char **words = braces->groups[i].words;
+		for (j = 0; words && words[j]; j++) {
+			free(words[j]);
+		}
+		free(words);
+	}
+	free(braces->groups);
+	free(braces->word);
+}
@@ -0,0 +1,441 @@
+/* For O_PATH and O_DIRECTORY */
+#define _GNU_SOURCE
+#include "main.h"
+
+/*
+ * Changing directories: cd, cd -, pushd, popd and dirs.
+ *
+ * The directories to go back to, the previous one and those on the
+ * stack, are kept as O_PATH descriptors rather than paths. Going back is
+ * a single fchdir, which gets there even if the directory has been
+ * renamed or its path has grown too long to resolve.
+ *
+ * The directories the shell has been in are ranked by frecency, how
+ * often and how lately they were visited, in a file in the cache
+ * directory that all shells share through mmap. The main loop notes the
+ * working directory before each prompt, and cd with a name that isn't a
+ * directory goes to the best ranked one whose path contains it.
+ */
+
+#define DIR_DB "dirs.smd"
+#define DIR_MAGIC "SMSHDIR1"
+#define DIR_SLOTS (1024)
+/* Longer paths aren't ranked */
+#define DIR_LEN (500)
+/* When the ranks add up to more than this they all fade, and the
+ * directories that fade below 1 are forgotten */
+#define DIR_AGING (5000.0)
+
+/* A directory to go back to */
+typedef struct {
+	int fd; /* O_PATH, or -1 */
+	char *path; /* Where it was, for when /proc isn't there */
+} Dir;
+
+typedef struct {
+	double rank; /* Visits, faded by aging */
+	int64_t last; /* Time of the last visit */
+	char path[DIR_LEN];
+} DirRank;
+
+/* The file of ranks, with the used slots first */
+typedef struct {
+	char magic[8];
+	uint32_t count;
+	uint32_t unused;
+	DirRank dirs[DIR_SLOTS];
+} DirDb;
+
+static Dir previous = { -1, NULL };
+static Dir *stack = NULL;
+static size_t stack_len = 0, stack_cap = 0;
+
+static DirDb *db = NULL;
+static int db_fd = -1;
+static bool db_failed = false;
+static char *last_noted = NULL;
+
+/* The working directory, to be freed, or NULL */
+static char *current_dir(void) {
+	size_t size = 256;
+	char *buf = NULL;
+
+	for (;;) {
+		if (!(buf = realloc(buf, size))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		if (getcwd(buf, size)) {
+			return buf;
+		}
+		if (ERANGE != errno) {
+			free(buf);
+			return NULL;
+		}
+		size *= 2;
+	}
+}
+
+static void close_dir(Dir *dir) {
+	if (-1 != dir->fd) {
+		close(dir->fd);
+	}
+	free(dir->path);
+	dir->fd = -1;
+	dir->path = NULL;
+}
+
+/* Where the directory is now, to be freed. Its path is looked up from
+ * the descriptor, which follows renames. */
+static char *dir_path(const Dir *dir) {
+	char link[64], *path;
+	size_t size = 256;
+	ssize_t n;
+
+	sprintf(link, "/proc/self/fd/%d", dir->fd);
+	for (;;) {
+		if (!(path = malloc(size))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		if (-1 == (n = readlink(link, path, size)) || (size_t) n < size) {
+			break;
+		}
+		free(path);
+		size *= 2;
+	}
+	if (-1 == n) {
+		free(path);
+		if (!(path = strdup(dir->path ? dir->path : "?"))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		return path;
+	}
+	path[n] = 0;
+	return path;
+}
+
+/* Prints the path with $HOME as ~, followed by end */
+static void print_path(char *path, const char *end) {
+	substitute_home(path);
+	printf("%s%s", path, end);
+}
+
+/* Changes to the directory at path, or else the descriptor, keeping the
+ * one left as the previous. Returns false with errno set if it failed. */
+static bool enter(const char *path, int fd) {
+	Dir here;
+	int error;
+
+	here.fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	here.path = current_dir();
+	if (-1 == (path ? chdir(path) : fchdir(fd))) {
+		error = errno;
+		close_dir(&here);
+		errno = error;
+		return false;
+	}
+	close_dir(&previous);
+	previous = here;
+	return true;
+}
+
+/* Maps the file of ranks, creating it if this is the first shell */
+static bool open_db(void) {
+	char path[1100];
+	struct stat st;
+	void *map;
+
+	if (db) {
+		return true;
+	}
+	if (db_failed || !cache_file(DIR_DB, path, sizeof(path)) ||
+			-1 == (db_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600))) {
+		db_failed = true;
+		return false;
+	}
+	while (-1 == flock(db_fd, LOCK_EX) && EINTR == errno);
+	if (-1 == fstat(db_fd, &st) ||
+			((size_t) st.st_size < sizeof(*db) && -1 == ftruncate(db_fd, sizeof(*db))) ||
+			MAP_FAILED == (map = mmap(NULL, sizeof(*db), PROT_READ | PROT_WRITE, MAP_SHARED, db_fd, 0))) {
+		close(db_fd);
+		db_fd = -1;
+		db_failed = true;
+		return false;
+	}
+	db = map;
+	if (0 != memcmp(db->magic, DIR_MAGIC, 8) || db->count > DIR_SLOTS) {
+		/* New, or from another version */
+		memset(db, 0, sizeof(*db));
+		memcpy(db->magic, DIR_MAGIC, 8);
+	}
+	flock(db_fd, LOCK_UN);
+	return true;
+}
+
+static double frecency(const DirRank *dir, int64_t now) {
+	int64_t age = now - dir->last;
+	return dir->rank * (age < 3600 ? 4 : age < 86400 ? 2 : age < 604800 ? 0.5 : 0.25);
+}
+
+static void forget(uint32_t i) {
+	db->dirs[i] = db->dirs[--db->count];
+}
+
+/* Ranks the working directory up if it's another than last time. Called
+ * from the main loop before each prompt. */
+void note_cwd(void) {
+	char *cwd = current_dir();
+	const char *home = get_var("HOME");
+	int64_t now = (int64_t) time(NULL);
+	double total = 0;
+	DirRank *dir = NULL;
+	uint32_t i;
+
+	if (!cwd || (last_noted && 0 == strcmp(cwd, last_noted))) {
+		free(cwd);
+		return;
+	}
+	free(last_noted);
+	last_noted = cwd;
+	/* Home is a plain cd away anyway */
+	if (strlen(cwd) >= DIR_LEN || (home && 0 == strcmp(cwd, home)) || !open_db()) {
+		return;
+	}
+
+	while (-1 == flock(db_fd, LOCK_EX) && EINTR == errno);
+	for (i = 0; i < db->count; i++) {
+		if (0 == strcmp(db->dirs[i].path, cwd)) {
+			dir = &db->dirs[i];
+		}
+		total += db->dirs[i].rank;
+	}
+	if (!dir) {
+		if (DIR_SLOTS == db->count) {
+			/* Replace the one ranked lowest */
+			dir = &db->dirs[0];
+			for (i = 1; i < db->count; i++) {
+				if (frecency(&db->dirs[i], now) < frecency(dir, now)) {
+					dir = &db->dirs[i];
+				}
+			}
+		} else {
+			dir = &db->dirs[db->count++];
+		}
+		dir->rank = 0;
+		strcpy(dir->path, cwd);
+	}
+	dir->rank++;
+	dir->last = now;
+	if (total + 1 > DIR_AGING) {
+		for (i = db->count; i-- > 0;) {
+			if ((db->dirs[i].rank *= 0.9) < 1) {
+				forget(i);
+			}
+		}
+	}
+	flock(db_fd, LOCK_UN);
+}
+
+/* The best ranked directory, other than the working one, with the name
+ * in its path, to be freed, or NULL. Those with it in their last part
+ * come first. */
+static char *best_dir(const char *name) {
+	int64_t now = (int64_t) time(NULL);
+	double best_score = 0;
+	bool best_last = false;
+	char *best = NULL;
+	uint32_t i;
+
+	if (!open_db()) {
+		return NULL;
+	}
+	while (-1 == flock(db_fd, LOCK_SH) && EINTR == errno);
+	for (i = 0; i < db->count; i++) {
+		const char *path = db->dirs[i].path, *match = strstr(path, name);
+		double score;
+		bool last;
+
+		if (!match || (last_noted && 0 == strcmp(path, last_noted))) {
+			continue;
+		}
+		last = !strchr(match + strlen(name), '/') && !strchr(name, '/');
+		score = frecency(&db->dirs[i], now);
+		if (!best || (last && !best_last) || (last == best_last && score > best_score)) {
+			free(best);
+			if (!(best = strdup(path))) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+			best_score = score;
+			best_last = last;
+		}
+	}
+	flock(db_fd, LOCK_UN);
+	return best;
+}
+
+/* Forgets a ranked directory that's gone */
+static void forget_dir(const char *path) {
+	uint32_t i;
+
+	while (-1 == flock(db_fd, LOCK_EX) && EINTR == errno);
+	for (i = 0; i < db->count; i++) {
+		if (0 == strcmp(db->dirs[i].path, path)) {
+			forget(i);
+			break;
+		}
+	}
+	flock(db_fd, LOCK_UN);
+}
+
+/* Goes to the best ranked directory matching name, printing it */
+static bool jump(const char *name) {
+	char *path;
+
+	while (NULL != (path = best_dir(name))) {
+		if (enter(path, -1)) {
+			print_path(path, "\n");
+			free(path);
+			return true;
+		}
+		forget_dir(path);
+		free(path);
+	}
+	return false;
+}
+
+/* The built-in cd command. "cd -" goes back to the previous directory,
+ * and a name that isn't a directory to the best ranked one with it. */
+int cd_cmd(char **args) {
+	const char *home = get_var("HOME"), *arg = args[1];
+	char *dir = NULL, *path;
+	int error;
+
+	if (arg && args[2]) {
+		/* 2 (or more) arguments given. */
+		fprintf(stderr, "cd: only one argument is supported.\n");
+		return EXIT_FAILURE;
+	}
+	if ((!arg || '~' == arg[0]) && !home) {
+		fprintf(stderr, "cd: HOME not set\n");
+		return EXIT_FAILURE;
+	}
+
+	if (arg && 0 == strcmp(arg, "-")) {
+		if (-1 == previous.fd) {
+			fprintf(stderr, "cd: no previous directory\n");
+			return EXIT_FAILURE;
+		}
+		if (!enter(NULL, previous.fd)) {
+			perror("cd");
+			return EXIT_FAILURE;
+		}
+		if (NULL != (path = current_dir())) {
+			print_path(path, "\n");
+			free(path);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (!arg) {
+		arg = home;
+	} else if ('~' == arg[0]) {
+		/* Substitute ~ with $HOME */
+		if (!(dir = malloc(strlen(home) + strlen(arg)))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		sprintf(dir, "%s%s", home, arg + 1);
+		arg = dir;
+	}
+	if (enter(arg, -1)) {
+		free(dir);
+		return EXIT_SUCCESS;
+	}
+	error = errno;
+	if (ENOENT == error && !dir && '.' != arg[0] && '/' != arg[0] && jump(arg)) {
+		return EXIT_SUCCESS;
+	}
+	errno = error;
+	perror("cd");
+	free(dir);
+	return EXIT_FAILURE;
+}
+
+/* The built-in dirs command, listing the working directory and then
+ * the stack from the top */
+int dirs_cmd(char **args) {
+	char *path;
+	size_t i;
+
+	(void) args; /* Workaround for unused variable */
+	if (NULL != (path = current_dir())) {
+		print_path(path, stack_len ? " " : "\n");
+		free(path);
+	}
+	for (i = stack_len; i-- > 0;) {
+		path = dir_path(&stack[i]);
+		print_path(path, i ? " " : "\n");
+		free(path);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* The built-in pushd command. "pushd dir" puts the working directory on
+ * the stack and goes to dir, and plain "pushd" swaps the two. */
+int pushd_cmd(char **args) {
+	Dir here;
+
+	if (args[1] && args[2]) {
+		fprintf(stderr, "pushd: only one argument is supported.\n");
+		return EXIT_FAILURE;
+	}
+	if (!args[1] && !stack_len) {
+		fprintf(stderr, "pushd: no other directory\n");
+		return EXIT_FAILURE;
+	}
+	if (-1 == (here.fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC))) {
+		perror("pushd");
+		return EXIT_FAILURE;
+	}
+	here.path = current_dir();
+	if (!(args[1] ? enter(args[1], -1) : enter(NULL, stack[stack_len - 1].fd))) {
+		perror("pushd");
+		close_dir(&here);
+		return EXIT_FAILURE;
+	}
+	if (args[1]) {
+		if (stack_len == stack_cap) {
+			stack_cap = stack_cap ? 2 * stack_cap : 8;
+			if (!(stack = realloc(stack, stack_cap * sizeof(*stack)))) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		stack_len++;
+	} else {
+		close_dir(&stack[stack_len - 1]);
+	}
+	stack[stack_len - 1] = here;
+	return dirs_cmd(args);
+}
+
+/* The built-in popd command, going back to the top of the stack */
+int popd_cmd(char **args) {
+	if (args[1]) {
+		fprintf(stderr, "popd: no arguments are supported.\n");
+		return EXIT_FAILURE;
+	}
+	if (!stack_len) {
+		fprintf(stderr, "popd: directory stack empty\n");
+		return EXIT_FAILURE;
+	}
+	if (!enter(NULL, stack[stack_len - 1].fd)) {
+		perror("popd");
+		return EXIT_FAILURE;
+	}
+	close_dir(&stack[--stack_len]);
+	return dirs_cmd(args);
+}
@@ -0,0 +1,768 @@
+#include "main.h"
+#include <dirent.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#if READLINE
+#include <readline/readline.h>
+#include <readline/history.h>
+#endif
+
+/*
+ * Reading command lines, with either GNU readline or the shell's own
+ * line editor.
+ *
+ * The built-in editor covers what's used day to day: the emacs bindings
+ * for moving and killing, history with the arrows or C-p and C-n, and
+ * completion with Tab. It redraws a single line, scrolling it sideways
+ * when it's wider than the terminal. Without readline linked in, the
+ * shell starts faster and is smaller, and so is every fork of it.
+ *
+ * Building with "make READLINE=" leaves readline out. A shell built with
+ * it uses the built-in editor when started with --builtin-editor.
+ *
+ * Either way, the hook given to init_editor is called about ten times a
+ * second while waiting for a key, and the completer first gets to
+ * complete the word at the cursor, before file names are tried.
+ */
+
+#define HISTORY_MAX (1000)
+/* How long to wait for a key before calling the hook, in ms */
+#define HOOK_INTERVAL (100)
+
+#define CONTROL(c) ((c) & 0x1f)
+#define KEY_ESC (27)
+#define KEY_DEL (127)
+
+/* Characters that end the word being completed */
+#define WORD_BREAKS " \t\n\"'`<>=;|&(){}"
+
+#if READLINE
+static bool builtin_editor = true;
+#endif
+static int (*idle_hook)(void) = NULL;
+static Completer *completer = NULL;
+
+/* The line being edited, and where the cursor is in it */
+static char *line = NULL;
+static size_t line_len = 0, line_cap = 0, cursor = 0;
+static const char *current_prompt = "";
+static char *killed = NULL;
+static char *history[HISTORY_MAX];
+static size_t history_len = 0;
+static struct termios cooked;
+static bool raw = false;
+
+void add_completion(Completions *c, const char *name) {
+	if (c->num + 1 >= c->cap) {
+		c->cap = c->cap ? 2 * c->cap : 16;
+		if (!(c->names = realloc(c->names, c->cap * sizeof(*c->names)))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!(c->names[c->num++] = strdup(name))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	c->names[c->num] = NULL;
+}
+
+static void free_completions(Completions *c) {
+	size_t i;
+	for (i = 0; i < c->num; i++) {
+		free(c->names[i]);
+	}
+	free(c->names);
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Sorts the names, dropping duplicates, and returns the length of the
+ * prefix they have in common */
+static size_t sort_completions(Completions *c) {
+	size_t i, n = 0, common;
+
+	if (!c->num) {
+		return 0;
+	}
+	qsort(c->names, c->num, sizeof(*c->names), &compare_names);
+	for (i = 0; i < c->num; i++) {
+		if (n && 0 == strcmp(c->names[n - 1], c->names[i])) {
+			free(c->names[i]);
+		} else {
+			c->names[n++] = c->names[i];
+		}
+	}
+	c->num = n;
+	c->names[n] = NULL;
+	/* Sorted, the first and last differ the earliest */
+	for (common = 0; c->names[0][common] && c->names[0][common] == c->names[n - 1][common]; common++);
+	return common;
+}
+
+/* Completes the word at the cursor, which is from start to end of the
+ * line. Runs the completer, and falls back to the names of files. */
+static void complete(const char *text, size_t start, size_t end, Completions *c) {
+	char *word, dir[1100];
+	const char *base, *slash;
+	struct dirent *entry;
+	DIR *d;
+
+	if (completer && completer(text, start, end, c)) {
+		return;
+	}
+	if (!(word = malloc(end - start + 1))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(word, text + start, end - start);
+	word[end - start] = 0;
+	slash = strrchr(word, '/');
+	base = slash ? slash + 1 : word;
+	if (!slash) {
+		strcpy(dir, ".");
+	} else if ('~' == word[0] && slash == word + 1) {
+		snprintf(dir, sizeof(dir), "%s/", getenv("HOME") ? getenv("HOME") : "");
+	} else {
+		snprintf(dir, sizeof(dir), "%.*s", slash == word ? 1 : (int) (slash - word), word);
+	}
+
+	if (NULL != (d = opendir(dir))) {
+		while (NULL != (entry = readdir(d))) {
+			char name[1100], path[2200];
+			struct stat st;
+
+			if (0 != strncmp(entry->d_name, base, strlen(base)) ||
+					('.' == entry->d_name[0] && '.' != base[0]) ||
+					0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, "..")) {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+			/* Directories end in a slash, to carry on into them */
+			snprintf(name, sizeof(name), "%.*s%s%s", (int) (base - word), word, entry->d_name,
+				0 == stat(path, &st) && S_ISDIR(st.st_mode) ? "/" : "");
+			add_completion(c, name);
+		}
+		closedir(d);
+	}
+	free(word);
+}
+
+/* Where the word that ends at the cursor starts */
+static size_t word_start(const char *text, size_t end) {
+	size_t start = end;
+	while (start > 0 && !strchr(WORD_BREAKS, text[start - 1])) {
+		start--;
+	}
+	return start;
+}
+
+/* The built-in editor */
+
+static void output(const char *s, size_t len) {
+	while (len) {
+		ssize_t n = write(STDOUT_FILENO, s, len);
+		if (-1 == n) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return;
+		}
+		s += n;
+		len -= (size_t) n;
+	}
+}
+
+static void puts_out(const char *s) {
+	output(s, strlen(s));
+}
+
+/* Columns taken by text, counting UTF-8 sequences as one each. What's
+ * between \001 and \002 in a prompt takes none, as with readline. */
+static size_t columns(const char *s, size_t len) {
+	size_t i, n = 0;
+	bool hidden = false;
+	for (i = 0; i < len; i++) {
+		if ('\001' == s[i] || '\002' == s[i]) {
+			hidden = '\001' == s[i];
+		} else if (!hidden) {
+			n += 0x80 != ((unsigned char) s[i] & 0xc0);
+		}
+	}
+	return n;
+}
+
+/* Writes the prompt without its \001 and \002 markers */
+static void put_prompt(const char *s) {
+	size_t len;
+	while (*s) {
+		len = strcspn(s, "\001\002");
+		output(s, len);
+		s += len;
+		if (*s) {
+			s++;
+		}
+	}
+}
+
+static size_t terminal_width(void) {
+	struct winsize ws;
+	return 0 == ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_col > 0 ? ws.ws_col : 80;
+}
+
+static bool enter_raw(void) {
+	struct termios t;
+
+	if (raw) {
+		/* Still, after jumping back to the prompt from a signal */
+		return true;
+	}
+	if (-1 == tcgetattr(STDIN_FILENO, &cooked)) {
+		return false;
+	}
+	t = cooked;
+	/* Keys come one at a time and unechoed. Ctrl-C still signals, and
+	 * output is still processed, so what's printed meanwhile is fine. */
+	t.c_iflag &= ~(tcflag_t) (ICRNL | INLCR | IXON);
+	t.c_lflag &= ~(tcflag_t) (ICANON | ECHO | IEXTEN);
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	if (-1 == tcsetattr(STDIN_FILENO, TCSADRAIN, &t)) {
+		return false;
+	}
+	raw = true;
+	return true;
+}
+
+static void leave_raw(void) {
+	if (raw) {
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+		raw = false;
+	}
+}
+
+static size_t char_left(size_t);
+
+/* Redraws the prompt and line, scrolled so that the cursor shows */
+static void refresh(void) {
+	size_t width = terminal_width(), prompt_cols = columns(current_prompt, strlen(current_prompt));
+	size_t room = width > prompt_cols + 1 ? width - prompt_cols - 1 : 1;
+	size_t from = 0, to = line_len, cols;
+	char move[32];
+
+	while (columns(line + from, cursor - from) > room) {
+		from++;
+	}
+	while (0x80 == ((unsigned char) line[from] & 0xc0)) {
+		from++;
+	}
+	while (columns(line + from, to - from) > room) {
+		to = char_left(to);
+	}
+	puts_out("\r");
+	put_prompt(current_prompt);
+	output(line + from, to - from);
+	/* Clear what's left of the old line, and put the cursor in place */
+	puts_out("\x1b[K\r");
+	cols = prompt_cols + columns(line + from, cursor - from);
+	if (cols) {
+		sprintf(move, "\x1b[%luC", (unsigned long) cols);
+		puts_out(move);
+	}
+}
+
+static void reserve(size_t len) {
+	if (len + 1 > line_cap) {
+		while (len + 1 > line_cap) {
+			line_cap = line_cap ? 2 * line_cap : 256;
+		}
+		if (!(line = realloc(line, line_cap))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void insert(const char *s, size_t len) {
+	reserve(line_len + len);
+	memmove(line + cursor + len, line + cursor, line_len - cursor + 1);
+	memcpy(line + cursor, s, len);
+	line_len += len;
+	cursor += len;
+}
+
+/* Removes from..to, keeping it for C-y if kill is set */
+static void cut(size_t from, size_t to, bool kill) {
+	if (from >= to) {
+		return;
+	}
+	if (kill) {
+		free(killed);
+		if ((killed = malloc(to - from + 1))) {
+			memcpy(killed, line + from, to - from);
+			killed[to - from] = 0;
+		}
+	}
+	memmove(line + from, line + to, line_len - to + 1);
+	line_len -= to - from;
+	cursor = from;
+}
+
+static void set_line(const char *s) {
+	line_len = cursor = 0;
+	reserve(0);
+	line[0] = 0;
+	insert(s, strlen(s));
+}
+
+/* Moves over one character, which may take several bytes */
+static size_t char_left(size_t pos) {
+	if (pos > 0) {
+		for (pos--; pos > 0 && 0x80 == ((unsigned char) line[pos] & 0xc0); pos--);
+	}
+	return pos;
+}
+
+static size_t char_right(size_t pos) {
+	if (pos < line_len) {
+		for (pos++; pos < line_len && 0x80 == ((unsigned char) line[pos] & 0xc0); pos++);
+	}
+	return pos;
+}
+
+static size_t word_left(size_t pos) {
+	while (pos > 0 && !isalnum((unsigned char) line[pos - 1])) {
+		pos--;
+	}
+	while (pos > 0 && isalnum((unsigned char) line[pos - 1])) {
+		pos--;
+	}
+	return pos;
+}
+
+static size_t word_right(size_t pos) {
+	while (pos < line_len && !isalnum((unsigned char) line[pos])) {
+		pos++;
+	}
+	while (pos < line_len && isalnum((unsigned char) line[pos])) {
+		pos++;
+	}
+	return pos;
+}
+
+/* Reads a key, calling the hook while there's none. Returns -1 at EOF. */
+static int read_key(void) {
+	unsigned char c;
+	ssize_t n;
+
+	for (;;) {
+		if (idle_hook) {
+			struct pollfd pfd;
+			pfd.fd = STDIN_FILENO;
+			pfd.events = POLLIN;
+			if (0 == poll(&pfd, 1, HOOK_INTERVAL)) {
+				idle_hook();
+				continue;
+			}
+		}
+		if (1 == (n = read(STDIN_FILENO, &c, 1))) {
+			return c;
+		}
+		if (-1 == n && EINTR == errno) {
+			continue;
+		}
+		return -1;
+	}
+}
+
+/* Reads the rest of an escape sequence, returning its final character
+ * and the number in it, as in KEY_ESC [ 3 ~ */
+static int read_escape(int *number) {
+	int c = read_key();
+
+	*number = 0;
+	if ('[' != c && 'O' != c) {
+		/* Meta, as KEY_ESC followed by the key */
+		return -1 == c ? c : 0x100 | c;
+	}
+	while (-1 != (c = read_key()) && (isdigit(c) || ';' == c)) {
+		*number = ';' == c ? 0 : *number * 10 + (c - '0');
+	}
+	return c;
+}
+
+/* Shows the completions under the line, and the line again */
+static void list_completions(Completions *c) {
+	size_t width = terminal_width(), longest = 0, per_line, i;
+
+	for (i = 0; i < c->num; i++) {
+		size_t cols = columns(c->names[i], strlen(c->names[i]));
+		longest = cols > longest ? cols : longest;
+	}
+	per_line = width / (longest + 2) ? width / (longest + 2) : 1;
+	puts_out("\r\n");
+	for (i = 0; i < c->num; i++) {
+		const char *name = strrchr(c->names[i], '/') && '/' != c->names[i][strlen(c->names[i]) - 1] ?
+			strrchr(c->names[i], '/') + 1 : c->names[i];
+		size_t pad = longest + 2 - columns(name, strlen(name));
+		puts_out(name);
+		while (pad-- && (i + 1) % per_line && i + 1 < c->num) {
+			puts_out(" ");
+		}
+		if (0 == (i + 1) % per_line || i + 1 == c->num) {
+			puts_out("\r\n");
+		}
+	}
+}
+
+/* Tab: completes the word before the cursor as far as it's the same in
+ * all completions. A second Tab lists them. */
+static void tab(bool again) {
+	size_t start = word_start(line, cursor), common;
+	Completions c = { NULL, 0, 0 };
+
+	complete(line, start, cursor, &c);
+	common = sort_completions(&c);
+	if (1 == c.num) {
+		cut(start, cursor, false);
+		insert(c.names[0], strlen(c.names[0]));
+		if (common && '/' != c.names[0][common - 1] && (cursor == line_len || ' ' != line[cursor])) {
+			insert(" ", 1);
+		}
+	} else if (common > cursor - start) {
+		cut(start, cursor, false);
+		insert(c.names[0], common);
+	} else if (again && c.num) {
+		list_completions(&c);
+	} else {
+		puts_out("\a");
+	}
+	free_completions(&c);
+}
+
+/* Edits a line at the terminal, returning it, or NULL on EOF */
+static char *edit_tty(void) {
+	size_t browsing = history_len;
+	char *typed = NULL;
+	int key, last = 0;
+
+	set_line("");
+	refresh();
+	for (;; last = key) {
+		int n;
+
+		if (-1 == (key = read_key())) {
+			leave_raw();
+			puts_out("\r\n");
+			free(typed);
+			return NULL;
+		}
+		if (KEY_ESC == key) {
+			switch (key = read_escape(&n)) {
+				case 'A': key = CONTROL('p'); break;
+				case 'B': key = CONTROL('n'); break;
+				case 'C': key = 5 == n ? 0x100 | 'f' : CONTROL('f'); break;
+				case 'D': key = 5 == n ? 0x100 | 'b' : CONTROL('b'); break;
+				case 'H': key = CONTROL('a'); break;
+				case 'F': key = CONTROL('e'); break;
+				case '~':
+					key = 1 == n || 7 == n ? CONTROL('a') : 4 == n || 8 == n ? CONTROL('e') :
+						3 == n ? 0x100 | CONTROL('d') : 0;
+					break;
+			}
+		}
+
+		switch (key) {
+			case '\r':
+			case '\n':
+				cursor = line_len;
+				refresh();
+				puts_out("\r\n");
+				free(typed);
+				return strdup(line);
+			case CONTROL('d'):
+				if (!line_len) {
+					leave_raw();
+					puts_out("\r\n");
+					free(typed);
+					return NULL;
+				}
+				/* Fall through */
+			case 0x100 | CONTROL('d'):
+				cut(cursor, char_right(cursor), false);
+				break;
+			case CONTROL('h'):
+			case KEY_DEL:
+				cut(char_left(cursor), cursor, false);
+				break;
+			case CONTROL('a'):
+				cursor = 0;
+				break;
+			case CONTROL('e'):
+				cursor = line_len;
+				break;
+			case CONTROL('b'):
+				cursor = char_left(cursor);
+				break;
+			case CONTROL('f'):
+				cursor = char_right(cursor);
+				break;
+			case 0x100 | 'b':
+				cursor = word_left(cursor);
+				break;
+			case 0x100 | 'f':
+				cursor = word_right(cursor);
+				break;
+			case CONTROL('k'):
+				cut(cursor, line_len, true);
+				break;
+			case CONTROL('u'):
+				cut(0, cursor, true);
+				break;
+			case CONTROL('w'):
+				n = (int) cursor;
+				while (n > 0 && isspace((unsigned char) line[n - 1])) {
+					n--;
+				}
+				while (n > 0 && !isspace((unsigned char) line[n - 1])) {
+					n--;
+				}
+				cut((size_t) n, cursor, true);
+				break;
+			case 0x100 | 'd':
+				cut(cursor, word_right(cursor), true);
+				break;
+			case 0x100 | KEY_DEL:
+				cut(word_left(cursor), cursor, true);
+				break;
+			case CONTROL('y'):
+				if (killed) {
+					insert(killed, strlen(killed));
+				}
+				break;
+			case CONTROL('t'):
+				if (cursor > 0 && line_len > 1) {
+					char c;
+					if (cursor == line_len) {
+						cursor--;
+					}
+					c = line[cursor - 1];
+					line[cursor - 1] = line[cursor];
+					line[cursor] = c;
+					cursor++;
+				}
+				break;
+			case CONTROL('l'):
+				puts_out("\x1b[H\x1b[2J");
+				break;
+			case CONTROL('p'):
+			case CONTROL('n'):
+				if (CONTROL('p') == key ? 0 == browsing : browsing == history_len) {
+					break;
+				}
+				if (browsing == history_len) {
+					/* Keep what was being typed, to come back to */
+					free(typed);
+					typed = strdup(line);
+				}
+				if (CONTROL('p') == key) {
+					browsing--;
+				} else {
+					browsing++;
+				}
+				set_line(browsing < history_len ? history[browsing] : typed ? typed : "");
+				break;
+			case '\t':
+				tab('\t' == last);
+				break;
+			default:
+				if (key >= ' ' && key < 0x100) {
+					char c[4];
+					int len = 1, more = key >= 0xf0 ? 3 : key >= 0xe0 ? 2 : key >= 0xc0 ? 1 : 0;
+					/* The rest of a UTF-8 character comes along, so it's
+					 * never shown in part */
+					c[0] = (char) key;
+					while (more-- && 0x80 == ((n = read_key()) & 0xc0)) {
+						c[len++] = (char) n;
+					}
+					insert(c, (size_t) len);
+				}
+		}
+		refresh();
+	}
+}
+
+/* Reads a line from input that isn't a terminal. It's read a byte at a
+ * time, leaving the rest to the commands, and echoed after the prompt
+ * as readline does. */
+static char *edit_pipe(void) {
+	char c;
+	ssize_t n;
+
+	line_len = cursor = 0;
+	reserve(0);
+	for (;;) {
+		while (-1 == (n = read(STDIN_FILENO, &c, 1)) && EINTR == errno);
+		if (1 != n || '\n' == c) {
+			break;
+		}
+		insert(&c, 1);
+	}
+	line[line_len] = 0;
+	if (1 != n && !line_len) {
+		return NULL;
+	}
+	puts_out(line);
+	puts_out("\n");
+	return strdup(line);
+}
+
+#if READLINE
+static char **readline_completion(const char *text, int start, int end) {
+	Completions c = { NULL, 0, 0 };
+	char **matches;
+	size_t common;
+
+	(void) text;
+	if (!completer || !completer(rl_line_buffer, (size_t) start, (size_t) end, &c)) {
+		/* Readline completes file names */
+		return NULL;
+	}
+	rl_attempted_completion_over = 1;
+	if (!c.num) {
+		free_completions(&c);
+		return NULL;
+	}
+	/* Readline wants what to replace the word with, then the matches */
+	common = sort_completions(&c);
+	if (!(matches = malloc((c.num + 2) * sizeof(*matches))) || !(matches[0] = malloc(common + 1))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(matches[0], c.names[0], common);
+	matches[0][common] = 0;
+	memcpy(matches + 1, c.names, (c.num + 1) * sizeof(*matches));
+	if (1 == c.num) {
+		free(matches[0]);
+		matches[0] = matches[1];
+		matches[1] = NULL;
+	}
+	free(c.names);
+	return matches;
+}
+#endif
+
+/* Picks the editor, and sets up the hook called while waiting for keys
+ * and the completer, either of which may be NULL */
+void init_editor(bool use_readline, int (*hook)(void), Completer *complete_word) {
+#if READLINE
+	builtin_editor = !use_readline;
+	if (!builtin_editor) {
+		rl_event_hook = hook;
+		rl_attempted_completion_function = &readline_completion;
+	}
+#else
+	(void) use_readline;
+#endif
+	idle_hook = hook;
+	completer = complete_word;
+}
+
+/* Reads a line with the prompt, returning it to be freed, or NULL on EOF */
+char *edit_line(const char *prompt) {
+	char *result;
+
+#if READLINE
+	if (!builtin_editor) {
+		return readline(prompt);
+	}
+#endif
+	current_prompt = prompt;
+	fflush(stdout);
+	if (!isatty(STDIN_FILENO) || !enter_raw()) {
+		put_prompt(prompt);
+		return edit_pipe();
+	}
+	result = edit_tty();
+	leave_raw();
+	current_prompt = "";
+	return result;
+}
+
+/* Shows another prompt in place of the one being edited at */
+void set_prompt(const char *prompt) {
+#if READLINE
+	if (!builtin_editor) {
+		rl_set_prompt(prompt);
+		rl_forced_update_display();
+		return;
+	}
+#endif
+	if (raw) {
+		current_prompt = prompt;
+		refresh();
+	}
+}
+
+/* Adds a line to the history */
+void remember_line(const char *text) {
+#if READLINE
+	if (!builtin_editor) {
+		add_history(text);
+		return;
+	}
+#endif
+	if (history_len && 0 == strcmp(history[history_len - 1], text)) {
+		return;
+	}
+	if (HISTORY_MAX == history_len) {
+		free(history[0]);
+		memmove(history, history + 1, (HISTORY_MAX - 1) * sizeof(*history));
+		history_len--;
+	}
+	if (!(history[history_len] = strdup(text))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	history_len++;
+}
+
+/* What's been typed so far, while waiting for a key */
+const char *edited_line(void) {
+#if READLINE
+	if (!builtin_editor) {
+		return rl_line_buffer ? rl_line_buffer : "";
+	}
+#endif
+	return line ? line : "";
+}
+
+/* Moves off the prompt to a line of its own, with the terminal as
+ * commands expect it, to run something from the hook */
+void leave_prompt(void) {
+#if READLINE
+	if (!builtin_editor) {
+		rl_crlf();
+		(*rl_deprep_term_function)();
+		return;
+	}
+#endif
+	puts_out("\r\n");
+	leave_raw();
+}
+
+/* Puts the prompt and the line back after leave_prompt */
+void back_to_prompt(void) {
+#if READLINE
+	if (!builtin_editor) {
+		(*rl_prep_term_function)(1);
+		rl_on_new_line();
+		rl_forced_update_display();
+		return;
+	}
+#endif
+	enter_raw();
+	refresh();
+}
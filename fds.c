@@ -0,0 +1,57 @@
+/* For pipe2 and close_range */
+#define _GNU_SOURCE
+#include "main.h"
+#include <dirent.h>
+
+/*
+ * Keeping the shell's file descriptors out of the commands it runs.
+ *
+ * Everything the shell opens for itself is close-on-exec, from pipes to
+ * here-document files, so a command only gets its stdin, stdout, stderr
+ * and whatever the shell itself inherited. A leaked write end of a pipe
+ * would keep the command reading it from ever seeing EOF.
+ *
+ * Libraries don't always do the same, so children also mark whatever is
+ * left over close-on-exec with a single close_range just before they
+ * exec, at the same cost however many descriptors there are. They're not
+ * closed outright, as a child running shell code rather than a command
+ * still uses the shell's own, such as the files of cached here-documents.
+ */
+
+/* The descriptors from this one up weren't inherited by the shell */
+static unsigned int first_own_fd = 3;
+
+/* Notes the descriptors the shell was started with, which are passed on
+ * to commands as they are. Called before the shell opens any. */
+void note_inherited_fds(void) {
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *entry;
+
+	if (!dir) {
+		/* Without /proc, only stdin, stdout and stderr are passed on */
+		return;
+	}
+	while (NULL != (entry = readdir(dir))) {
+		long fd = strtol(entry->d_name, NULL, 10);
+		if (fd != dirfd(dir) && (unsigned long) fd >= first_own_fd) {
+			first_own_fd = (unsigned int) fd + 1;
+		}
+	}
+	closedir(dir);
+}
+
+/* Creates a pipe whose ends are closed on exec, except where they're
+ * duplicated onto stdin or stdout */
+int shell_pipe(Pipe p) {
+	return pipe2(p, O_CLOEXEC);
+}
+
+/* Marks every descriptor the shell didn't inherit close-on-exec.
+ * Called in a child just before it execs a command. */
+void hide_shell_fds(void) {
+#ifdef CLOSE_RANGE_CLOEXEC
+	/* Kernels before 5.11 fail this, but the shell's own descriptors
+	 * are close-on-exec regardless */
+	close_range(first_own_fd, ~0U, CLOSE_RANGE_CLOEXEC);
+#endif
+}
@@ -0,0 +1,348 @@
+#include "main.h"
+
+/*
+ * Shell functions and aliases.
+ *
+ * Both are parsed once, when they're defined, and kept as trees in hash
+ * tables that commands are looked up in before builtins and the PATH.
+ * They run within the shell with their arguments as the positional
+ * parameters, so calling one doesn't fork unless it's part of a pipeline.
+ *
+ * An alias is its text followed by "$@", which passes the words after
+ * it on to the last command of the text. Aliases are looked up by the
+ * command name as written, so a quoted name bypasses them, and not
+ * within their own text, so alias ls='ls -F' doesn't recurse.
+ *
+ * Deferred functions, set up by defer in the rc file, hold what isn't
+ * needed right away. Each runs once, the first time one of the commands
+ * it's deferred for is run or, failing that, while the shell waits at
+ * the prompt.
+ */
+
+#define MAX_CALL_DEPTH (1000)
+
+struct ShellFunction {
+	char *name;
+	char *text; /* The value of an alias, for listing it */
+	Node *body; /* NULL once removed */
+	Node *retired; /* Bodies replaced while running, freed once it returns */
+	int active; /* Calls in progress */
+	struct ShellFunction *next;
+};
+
+/* A function deferred until first use or idle time */
+typedef struct Deferred {
+	char *function;
+	char **triggers; /* The commands that need it first */
+	struct Deferred *next;
+} Deferred;
+
+static ShellFunction *functions[FUNC_BUCKETS], *aliases[FUNC_BUCKETS];
+static int call_depth = 0;
+static Deferred *deferred = NULL;
+
+static unsigned long hash(const char *name) {
+	unsigned long h = 5381;
+	for (; *name; name++) {
+		h = h * 33 + (unsigned char) *name;
+	}
+	return h % FUNC_BUCKETS;
+}
+
+/* Finds the entry for the name, adding an empty one if there's none */
+static ShellFunction *entry(ShellFunction **table, const char *name) {
+	ShellFunction **bucket = &table[hash(name)], *f;
+
+	for (f = *bucket; f; f = f->next) {
+		if (0 == strcmp(f->name, name)) {
+			return f;
+		}
+	}
+	if (!(f = calloc(1, sizeof(*f))) || !(f->name = strdup(name))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	f->next = *bucket;
+	*bucket = f;
+	return f;
+}
+
+static ShellFunction *lookup(ShellFunction **table, const char *name) {
+	ShellFunction *f;
+	for (f = table[hash(name)]; f; f = f->next) {
+		if (0 == strcmp(f->name, name)) {
+			return f->body ? f : NULL;
+		}
+	}
+	return NULL;
+}
+
+/* Replaces the body, keeping the old one until no call is running it.
+ * Bodies are single nodes, so the retired ones are chained by next. */
+static void replace_body(ShellFunction *f, Node *body) {
+	if (f->body && f->active) {
+		f->body->next = f->retired;
+		f->retired = f->body;
+	} else {
+		free_node(f->body);
+	}
+	f->body = body;
+}
+
+/* Defines a function with a copy of the body, as the tree it's defined
+ * in may be freed or unmapped while the function is still around. */
+void define_function(const char *name, Node *body) {
+	replace_body(entry(functions, name), copy_node(body));
+}
+
+/* The alias or function that runs a command. word is its name as written
+ * and name as expanded; aliases only apply if they're the same. */
+ShellFunction *find_function(const char *word, const char *name) {
+	ShellFunction *f;
+
+	if (word && !strpbrk(word, "'\"\\$`") && 0 == strcmp(word, name) &&
+			NULL != (f = lookup(aliases, word)) && !f->active) {
+		return f;
+	}
+	return lookup(functions, name);
+}
+
+/* Calls the function or alias with args[0] as its name and the rest as
+ * the positional parameters, returning its status */
+int call_function(ShellFunction *f, char **args) {
+	char **saved;
+	int status;
+
+	if (call_depth >= MAX_CALL_DEPTH) {
+		fprintf(stderr, SMSH ": %s: maximum function nesting level exceeded\n", f->name);
+		/* Like Ctrl-C, this abandons the rest of the input */
+		interrupted = 1;
+		return EXIT_FAILURE;
+	}
+	saved = set_positional(args + 1);
+	call_depth++;
+	f->active++;
+	status = exec_function(f->body, NULL);
+	f->active--;
+	call_depth--;
+	set_positional(saved);
+	if (!f->active && f->retired) {
+		free_node(f->retired);
+		f->retired = NULL;
+	}
+	return status;
+}
+
+static void print_alias(ShellFunction *f) {
+	char *quoted = quote_word(f->text);
+	printf("alias %s=%s\n", f->name, quoted);
+	free(quoted);
+}
+
+/* Defines an alias, parsing its text right away. The list it parses
+ * into is kept in a group, so that the body is a single node. */
+static bool define_alias(const char *name, const char *value) {
+	ShellFunction *f;
+	Node *body, *list;
+	char *text;
+	bool incomplete;
+
+	if (!(text = malloc(strlen(value) + sizeof(" \"$@\"")))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(text, "%s \"$@\"", value);
+	list = parse_commands(text, &incomplete);
+	free(text);
+	if (!list) {
+		fprintf(stderr, "alias: %s: %s\n", name, incomplete ? "incomplete command" : "bad alias");
+		return false;
+	}
+
+	if (!(body = calloc(1, sizeof(*body)))) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	body->type = NODE_GROUP;
+	body->body = list;
+	f = entry(aliases, name);
+	replace_body(f, body);
+	free(f->text);
+	if (!(f->text = strdup(value))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	return true;
+}
+
+/* The built-in alias command. Without arguments it lists the aliases,
+ * and name=value defines one. */
+int alias_cmd(char **args) {
+	int status = EXIT_SUCCESS, i;
+	ShellFunction *f;
+
+	if (!args[1]) {
+		for (i = 0; i < FUNC_BUCKETS; i++) {
+			for (f = aliases[i]; f; f = f->next) {
+				if (f->body) {
+					print_alias(f);
+				}
+			}
+		}
+		return status;
+	}
+	for (args++; *args; args++) {
+		char *eq = strchr(*args, '=');
+
+		if (eq && eq != *args) {
+			*eq = 0;
+			if (strpbrk(*args, " \t\n|&;()<>'\"\\$`/")) {
+				fprintf(stderr, "alias: %s: invalid alias name\n", *args);
+				status = EXIT_FAILURE;
+			} else if (!define_alias(*args, eq + 1)) {
+				status = EXIT_FAILURE;
+			}
+			*eq = '=';
+		} else if (NULL != (f = lookup(aliases, *args))) {
+			print_alias(f);
+		} else {
+			fprintf(stderr, "alias: %s: not found\n", *args);
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
+
+/* The built-in unalias command, with -a removing all of them */
+int unalias_cmd(char **args) {
+	int status = EXIT_SUCCESS, i;
+	ShellFunction *f;
+
+	if (args[1] && 0 == strcmp(args[1], "-a")) {
+		for (i = 0; i < FUNC_BUCKETS; i++) {
+			for (f = aliases[i]; f; f = f->next) {
+				replace_body(f, NULL);
+			}
+		}
+		return status;
+	}
+	for (args++; *args; args++) {
+		if (NULL != (f = lookup(aliases, *args))) {
+			replace_body(f, NULL);
+		} else {
+			fprintf(stderr, "unalias: %s: not found\n", *args);
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
+
+/* The built-in defer command: defer function [command ...] */
+int defer_cmd(char **args) {
+	Deferred *d, **tail = &deferred;
+	size_t n, i;
+
+	if (!args[1]) {
+		fprintf(stderr, "defer: usage: defer function [command ...]\n");
+		return 2;
+	}
+	if (!lookup(functions, args[1])) {
+		fprintf(stderr, "defer: %s: not a function\n", args[1]);
+		return EXIT_FAILURE;
+	}
+	for (n = 0; args[n + 2]; n++);
+	if (!(d = calloc(1, sizeof(*d))) || !(d->function = strdup(args[1])) ||
+			!(d->triggers = calloc(n + 1, sizeof(*d->triggers)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i++) {
+		if (!(d->triggers[i] = strdup(args[i + 2]))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	/* Idle time runs them in the order they were deferred */
+	while (*tail) {
+		tail = &(*tail)->next;
+	}
+	*tail = d;
+	return EXIT_SUCCESS;
+}
+
+/* Adds the functions and aliases starting with the prefix */
+void complete_functions(const char *prefix, size_t len, Completions *c) {
+	ShellFunction *f;
+	int i;
+
+	for (i = 0; i < FUNC_BUCKETS; i++) {
+		for (f = functions[i]; f; f = f->next) {
+			if (f->body && 0 == strncmp(f->name, prefix, len)) {
+				add_completion(c, f->name);
+			}
+		}
+		for (f = aliases[i]; f; f = f->next) {
+			if (f->body && 0 == strncmp(f->name, prefix, len)) {
+				add_completion(c, f->name);
+			}
+		}
+	}
+}
+
+bool deferred_pending(void) {
+	return NULL != deferred;
+}
+
+/* Runs a deferred function, taking it off the list first so that
+ * it runs only once */
+static void run_one(Deferred **link, const char *command) {
+	Deferred *d = *link;
+	ShellFunction *f = lookup(functions, d->function);
+	struct timeval before, after;
+	char *args[2], **trigger;
+
+	*link = d->next;
+	args[0] = d->function;
+	args[1] = NULL;
+	gettimeofday(&before, NULL);
+	if (f) {
+		call_function(f, args);
+	}
+	if (profile_startup) {
+		gettimeofday(&after, NULL);
+		fprintf(stderr, SMSH ": %10.3f ms  deferred %s%s%s\n",
+			(double) (after.tv_sec - before.tv_sec) * 1000 +
+			(double) (after.tv_usec - before.tv_usec) / 1000,
+			d->function, command ? " for " : "", command ? command : "");
+	}
+	for (trigger = d->triggers; *trigger; trigger++) {
+		free(*trigger);
+	}
+	free(d->triggers);
+	free(d->function);
+	free(d);
+}
+
+/* Runs the deferred functions that command needs, or with NULL the
+ * first one still waiting */
+void run_deferred(const char *command) {
+	Deferred **link = &deferred;
+
+	if (!command) {
+		if (deferred) {
+			run_one(link, NULL);
+		}
+		return;
+	}
+	while (*link) {
+		char **trigger;
+		for (trigger = (*link)->triggers; *trigger && 0 != strcmp(*trigger, command); trigger++);
+		if (*trigger) {
+			run_one(link, command);
+			/* It may have run or deferred others, so start over */
+			link = &deferred;
+		} else {
+			link = &(*link)->next;
+		}
+	}
+}
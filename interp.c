@@ -0,0 +1,371 @@
+#include "main.h"
+
+/*
+ * Execution of parsed commands by walking their trees.
+ *
+ * Everything but the pipelines themselves runs within the shell, so a
+ * loop only forks for the external commands in its body; conditions and
+ * bodies made up of builtins don't fork at all.
+ */
+
+/* Pending break and continue, counted in loops left to unwind */
+static int breaks = 0, continues = 0;
+static int loop_depth = 0;
+/* A pending return, which unwinds all the way out of the function */
+static bool returning = false;
+static int return_status = EXIT_SUCCESS, function_depth = 0;
+
+/* Whether execution of the current list should stop early */
+static bool unwinding(void) {
+	return interrupted || breaks || continues || returning;
+}
+
+/* Called after each iteration of a loop. Returns whether to leave it. */
+static bool loop_done(void) {
+	if (interrupted || returning) {
+		return true;
+	}
+	if (breaks) {
+		breaks--;
+		return true;
+	}
+	if (continues) {
+		/* Continue this loop, or leave it to continue an outer one */
+		return 0 < --continues;
+	}
+	return false;
+}
+
+static int exec_while(Node *node) {
+	int status = EXIT_SUCCESS;
+
+	loop_depth++;
+	for (;;) {
+		int cond = exec_node(node->cond);
+		if (unwinding()) {
+			if (loop_done()) {
+				break;
+			}
+			continue;
+		}
+		if ((EXIT_SUCCESS == cond) == (NODE_UNTIL == node->type)) {
+			break;
+		}
+		status = exec_node(node->body);
+		if (loop_done()) {
+			break;
+		}
+	}
+	loop_depth--;
+	return status;
+}
+
+/* Runs one iteration of a for loop. Returns whether to leave the loop. */
+static bool for_iteration(Node *node, const char *word, int *status) {
+	set_var(node->name, word);
+	*status = exec_node(node->body);
+	return loop_done();
+}
+
+/* Whether brace expansion is all a word needs, as for {1..1000000} */
+static bool only_braces(const char *word) {
+	return !strpbrk(word, "$'\"\\~");
+}
+
+static int exec_for(Node *node) {
+	static char *all[] = { "\"$@\"", NULL };
+	int status = EXIT_SUCCESS;
+	char ***fields, **word, **words = node->words ? node->words : all;
+	size_t num_words, i;
+	bool done = false;
+
+	/* The words are expanded once, before the first iteration. Words that
+	 * are only brace expanded are left to produce their values lazily. */
+	for (num_words = 0; words[num_words]; num_words++);
+	if (!(fields = calloc(num_words + 1, sizeof(*fields)))) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < num_words; i++) {
+		if (!only_braces(words[i])) {
+			char *args[2];
+			args[0] = words[i];
+			args[1] = NULL;
+			fields[i] = expand_args(args);
+		}
+	}
+
+	loop_depth++;
+	for (i = 0; i < num_words && !done; i++) {
+		Braces braces;
+		const char *value;
+
+		if (fields[i]) {
+			for (word = fields[i]; *word && !done; word++) {
+				done = for_iteration(node, *word, &status);
+			}
+		} else if (start_braces(&braces, words[i], false)) {
+			while (!done && NULL != (value = next_brace(&braces))) {
+				done = for_iteration(node, value, &status);
+			}
+			end_braces(&braces);
+		} else {
+			done = for_iteration(node, words[i], &status);
+		}
+	}
+	loop_depth--;
+
+	for (i = 0; i < num_words; i++) {
+		free(fields[i]);
+	}
+	free(fields);
+	return status;
+}
+
+/* An arithmetic command succeeds if the expression isn't 0 */
+static int exec_arith(const char *expr) {
+	long value;
+	if (!arith(expr, strlen(expr), &value)) {
+		return EXIT_FAILURE;
+	}
+	return value ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int exec_arith_for(Node *node) {
+	const char *init = node->words[0], *cond = node->words[1], *step = node->words[2];
+	int status = EXIT_SUCCESS;
+	long value;
+
+	if (!arith(init, strlen(init), &value)) {
+		return EXIT_FAILURE;
+	}
+	loop_depth++;
+	for (;;) {
+		/* An empty condition is always true */
+		if (*cond) {
+			if (!arith(cond, strlen(cond), &value)) {
+				status = EXIT_FAILURE;
+				break;
+			}
+			if (!value) {
+				break;
+			}
+		}
+		status = exec_node(node->body);
+		if (loop_done()) {
+			break;
+		}
+		if (!arith(step, strlen(step), &value)) {
+			status = EXIT_FAILURE;
+			break;
+		}
+	}
+	loop_depth--;
+	return status;
+}
+
+static int exec_case(Node *node) {
+	char *word = expand_word(node->name, false);
+	CaseItem *item;
+	int status = EXIT_SUCCESS;
+
+	for (item = node->items; item; item = item->next) {
+		char **pattern;
+		bool matched = false;
+
+		for (pattern = item->patterns; *pattern && !matched; pattern++) {
+			char *expanded = expand_word(*pattern, true);
+			matched = 0 == fnmatch(expanded, word, 0);
+			free(expanded);
+		}
+		if (matched) {
+			status = exec_node(item->body);
+			break;
+		}
+	}
+	free(word);
+	return status;
+}
+
+static int exec_subshell(Node *node) {
+	struct timeval since;
+	pid_t child;
+	int status;
+
+	sync_input();
+	fflush(NULL);
+	TRY(child = fork(), "fork");
+	if (0 == child) {
+		exit(exec_node(node->body));
+	}
+	gettimeofday(&since, NULL);
+	while (-1 == waitpid(child, &status, 0)) {
+		if (EINTR != errno) {
+			return EXIT_FAILURE;
+		}
+	}
+	count_wait(&since);
+	return exit_status(status);
+}
+
+static int exec_one(Node *node) {
+	switch (node->type) {
+		case NODE_PIPELINE:
+			return exec(node->pipeline);
+		case NODE_IF: {
+			int cond = exec_node(node->cond);
+			if (unwinding()) {
+				return cond;
+			}
+			if (EXIT_SUCCESS == cond) {
+				return exec_node(node->body);
+			}
+			return node->alt ? exec_node(node->alt) : EXIT_SUCCESS;
+		}
+		case NODE_WHILE:
+		case NODE_UNTIL:
+			return exec_while(node);
+		case NODE_FOR:
+			return exec_for(node);
+		case NODE_CASE:
+			return exec_case(node);
+		case NODE_GROUP:
+			return exec_node(node->body);
+		case NODE_SUBSHELL:
+			return exec_subshell(node);
+		case NODE_ARITH:
+			return exec_arith(node->name);
+		case NODE_ARITH_FOR:
+			return exec_arith_for(node);
+		case NODE_AND:
+		case NODE_OR: {
+			int status = exec_node(node->cond);
+			if (unwinding() || (EXIT_SUCCESS == status) != (NODE_AND == node->type)) {
+				return status;
+			}
+			return exec_node(node->body);
+		}
+		case NODE_FUNCTION:
+			define_function(node->name, node->body);
+			return EXIT_SUCCESS;
+	}
+	return EXIT_FAILURE;
+}
+
+/* Executes a list of commands, returning the status of the last one */
+int exec_node(Node *node) {
+	int status = EXIT_SUCCESS;
+
+	for (; node && !unwinding(); node = node->next) {
+		/* Scripts never wait at the prompt, where jobs are admitted */
+		run_queued_jobs();
+		status = exec_one(node);
+		set_status(status);
+	}
+	return status;
+}
+
+/* Whether every command within the tree is a builtin, i.e. nothing
+ * but the shell itself will read its input. */
+bool only_builtins(Node *node) {
+	for (; node; node = node->next) {
+		CaseItem *item;
+
+		if (node->pipeline) {
+			size_t i;
+			for (i = 0; i < node->pipeline->length; i++) {
+				Command *command = node->pipeline->cmds[i];
+				char *name;
+
+				if (command->compound) {
+					if (!only_builtins(command->compound)) {
+						return false;
+					}
+					continue;
+				}
+				name = command->args[count_assignments(command->args)];
+				if (name && (strchr(name, '$') || !builtin_func(name) || find_function(name, name))) {
+					return false;
+				}
+				if (name && find_loadable(name) && !(find_loadable(name)->flags & SMSH_STREAMS)) {
+					/* It may read the input past read's buffer */
+					return false;
+				}
+			}
+		}
+		for (item = node->items; item; item = item->next) {
+			if (!only_builtins(item->body)) {
+				return false;
+			}
+		}
+		if (!only_builtins(node->cond) || !only_builtins(node->body) ||
+				!only_builtins(node->alt)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Runs the body of a function or a sourced script, which break and
+ * continue can't leave and return can. Sets *returned, if given, when
+ * return was used. */
+int exec_function(Node *body, bool *returned) {
+	int depth = loop_depth, status;
+
+	loop_depth = 0;
+	function_depth++;
+	status = exec_node(body);
+	if (returned) {
+		*returned = returning;
+	}
+	if (returning) {
+		returning = false;
+		status = return_status;
+	}
+	function_depth--;
+	loop_depth = depth;
+	return status;
+}
+
+static int loop_control(char **args, int *counter) {
+	int n = args[1] ? atoi(args[1]) : 1;
+
+	if (n < 1) {
+		fprintf(stderr, "%s: loop count out of range\n", args[0]);
+		return EXIT_FAILURE;
+	}
+	if (0 == loop_depth) {
+		fprintf(stderr, "%s: only meaningful in a loop\n", args[0]);
+		return EXIT_SUCCESS;
+	}
+	*counter = n > loop_depth ? loop_depth : n;
+	return EXIT_SUCCESS;
+}
+
+/* The built-in break command */
+int break_cmd(char **args) {
+	return loop_control(args, &breaks);
+}
+
+/* The built-in continue command */
+int continue_cmd(char **args) {
+	return loop_control(args, &continues);
+}
+
+/* The built-in return command, leaving the function with the given
+ * status or that of the last command */
+int return_cmd(char **args) {
+	char *end;
+
+	if (0 == function_depth) {
+		fprintf(stderr, "return: can only return from a function or sourced script\n");
+		return EXIT_FAILURE;
+	}
+	return_status = args[1] ? (int) strtol(args[1], &end, 10) & 0xff : atoi(get_var("?"));
+	if (args[1] && (*end || !*args[1])) {
+		fprintf(stderr, "return: %s: numeric argument required\n", args[1]);
+		return_status = 2;
+	}
+	returning = true;
+	return return_status;
+}
@@ -0,0 +1,620 @@
+/* For O_CLOEXEC and nanosleep */
+#define _DEFAULT_SOURCE
+#include "main.h"
+
+/*
+ * Background jobs and their admission control.
+ *
+ * Before a background job is started the host's pressure stall
+ * information (PSI) is consulted. If any resource is under more
+ * pressure than its threshold allows, the job is queued and started
+ * later, one at a time, once the pressure has dropped. Queued jobs are
+ * forked right away, with their arguments expanded as usual, but wait
+ * at a gate (a pipe) before running anything until they're admitted.
+ * Admission is retried while the shell waits for input, before each
+ * command it runs and every second while it waits for foreground
+ * commands, so that scripts let queued jobs through as well.
+ *
+ * The thresholds are the percentage of time (averaged over ten seconds)
+ * that some task was stalled on the resource, and are configured with
+ * SMSH_PSI_CPU, SMSH_PSI_MEMORY and SMSH_PSI_IO. A threshold of 0
+ * disables the check for that resource.
+ *
+ * Optionally, SMSH_GLOBAL_JOBS caps the number of background jobs
+ * running across all smsh sessions on the host. Each running job holds
+ * a token in a shared memory segment, which is guarded by an flock so
+ * that a crashed shell never leaves the pool locked. The first shell to
+ * use the pool creates it writable by its owner and group; for the cap
+ * to span users, the administrator creates it beforehand (as
+ * /dev/shm/smsh-tokens) owned by a group they share, mode 0660. A pool
+ * anyone can write to isn't used, nor one not laid out as expected.
+ * Tokens held by shells that no longer exist are reclaimed when the pool
+ * is used; a shell is told apart from a later process with the same pid
+ * by when it started and who runs it. A pool that can't be had, or
+ * stays locked, is done without, leaving admission to the pressure
+ * checks.
+ */
+
+/* What the pool starts with, so that shells built with another layout
+ * don't take it for theirs */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots;
+	uint32_t token_size;
+	uint32_t unused; /* Keeps the tokens that follow aligned */
+} PoolHeader;
+
+#define POOL_MAGIC "smshpool"
+#define POOL_VERSION (1)
+
+/* A slot in the pool; free when shell is 0 */
+typedef struct {
+	pid_t shell;
+	uint64_t shell_start; /* When the shell started, in clock ticks after boot */
+	pid_t leader; /* 0 until the job has been started */
+	uid_t uid;
+	time_t since;
+	char line[64];
+} Token;
+
+static Job *jobs = NULL;
+static int next_id = 1;
+static pid_t owner = -1;
+static struct timeval last_admit, last_try;
+static Token *pool = NULL;
+static int pool_fd = -1;
+static bool pool_failed = false;
+static uint64_t owner_start = 0;
+/* Token taken by hold_job for the job about to be started */
+static int admitted_token = -1;
+
+/* Resources and their default thresholds */
+static const char *resources[] = { "cpu", "memory", "io" };
+static const char *threshold_vars[] = { "SMSH_PSI_CPU", "SMSH_PSI_MEMORY", "SMSH_PSI_IO" };
+static const double default_thresholds[] = { 80.0, 10.0, 50.0 };
+#define NUM_RESOURCES ((int) (sizeof(resources) / sizeof(*resources)))
+
+void init_jobs(void) {
+	owner = getpid();
+	gettimeofday(&last_admit, NULL);
+}
+
+/* Returns the "some avg10" pressure of a resource, or 0 if unavailable */
+static double pressure(const char *resource) {
+	char path[64];
+	double avg10 = 0;
+	FILE *f;
+
+	sprintf(path, "/proc/pressure/%s", resource);
+	if (NULL == (f = fopen(path, "re"))) {
+		/* Kernels without PSI never hold back jobs */
+		return 0;
+	}
+	if (1 != fscanf(f, "some avg10=%lf", &avg10)) {
+		avg10 = 0;
+	}
+	fclose(f);
+	return avg10;
+}
+
+/* Returns the name of the first resource over its threshold, or NULL */
+static const char *stalled_resource(double *value) {
+	int i;
+	for (i = 0; i < NUM_RESOURCES; i++) {
+		const char *setting = get_var(threshold_vars[i]);
+		double threshold = setting ? strtod(setting, NULL) : default_thresholds[i];
+
+		if (threshold <= 0) {
+			continue;
+		}
+		if ((*value = pressure(resources[i])) >= threshold) {
+			return resources[i];
+		}
+	}
+	return NULL;
+}
+
+/* Whether any resource is under more pressure than its threshold */
+bool host_stalled(void) {
+	double value;
+	return NULL != stalled_resource(&value);
+}
+
+/* Returns the cap on host-wide background jobs, or 0 if there is none */
+static int global_limit(void) {
+	const char *value = get_var("SMSH_GLOBAL_JOBS");
+	int limit = value ? atoi(value) : 0;
+	return limit < 0 ? 0 : limit > GLOBAL_SLOTS ? GLOBAL_SLOTS : limit;
+}
+
+/* When a process started, in clock ticks after boot, or 0 if unknown */
+static uint64_t process_start(pid_t pid) {
+	char path[64], buf[1024], *p;
+	uint64_t start;
+	ssize_t n;
+	int fd;
+
+	sprintf(path, "/proc/%d/stat", (int) pid);
+	if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+		return 0;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[n > 0 ? n : 0] = 0;
+	/* starttime is the 22nd field, the 20th after the command */
+	if (!(p = strrchr(buf, ')')) || 1 != sscanf(p + 2,
+			"%*c %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %" SCNu64, &start)) {
+		return 0;
+	}
+	return start;
+}
+
+/* Takes the pool's lock, trying for POOL_LOCK_MS */
+static bool lock_fd(int fd) {
+	struct timespec pause;
+	int i;
+
+	pause.tv_sec = 0;
+	pause.tv_nsec = 1000000;
+	for (i = 0; -1 == flock(fd, LOCK_EX | LOCK_NB); i++) {
+		if (EWOULDBLOCK != errno && EINTR != errno) {
+			return false;
+		}
+		if (POOL_LOCK_MS <= i) {
+			fprintf(stderr, SMSH ": job pool is locked, not counting global jobs\n");
+			return false;
+		}
+		nanosleep(&pause, NULL);
+	}
+	return true;
+}
+
+/* Sets up a pool that was just created, or checks one that was already
+ * there. Called with the pool locked. */
+static bool init_pool(PoolHeader *header, bool fresh) {
+	if (fresh) {
+		memcpy(header->magic, POOL_MAGIC, sizeof(header->magic));
+		header->version = POOL_VERSION;
+		header->slots = GLOBAL_SLOTS;
+		header->token_size = sizeof(Token);
+		return true;
+	}
+	return 0 == memcmp(header->magic, POOL_MAGIC, sizeof(header->magic)) &&
+		POOL_VERSION == header->version && GLOBAL_SLOTS == header->slots &&
+		sizeof(Token) == header->token_size;
+}
+
+/* Maps the host's pool, creating it if this is the first shell to use it */
+static bool open_pool(void) {
+	const size_t size = sizeof(PoolHeader) + GLOBAL_SLOTS * sizeof(Token);
+	struct stat st;
+	void *map = MAP_FAILED;
+	const char *problem = NULL;
+	bool locked = false, ok;
+
+	if (pool) {
+		return true;
+	}
+	if (pool_failed) {
+		return false;
+	}
+	if (-1 != (pool_fd = shm_open(GLOBAL_POOL, O_RDWR | O_CREAT | O_EXCL, 0660))) {
+		/* Not left to the umask, which would keep the group out */
+		fchmod(pool_fd, 0660);
+	} else if (EEXIST == errno) {
+		pool_fd = shm_open(GLOBAL_POOL, O_RDWR, 0);
+	}
+	if (-1 == pool_fd) {
+		fprintf(stderr, SMSH ": %s: %s\n", GLOBAL_POOL, strerror(errno));
+		pool_failed = true;
+		return false;
+	}
+	/* Its size is looked at with the lock held, as the shell that
+	 * created it may still be setting it up */
+	ok = (locked = lock_fd(pool_fd)) && 0 == fstat(pool_fd, &st);
+	if (ok && (st.st_mode & 002)) {
+		/* Anyone at all could hold up or corrupt it */
+		problem = "writable by anyone";
+	} else if (ok && 0 != st.st_size && size != (size_t) st.st_size) {
+		problem = "not a pool this shell can use";
+	}
+	ok = ok && !problem && (0 != st.st_size || 0 == ftruncate(pool_fd, size)) &&
+		MAP_FAILED != (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool_fd, 0));
+	if (ok && !init_pool(map, 0 == st.st_size)) {
+		problem = "not a pool this shell can use";
+		ok = false;
+	}
+	if (locked) {
+		flock(pool_fd, LOCK_UN);
+	}
+	if (!ok) {
+		if (locked) {
+			fprintf(stderr, SMSH ": %s: %s\n", GLOBAL_POOL, problem ? problem : strerror(errno));
+		}
+		if (MAP_FAILED != map) {
+			munmap(map, size);
+		}
+		close(pool_fd);
+		pool_fd = -1;
+		pool_failed = true;
+		return false;
+	}
+	pool = (Token *) ((PoolHeader *) map + 1);
+	owner_start = process_start(owner);
+	return true;
+}
+
+/* Whether the shell holding a token is gone, its pid maybe reused */
+static bool holder_gone(const Token *token) {
+	char path[64];
+	struct stat st;
+	uint64_t start;
+
+	if (token->shell <= 0 || (-1 == kill(token->shell, 0) && ESRCH == errno)) {
+		return true;
+	}
+	/* Processes that can't be looked at (hidepid) are taken to be it */
+	sprintf(path, "/proc/%d", (int) token->shell);
+	if (0 == stat(path, &st) && st.st_uid != token->uid) {
+		return true;
+	}
+	start = process_start(token->shell);
+	return start && token->shell_start && start != token->shell_start;
+}
+
+/* Locks the pool and frees the tokens of shells that are gone. Returns
+ * the number of tokens held, or -1 if the pool stayed locked for
+ * POOL_LOCK_MS, and isn't locked. */
+static int lock_pool(void) {
+	int i, held = 0;
+
+	if (!lock_fd(pool_fd)) {
+		return -1;
+	}
+	for (i = 0; i < GLOBAL_SLOTS; i++) {
+		if (0 == pool[i].shell) {
+			continue;
+		}
+		if (holder_gone(&pool[i])) {
+			pool[i].shell = 0;
+			continue;
+		}
+		held++;
+	}
+	return held;
+}
+
+static void unlock_pool(void) {
+	flock(pool_fd, LOCK_UN);
+}
+
+/* Whether a job could get a token right now */
+static bool token_available(void) {
+	int limit = global_limit(), held;
+
+	if (0 == limit || !open_pool() || -1 == (held = lock_pool())) {
+		return true;
+	}
+	unlock_pool();
+	return held < limit;
+}
+
+/* Takes a token for a job about to start. Returns false if the host's
+ * cap is reached, otherwise the slot (-1 without a pool) is stored. */
+static bool take_token(int *slot) {
+	int limit = global_limit(), held, i;
+
+	*slot = -1;
+	if (0 == limit || !open_pool() || -1 == (held = lock_pool())) {
+		return true;
+	}
+	if (held >= limit) {
+		unlock_pool();
+		return false;
+	}
+	for (i = 0; i < GLOBAL_SLOTS; i++) {
+		if (0 == pool[i].shell) {
+			pool[i].shell = owner;
+			pool[i].shell_start = owner_start;
+			pool[i].leader = 0;
+			pool[i].uid = getuid();
+			pool[i].since = time(NULL);
+			pool[i].line[0] = 0;
+			*slot = i;
+			break;
+		}
+	}
+	unlock_pool();
+	return true;
+}
+
+static void set_token(int slot, pid_t leader, const char *line) {
+	if (-1 != slot && pool && -1 != lock_pool()) {
+		pool[slot].leader = leader;
+		strncpy(pool[slot].line, line, sizeof(pool[slot].line) - 1);
+		pool[slot].line[sizeof(pool[slot].line) - 1] = 0;
+		unlock_pool();
+	}
+}
+
+static void release_token(int slot) {
+	/* Not getting the lock leaves the token to be reclaimed once the
+	 * shell is gone */
+	if (-1 != slot && pool && -1 != lock_pool()) {
+		if (owner == pool[slot].shell) {
+			pool[slot].shell = 0;
+		}
+		unlock_pool();
+	}
+}
+
+static Job *new_job(JobState state, pid_t pgid, const char *line) {
+	Job *job = malloc(sizeof(*job)), **tail;
+	if (!job || !(job->line = strdup(line))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	if (!jobs) {
+		/* Start numbering over when there are no jobs left */
+		next_id = 1;
+	}
+	job->id = next_id++;
+	job->pid = pgid;
+	job->state = state;
+	job->gate = -1;
+	job->num_procs = 0;
+	job->token = -1;
+	job->next = NULL;
+
+	/* Append to keep the queue in submission order */
+	for (tail = &jobs; *tail; tail = &(*tail)->next);
+	*tail = job;
+	return job;
+}
+
+static void free_job(Job *job) {
+	release_token(job->token);
+	if (-1 != job->gate) {
+		close(job->gate);
+	}
+	free(job->line);
+	free(job);
+}
+
+/* The oldest queued job, or NULL. A forked copy of the shell doesn't
+ * admit its parent's jobs, so it has none. */
+static Job *first_queued(void) {
+	Job *job;
+
+	for (job = jobs; job && JOB_QUEUED != job->state; job = job->next);
+	return job && getpid() == owner ? job : NULL;
+}
+
+/* Whether any background job is waiting to be admitted */
+bool jobs_queued(void) {
+	return NULL != first_queued();
+}
+
+/* Decides whether a background job may start right away. It's held
+ * back if the host is under pressure, the host-wide cap is reached or
+ * other jobs are already waiting, so that admission stays in order.
+ * Returns NULL if it may start, otherwise the reason it's held. */
+const char *hold_job(void) {
+	static char reason[64];
+	const char *resource;
+	double value = 0;
+
+	if (first_queued()) {
+		return "";
+	}
+	if (NULL != (resource = stalled_resource(&value))) {
+		sprintf(reason, " (%s pressure %.2f%%)", resource, value);
+		return reason;
+	}
+	if (!take_token(&admitted_token)) {
+		sprintf(reason, " (%d global jobs running)", global_limit());
+		return reason;
+	}
+	return NULL;
+}
+
+/* Registers a background job. If it was held, its processes wait at
+ * the gate until run_queued_jobs lets them through. */
+void add_job(pid_t pgid, const char *line, int gate, size_t num_procs, const char *held) {
+	Job *job;
+
+	if (0 == pgid) {
+		/* Nothing could be started, so the token isn't needed */
+		release_token(admitted_token);
+		admitted_token = -1;
+		return;
+	}
+	if (held) {
+		job = new_job(JOB_QUEUED, pgid, line);
+		job->gate = gate;
+		job->num_procs = num_procs;
+		printf("[%d] queued%s\n", job->id, held);
+		fflush(stdout);
+		return;
+	}
+	job = new_job(JOB_RUNNING, pgid, line);
+	job->token = admitted_token;
+	set_token(job->token, job->pid, job->line);
+	admitted_token = -1;
+}
+
+/* The background jobs, queued or running, oldest first */
+const Job *first_job(void) {
+	return jobs;
+}
+
+/* The number of background jobs, queued or running */
+size_t count_jobs(void) {
+	size_t n = 0;
+	Job *job;
+
+	for (job = jobs; job; job = job->next) {
+		n++;
+	}
+	return n;
+}
+
+/* Whether a queued job may be started right now */
+bool jobs_pending(void) {
+	struct timeval now;
+	double value;
+
+	if (!first_queued()) {
+		return false;
+	}
+
+	gettimeofday(&now, NULL);
+	if (1000 * (now.tv_sec - last_admit.tv_sec) +
+			(now.tv_usec - last_admit.tv_usec) / 1000 < ADMIT_INTERVAL_MS) {
+		return false;
+	}
+	return NULL == stalled_resource(&value) && token_available();
+}
+
+/* Lets the oldest queued job through its gate if it's admitted */
+void run_queued_jobs(void) {
+	struct timeval now;
+	Job *job;
+	size_t i;
+
+	if (!first_queued()) {
+		return;
+	}
+	gettimeofday(&now, NULL);
+	if (1000 * (now.tv_sec - last_try.tv_sec) +
+			(now.tv_usec - last_try.tv_usec) / 1000 < ADMIT_RETRY_MS) {
+		return;
+	}
+	last_try = now;
+	/* Jobs that are done hand their tokens back now, though they're
+	 * only reported by reap_jobs at the prompt */
+	for (job = jobs; job; job = job->next) {
+		pid_t zombie;
+
+		if (-1 != job->token) {
+			while (0 < (zombie = waitpid(-job->pid, NULL, WNOHANG)));
+			if (-1 == zombie && ECHILD == errno) {
+				release_token(job->token);
+				job->token = -1;
+			}
+		}
+	}
+	if (!jobs_pending()) {
+		return;
+	}
+	job = first_queued();
+	if (!take_token(&job->token)) {
+		/* Another shell got there first */
+		return;
+	}
+	gettimeofday(&last_admit, NULL);
+
+	/* Every process of the job reads one byte off the gate */
+	for (i = 0; i < job->num_procs; i++) {
+		if (1 != write(job->gate, "", 1)) {
+			perror(SMSH ": gate");
+			break;
+		}
+	}
+	close(job->gate);
+	job->gate = -1;
+	job->state = JOB_RUNNING;
+	set_token(job->token, job->pid, job->line);
+	printf("[%d] %d started\n", job->id, (int) job->pid);
+	fflush(stdout);
+}
+
+/* Check for completed child processes */
+void reap_jobs(void) {
+	Job **job = &jobs;
+
+	while (*job) {
+		pid_t zombie;
+
+		/* A job is done when no process in its group is left */
+		while (0 < (zombie = waitpid(-(*job)->pid, NULL, WNOHANG)));
+		if (-1 == zombie && ECHILD == errno) {
+			Job *done = *job;
+			printf("%d done\n", (int) done->pid);
+			*job = done->next;
+			free_job(done);
+		} else {
+			job = &(*job)->next;
+		}
+	}
+	/* Children that aren't part of a job, such as orphaned stages */
+	while (0 < waitpid(-1, NULL, WNOHANG));
+	fflush(stdout);
+}
+
+/* Terminates all jobs, whether running or queued */
+void kill_jobs(void) {
+	Job *job;
+
+	if (getpid() != owner) {
+		/* A child shouldn't take its siblings down with it */
+		return;
+	}
+	while (NULL != (job = jobs)) {
+		kill(-job->pid, SIGTERM);
+		/* Stopped jobs only act on the signal once continued */
+		kill(-job->pid, SIGCONT);
+		jobs = job->next;
+		free_job(job);
+	}
+}
+
+/* Lists the tokens held by all shells on the host */
+static int list_global(void) {
+	int i, held;
+
+	if (!open_pool() || -1 == (held = lock_pool())) {
+		return EXIT_FAILURE;
+	}
+	printf("%d global jobs running (limit %d)\n", held, global_limit());
+	for (i = 0; i < GLOBAL_SLOTS; i++) {
+		struct passwd *pw;
+		char since[16], line[4 * sizeof(pool[i].line)];
+		size_t j, len = 0;
+
+		if (0 == pool[i].shell) {
+			continue;
+		}
+		/* Control characters are shown escaped, not sent to the terminal */
+		for (j = 0; j < sizeof(pool[i].line) - 1 && pool[i].line[j]; j++) {
+			unsigned char c = (unsigned char) pool[i].line[j];
+			len += (size_t) sprintf(line + len, c < 0x20 || 0x7f == c ? "\\%03o" : "%c", c);
+		}
+		line[len] = 0;
+		pw = getpwuid(pool[i].uid);
+		strftime(since, sizeof(since), "%H:%M:%S", localtime(&pool[i].since));
+		printf("%-10s %7d %7d %s  %s\n", pw ? pw->pw_name : "?",
+				(int) pool[i].shell, (int) pool[i].leader, since, line);
+	}
+	unlock_pool();
+	return EXIT_SUCCESS;
+}
+
+/* The built-in jobs command */
+int jobs_cmd(char **args) {
+	Job *job;
+
+	if (args[1] && 0 == strcmp(args[1], "--global")) {
+		int status = list_global();
+		fflush(stdout);
+		return status;
+	}
+
+	for (job = jobs; job; job = job->next) {
+		printf("[%d] %7d %-8s %s\n", job->id, (int) job->pid,
+				JOB_QUEUED == job->state ? "queued" : "running", job->line);
+	}
+	fflush(stdout);
+	return EXIT_SUCCESS;
+}
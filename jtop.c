@@ -0,0 +1,296 @@
+/* For O_CLOEXEC and nanosleep */
+#define _DEFAULT_SOURCE
+#include "main.h"
+#include <dirent.h>
+
+/*
+ * The jtop builtin, a live view of what the background jobs are doing.
+ *
+ * Every process in a job's process group is sampled from /proc: its
+ * state, threads, CPU time and resident memory from stat, and the bytes
+ * it read and wrote from io. They're added up per job, with the CPU
+ * usage over the time since the previous sample.
+ *
+ * Finding the members of a group takes a look at every process on the
+ * host. To keep sampling cheap enough to leave running, only the pids
+ * that are new since the previous sample, or were in a job then, are
+ * read. The others are looked at again only every JTOP_RESCAN samples,
+ * in case they joined a group meanwhile.
+ *
+ * The stall detector in stall.c samples the jobs the same way.
+ */
+
+#define JTOP_RESCAN (10)
+/* How long the first sample is taken over */
+#define JTOP_FIRST_MS (200)
+
+static int compare_pids(const void *a, const void *b) {
+	pid_t x = *(const pid_t *) a, y = *(const pid_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Reads a small file of /proc into buf, returning its length or -1 */
+static ssize_t read_proc(const char *path, char *buf, size_t size) {
+	ssize_t n;
+	int fd;
+
+	if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+		return -1;
+	}
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n >= 0) {
+		buf[n] = 0;
+	}
+	return n;
+}
+
+/* How busy a state is, so that a job shows its busiest process's */
+static int busyness(char state) {
+	const char *order = "ZTtSDR", *at = strchr(order, state);
+	return at && state ? (int) (at - order) + 1 : 0;
+}
+
+/* Samples a process, adding it to its job's totals if it's in one */
+static void sample(Sampler *s, Sampler *next, pid_t pid, JobTotals *totals) {
+	char path[64], buf[1024], state, *p;
+	unsigned long utime, stime, threads, rss, ticks;
+	long ppid, pgrp;
+	const Job *job;
+	SampledProcess *before, key;
+	size_t i;
+
+	sprintf(path, "/proc/%d/stat", (int) pid);
+	if (read_proc(path, buf, sizeof(buf)) <= 0 || !(p = strrchr(buf, ')'))) {
+		return;
+	}
+	/* The fields after the command: state, ppid, pgrp and on, of
+	 * which utime and stime are the 14th and 15th, num_threads the
+	 * 20th and rss the 24th */
+	if (7 != sscanf(p + 2, "%c %ld %ld %*s %*s %*s %*s %*s %*s %*s %*s %lu %lu %*s %*s %*s %*s %lu %*s %*s %*s %lu",
+			&state, &ppid, &pgrp, &utime, &stime, &threads, &rss)) {
+		return;
+	}
+	for (i = 0, job = first_job(); job && job->pid != (pid_t) pgrp; job = job->next, i++);
+	/* After the jobs come the foreground commands, which are children
+	 * of the shell in its own group */
+	if (!job && ((pid_t) pgrp != getpgrp() || (pid_t) ppid != getpid())) {
+		if (next->num_others == next->others_cap) {
+			next->others_cap = next->others_cap ? 2 * next->others_cap : 256;
+			if (!(next->others = realloc(next->others, next->others_cap * sizeof(*next->others)))) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		next->others[next->num_others++] = pid;
+		return;
+	}
+
+	/* CPU time since the previous sample, or since it started if it's new */
+	ticks = utime + stime;
+	key.pid = pid;
+	before = bsearch(&key, s->members, s->num_members, sizeof(key), &compare_pids);
+	totals[i].ticks += before && before->ticks <= ticks ? ticks - before->ticks : ticks;
+	if (next->num_members == next->members_cap) {
+		next->members_cap = next->members_cap ? 2 * next->members_cap : 64;
+		if (!(next->members = realloc(next->members, next->members_cap * sizeof(*next->members)))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	next->members[next->num_members].pid = pid;
+	next->members[next->num_members++].ticks = ticks;
+
+	totals[i].procs++;
+	totals[i].threads += threads;
+	totals[i].rss += rss;
+	if (busyness(state) > busyness(totals[i].state)) {
+		totals[i].state = state;
+	}
+	sprintf(path, "/proc/%d/io", (int) pid);
+	if (read_proc(path, buf, sizeof(buf)) > 0) {
+		if (NULL != (p = strstr(buf, "rchar: "))) {
+			totals[i].chars += (uint64_t) strtoul(p + 7, NULL, 10);
+		}
+		if (NULL != (p = strstr(buf, "wchar: "))) {
+			totals[i].chars += (uint64_t) strtoul(p + 7, NULL, 10);
+		}
+		if (NULL != (p = strstr(buf, "read_bytes: "))) {
+			totals[i].read += (uint64_t) strtoul(p + 12, NULL, 10);
+		}
+		if (NULL != (p = strstr(buf, "\nwrite_bytes: "))) {
+			totals[i].written += (uint64_t) strtoul(p + 14, NULL, 10);
+		}
+	}
+}
+
+/* Samples the processes of all jobs into totals, one per job and then
+ * one for the foreground commands. Returns the milliseconds since the
+ * previous sample, or -1 on failure. */
+long sample_jobs(Sampler *s, JobTotals *totals) {
+	Sampler next;
+	struct dirent *entry;
+	bool rescan = 0 == s->samples % JTOP_RESCAN;
+	struct timeval now;
+	long elapsed;
+	DIR *proc;
+
+	if (!(proc = opendir("/proc"))) {
+		perror("jtop: /proc");
+		return -1;
+	}
+	memset(&next, 0, sizeof(next));
+	while (NULL != (entry = readdir(proc))) {
+		pid_t pid;
+
+		if (!isdigit((unsigned char) entry->d_name[0])) {
+			continue;
+		}
+		pid = (pid_t) atoi(entry->d_name);
+		if (!rescan && bsearch(&pid, s->others, s->num_others, sizeof(pid), &compare_pids)) {
+			/* Was in no job, and most likely still isn't */
+			if (next.num_others == next.others_cap) {
+				next.others_cap = next.others_cap ? 2 * next.others_cap : 256;
+				if (!(next.others = realloc(next.others, next.others_cap * sizeof(*next.others)))) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			next.others[next.num_others++] = pid;
+			continue;
+		}
+		sample(s, &next, pid, totals);
+	}
+	closedir(proc);
+
+	/* Readdir lists /proc in pid order, but sort anyway to be sure */
+	qsort(next.members, next.num_members, sizeof(*next.members), &compare_pids);
+	qsort(next.others, next.num_others, sizeof(*next.others), &compare_pids);
+	free(s->members);
+	free(s->others);
+	gettimeofday(&now, NULL);
+	elapsed = 1000 * (now.tv_sec - s->when.tv_sec) + (now.tv_usec - s->when.tv_usec) / 1000;
+	next.samples = s->samples + 1;
+	next.when = now;
+	*s = next;
+	return elapsed;
+}
+
+/* Frees what the sampler has kept of the previous sample */
+void end_sampling(Sampler *s) {
+	free(s->members);
+	free(s->others);
+	memset(s, 0, sizeof(*s));
+}
+
+/* Formats bytes with a unit, to 6 characters */
+static const char *human(char *buf, uint64_t bytes) {
+	const char *units = "BKMGTP";
+	double value = (double) bytes;
+
+	while (value >= 1024 && units[1]) {
+		value /= 1024;
+		units++;
+	}
+	if ('B' == *units) {
+		sprintf(buf, "%5lu%c", (unsigned long) bytes, *units);
+	} else {
+		sprintf(buf, "%5.1f%c", value, *units);
+	}
+	return buf;
+}
+
+/* Sleeps unless interrupted by Ctrl-C */
+static void pause_ms(long ms) {
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = ms % 1000 * 1000000;
+	while (!interrupted && -1 == nanosleep(&ts, &ts) && EINTR == errno);
+}
+
+/* The built-in jtop command, showing the processes of each background
+ * job added up, every second until Ctrl-C. On anything but a terminal
+ * it shows them once. "-d seconds" sets how often, "-n count" how many
+ * times. */
+int jtop_cmd(char **args) {
+	long delay = 1000, count = isatty(STDOUT_FILENO) ? -1 : 1, elapsed, hz = sysconf(_SC_CLK_TCK);
+	unsigned long page = (unsigned long) sysconf(_SC_PAGESIZE);
+	bool clear = isatty(STDOUT_FILENO);
+	JobTotals *totals = NULL;
+	Sampler s;
+	size_t num_jobs, i;
+	const Job *job;
+	char *end;
+
+	for (args++; *args; args += 2) {
+		if (!args[1] || (0 != strcmp(args[0], "-d") && 0 != strcmp(args[0], "-n"))) {
+			fprintf(stderr, "jtop: usage: jtop [-d seconds] [-n count]\n");
+			return 2;
+		}
+		if ('d' == args[0][1]) {
+			delay = (long) (1000 * strtod(args[1], &end));
+		} else {
+			count = strtol(args[1], &end, 10);
+		}
+		if (*end || ('d' == args[0][1] ? delay : count) <= 0) {
+			fprintf(stderr, "jtop: %s: invalid number\n", args[1]);
+			return 2;
+		}
+	}
+
+	memset(&s, 0, sizeof(s));
+	gettimeofday(&s.when, NULL);
+	/* The first sample is only what later ones are compared with */
+	num_jobs = count_jobs();
+	if (!(totals = calloc(num_jobs + 1, sizeof(*totals)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	elapsed = sample_jobs(&s, totals);
+	pause_ms(JTOP_FIRST_MS);
+
+	while (-1 != elapsed && !interrupted && 0 != count) {
+		struct timeval before, after;
+		char rss[8], read[8], written[8];
+
+		reap_jobs();
+		num_jobs = count_jobs();
+		free(totals);
+		if (!(totals = calloc(num_jobs + 1, sizeof(*totals)))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		gettimeofday(&before, NULL);
+		if (-1 == (elapsed = sample_jobs(&s, totals))) {
+			break;
+		}
+		gettimeofday(&after, NULL);
+
+		if (clear) {
+			printf("\x1b[H\x1b[2J");
+		}
+		printf("%lu jobs, sampled in %ld us\n", (unsigned long) num_jobs,
+				1000000L * (after.tv_sec - before.tv_sec) + (after.tv_usec - before.tv_usec));
+		printf("JOB     PGID ST PROCS THREADS   CPU%%    RSS   READ  WRITE COMMAND\n");
+		for (i = 0, job = first_job(); job; job = job->next, i++) {
+			JobTotals *t = &totals[i];
+			printf("[%d]%*d %c  %5lu %7lu %6.1f %s %s %s %s\n", job->id, 9 - (job->id > 9) - (job->id > 99),
+					(int) job->pid, JOB_QUEUED == job->state ? 'Q' : t->state ? t->state : '-',
+					(unsigned long) t->procs, t->threads,
+					elapsed > 0 ? 100.0 * (double) t->ticks / (double) hz * 1000 / (double) elapsed : 0.0,
+					human(rss, (uint64_t) t->rss * page), human(read, t->read),
+					human(written, t->written), job->line);
+		}
+		fflush(stdout);
+		if (count > 0) {
+			count--;
+		}
+		if (0 != count) {
+			pause_ms(delay);
+		}
+	}
+	free(totals);
+	end_sampling(&s);
+	return -1 == elapsed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,20 +1,125 @@
 #include "main.h"
 
+/* Names of the supported built-in functions */
+static const char *builtins[] = {
+	"exit",
+	"cd",
+	"checkEnv",
+	"jobs",
+	"read",
+	"echo",
+	"true",
+	"false",
+	":",
+	"test",
+	"[",
+	"break",
+	"continue",
+	"xargs",
+	"set",
+	"alias",
+	"unalias",
+	"return",
+	"shift",
+	"stats",
+	"source",
+	".",
+	"defer",
+	"hash",
+	"enable",
+	"pushd",
+	"popd",
+	"dirs",
+	"jtop",
+	"export"
+};
+
+/* Pointers to the built-in functions that the shell supports */
+static int (*builtins_funcs[]) (char **) = {
+	&exit_cmd,
+	&cd_cmd,
+	&checkEnv_cmd,
+	&jobs_cmd,
+	&read_cmd,
+	&echo_cmd,
+	&true_cmd,
+	&false_cmd,
+	&true_cmd,
+	&test_cmd,
+	&test_cmd,
+	&break_cmd,
+	&continue_cmd,
+	&xargs_cmd,
+	&set_cmd,
+	&alias_cmd,
+	&unalias_cmd,
+	&return_cmd,
+	&shift_cmd,
+	&stats_cmd,
+	&source_cmd,
+	&source_cmd,
+	&defer_cmd,
+	&hash_cmd,
+	&enable_cmd,
+	&pushd_cmd,
+	&popd_cmd,
+	&dirs_cmd,
+	&jtop_cmd,
+	&export_cmd
+};
+
 static sigjmp_buf prompt_mark;
-static pid_t pid = -1;
+static pid_t shell_pid = -1;
+/* Foreground children, for passing SIGINT on to */
+static pid_t *fg_pids = NULL;
+static volatile size_t fg_count = 0;
+/* Whether a foreground process was run for the current input */
 static bool fg_process = false;
+/* Whether readline is waiting for input at the prompt */
+static volatile sig_atomic_t at_prompt = 0;
+volatile sig_atomic_t interrupted = 0;
+bool profile_startup = false;
+
+/* A pipeline fails if any of its commands do, rather than just the last */
+static bool pipefail = false;
+
+/* Options turned on by set -o and off by set +o */
+static const struct {
+	const char *name;
+	bool *value;
+} options[] = {
+	{ "pipefail", &pipefail }
+};
+#define NUM_OPTIONS ((int) (sizeof(options) / sizeof(*options)))
+
+/* Input of a command that spans several lines, such as a loop */
+static char *pending = NULL;
+static size_t pending_len = 0, pending_cap = 0;
+
+static int event_hook(void);
+static bool complete_command(const char *, size_t, size_t, Completions *);
+static void append_pending(const char *);
 
 /*
- * 1. Read input.
- * 2. Split into arguments and create CommandList struct.
- * 3. Execute each command and pipe if more than one,
- * in the background if '&' was found or foreground otherwise.
+ * 1. Read input, until it makes up complete commands.
+ * 2. Parse it into a tree of commands.
+ * 3. Execute the commands, piping if there is more than one in a
+ * pipeline, in the background if '&' was found or foreground otherwise.
+ *
+ * Given a script, run it instead of reading input. Otherwise, when
+ * interactive, source ~/.smshrc first.
  *
  * Make sure child processes are killed when parent is by registering signal handlers.
  */
-int main(void) {
+int main(int argc, char **argv) {
 	/* Register signal handler */
 	struct sigaction sa;
+	bool use_readline = true, interactive;
+	const char *replay_file = NULL;
+	long sessions = 1;
+	int arg;
+	/* Before anything of the shell's own is opened */
+	note_inherited_fds();
 	sa.sa_handler = &signal_handler;
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_NOCLDSTOP;
@@ -26,95 +131,141 @@ int main(void) {
 	/* Intercept SIGINT for parent and pass it to child */
 	TRY_OR_EXIT(sigaction(SIGINT, &sa, NULL), "sigaction");
 	TRY_OR_EXIT(sigaction(SIGTERM, &sa, NULL), "sigaction");
+	/* Wakes the wait for foreground commands, see stall.c */
+	TRY_OR_EXIT(sigaction(SIGALRM, &sa, NULL), "sigaction");
+
+	for (arg = 1; arg < argc && '-' == argv[arg][0] && '-' == argv[arg][1]; arg++) {
+		if (0 == strcmp(argv[arg], "--profile-startup")) {
+			profile_startup = true;
+		} else if (0 == strcmp(argv[arg], "--builtin-editor")) {
+			use_readline = false;
+		} else if (0 == strcmp(argv[arg], "--replay") && arg + 1 < argc) {
+			replay_file = argv[++arg];
+		} else if (0 == strcmp(argv[arg], "--sessions") && arg + 1 < argc && 0 < (sessions = atol(argv[arg + 1]))) {
+			arg++;
+		} else {
+			fprintf(stderr, "usage: " SMSH " [--profile-startup] [--builtin-editor] [--replay file [--sessions n]]"
+					" [script [arg ...]]\n");
+			return 2;
+		}
+	}
 
-	/* Set prompt mark here for jumping to from the signal handler */
-	while (0 != sigsetjmp(prompt_mark, 1));
+	shell_pid = getpid();
+	init_jobs();
+	init_stall();
 
-	/* Loop forever (until EOF), reading user input */
-	for (;;) {
-		/* Assume the length of the prompt
-		 * will never exceed 1024 characters. */
-		char prompt[1024], input[1024], *tmp;
-		struct timeval before, after;
-		CommandList commands;
-		pid_t zombie;
+	if (replay_file) {
+		/* A benchmark of recorded commands, instead of reading input */
+		char *exit_args[] = { "exit", NULL };
+		set_status(replay(replay_file, sessions));
+		return exit_cmd(exit_args);
+	}
 
-		/* Clear the buffers on the stack. */
-		memset(prompt, 0, sizeof(prompt));
-		memset(input, 0, sizeof(input));
+	if (arg < argc) {
+		/* Exits with the status of the script's last command. The
+		 * arguments after the script become $1 onwards. */
+		char *exit_args[] = { "exit", NULL };
+		set_arg0(argv[arg]);
+		set_positional(argv + arg + 1);
+		set_status(run_script(argv[arg]));
+		return exit_cmd(exit_args);
+	}
 
-		commands.bg = false;
-		commands.length = 0;
+	/* Let held back background jobs start, and deferred functions run,
+	 * while waiting for input. Readline only notices EOF without the
+	 * hook, so it's interactive only. */
+	if ((interactive = isatty(STDIN_FILENO))) {
+		init_editor(use_readline, &event_hook, &complete_command);
+		load_rc(profile_startup);
+	} else {
+		init_editor(use_readline, NULL, NULL);
+	}
 
-		/* Check for completed child processes */
-		while (0 < (zombie = waitpid(0, NULL, WNOHANG))) {
-			printf("%d done\n", (int) zombie);
-		}
-		fflush(stdout);
+	/* Set prompt mark here for jumping to from the signal handler */
+	if (SIGINT == sigsetjmp(prompt_mark, 1)) {
+		/* Ctrl-C throws away a partially entered command */
+		pending_len = 0;
+	}
 
-		if (NULL == getcwd(prompt, 1024)) {
-			/* Ignore the error and continue;
-			 * if the path is greater than 1024 characters
-			 * then it probably doesn't fare well from being
-			 * used as a prompt anyway. */
+	/* Loop forever (until EOF), reading user input */
+	for (;;) {
+		char *tmp;
+		uint64_t time_taken;
+		struct timeval before, after;
+		Node *commands;
+		bool incomplete, cached;
+		int status;
+
+		/* Check for completed child processes and
+		 * start any held back jobs that may run now. */
+		reap_jobs();
+		run_queued_jobs();
+		if (interactive && !pending_len) {
+			/* Rank where the last command left the shell for cd */
+			note_cwd();
 		}
-		substitute_home(prompt);
-		strcat(prompt, " ¥ ");
-
-		/* tmp is allocated in readline and it's the callee's (our)
-		 * obligation to free it. */
-		tmp = readline(prompt);
+		/* The editor reads the input a byte at a time from here on */
+		sync_input();
+
+		/* tmp is allocated by the editor and it's the callee's (our)
+		 * obligation to free it. A command that continues on this
+		 * line gets "> " for a prompt. */
+		at_prompt = 1;
+		tmp = edit_line(pending_len ? "> " : build_prompt());
+		at_prompt = 0;
 		/* On e.g. Ctrl-D the input is null and the shell is exited */
-		if (!tmp) break;
-
-		/* ENTERING CRITICAL AREA */
-		TRY_OR_EXIT(sighold(SIGINT), "sighold");
-
-		/* parse_commands modifies input - copy and save for adding to history */
-		strcpy(input, tmp);
-		free(tmp);
+		if (!tmp) {
+			if (pending_len) {
+				fprintf(stderr, SMSH ": unexpected end of file\n");
+			}
+			break;
+		}
 
-		if (*input) {
+		if (*tmp) {
 			/* Add command line history for the user's convenience */
-			add_history(input);
+			remember_line(tmp);
 		}
+		append_pending(tmp);
+		if (pending_len > strlen(tmp) + 1 && heredoc_awaited()) {
+			/* Within a here-document, only its delimiter can end the input */
+			const char *line = tmp;
+			while ('\t' == *line) {
+				line++;
+			}
+			if (0 != strcmp(line, heredoc_awaited())) {
+				free(tmp);
+				continue;
+			}
+		}
+		free(tmp);
 
-		/* 2. Parse arguments into commands. */
-		parse_commands(&commands, input);
-
-		if (0 == commands.length) {
-			free(commands.cmds);
-			/* For some reason an empty command was received. */
+		/* 2. Parse the input into commands, unless it continues on the next line. */
+		commands = parse_line(pending, &incomplete, &cached);
+		if (incomplete) {
+			continue;
+		}
+		pending_len = 0;
+		if (!commands) {
+			/* Either empty or a syntax error, which has been printed. */
 			continue;
 		}
 
+		fg_process = false;
+		interrupted = 0;
 		gettimeofday(&before, NULL);
-		exec(&commands);
-		/* EXITING CRITICAL AREA */
-		TRY_OR_EXIT(sigrelse(SIGINT), "sigrelse");
-
-		if (fg_process) {
-			int status;
-			uint64_t time_taken;
-
-			TRY_OR_EXIT(sighold(SIGCHLD), "sighold");
-
-			/* Wait for foreground process */
-			while (-1 != waitpid(pid, &status, 0));
-			if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
-				/* An error occurred during the execution.
-				 * Do not print the time it took to run the command. */
-				continue;
-			}
-			gettimeofday(&after, NULL);
-
-			TRY_OR_EXIT(sigrelse(SIGCHLD), "sigrelse");
+		status = exec_node(commands);
+		if (!cached) {
+			free_node(commands);
+		}
 
-			time_taken = (uint64_t) (1000 * (after.tv_sec - before.tv_sec) +
-					(after.tv_usec - before.tv_usec) / 1000);
+		gettimeofday(&after, NULL);
+		time_taken = (uint64_t) (1000 * (after.tv_sec - before.tv_sec) +
+				(after.tv_usec - before.tv_usec) / 1000);
+		prompt_duration(time_taken);
+		if (fg_process && EXIT_SUCCESS == status) {
+			/* Only print the time it took when the commands succeeded */
 			printf("%" PRIu64 " ms\n", time_taken);
 			fflush(stdout);
-			fg_process = false;
 		}
 	}
 
@@ -122,259 +273,524 @@ int main(void) {
 	return exit_cmd(NULL);
 }
 
-void exec(CommandList *commands) {
-	fg_process = !commands->bg;
+/* Adds a line of input to what's read so far of a command */
+static void append_pending(const char *line) {
+	size_t len = strlen(line);
 
-	if (1 == commands->length) {
-		if (EXIT_SUCCESS != exec_cmd(commands->cmds[0])) {
-			/* Execute of command failed */
-			fg_process = false;
+	if (pending_len + len + 2 > pending_cap) {
+		while (pending_len + len + 2 > pending_cap) {
+			pending_cap = pending_cap ? 2 * pending_cap : 1024;
 		}
-	} else {
-		size_t i;
-		int ret;
-		/* Commands were piped, handle it accordingly.
-		 *
-		 * To prevent the signal handler from registering
-		 * when commands in the pipeline finishes, the SIGCHLD
-		 * signal is masked during execution.
-		 *
-		 * The process is forked to allow for commands like
-		 * `sleep 10 | ls | sort` to both be run in the foreground
-		 * and suspend prompt until finished, and be run in the
-		 * background and immediately return the prompt to the
-		 * user.
-		 */
-		TRY_OR_EXIT(sighold(SIGCHLD), "sighold");
-		switch (pid = fork()) {
-			case -1:
-				/* Skip the execution of a command and
-				 * try again at the next prompt. */
-				perror("fork");
-				fg_process = false;
-				break;
-			case 0:
-				ret = exec_commands(commands, 0, STDIN_FILENO);
-				free(commands->cmds);
-				while (-1 != waitpid(-getpgid(pid), NULL, 0)) {
-					exit(EXIT_FAILURE);
-				}
-				exit(ret);
-			default:
-				pid = -getpgid(pid);
-				for (i = 0; i < commands->length; i++) {
-					free(commands->cmds[i]->args);
-					free(commands->cmds[i]);
-				}
+		if (!(pending = realloc(pending, pending_cap))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
 		}
-		TRY_OR_EXIT(sigrelse(SIGCHLD), "sigrelse");
 	}
+	memcpy(pending + pending_len, line, len);
+	pending_len += len;
+	pending[pending_len++] = '\n';
+	pending[pending_len] = 0;
+}
 
-	free(commands->cmds);
+/* Called by the line editor while it waits for input */
+static int event_hook(void) {
+	const char *prompt;
+
+	/* Signals mustn't jump to the prompt out of what's done here, which
+	 * may hold the job pool's lock or be in the middle of a malloc */
+	at_prompt = 0;
+	if (jobs_pending()) {
+		/* Move off the prompt line, start the job and redraw the prompt */
+		leave_prompt();
+		run_queued_jobs();
+		back_to_prompt();
+	}
+	/* Get what's being typed ready to run */
+	speculate(edited_line());
+	if (deferred_pending() && !*edited_line()) {
+		/* Nothing typed yet, so run the next deferred function. It runs
+		 * as if off the prompt, with the terminal as commands expect it. */
+		leave_prompt();
+		run_deferred(NULL);
+		interrupted = 0;
+		back_to_prompt();
+	}
+	if (check_stalls()) {
+		leave_prompt();
+		report_stalls();
+		back_to_prompt();
+	}
+	if (!pending_len && NULL != (prompt = update_prompt())) {
+		/* The state of the git repository came in */
+		set_prompt(prompt);
+	}
+	at_prompt = 1;
+	if (interrupted) {
+		/* Ctrl-C came while it was held off, and clears the line now */
+		interrupted = 0;
+		raise(SIGINT);
+	}
+	return 0;
 }
 
-void parse_commands(CommandList *commands, char *input) {
-	/* Split the inputs into commands by using the pipeline as a deliminator */
-	const char *pipe_delim = "|", *delim = " ";
-	char *save_pipe_ptr, *save_space_ptr;
-	char *cmd_str = strtok_r(input, pipe_delim, &save_pipe_ptr);
-
-	size_t cmds_buf_len = 2;
-	commands->cmds = calloc(cmds_buf_len, sizeof(*commands->cmds));
-
-	while (NULL != cmd_str) {
-		/* Split the command into tokens by using space as a deliminator */
-		char *arg_str = strtok_r(cmd_str, delim, &save_space_ptr);
-		size_t args_buf_len = 3;
-
-		/* The callee should free this after processing the command */
-		Command *command = malloc(sizeof(*command));
-		command->num_args = 0;
-		command->args = calloc(args_buf_len, sizeof(*command->args));
-
-		/* Adds all the tokens to the command arguments, including the command itself */
-		while (NULL != arg_str) {
-			/* If a previous command indicated bg it indicates a parse error.
-			 * Only the last command can have & as an indicator. */
-			if (commands->bg) {
-				size_t i;
-				for (i = 0; i < commands->length; i++) {
-					free(commands->cmds[i]->args);
-					free(commands->cmds[i]);
-				}
-				free(command->args);
-				free(command);
+/* Completes the first word of a command with the names of builtins,
+ * functions and commands in the PATH. Other words are file names. */
+static bool complete_command(const char *line, size_t start, size_t end, Completions *c) {
+	size_t i = start;
+	int j;
 
-				commands->length = 0;
-				/* If '&' already was seen then it's not the last symbol */
-				fprintf(stderr, SMSH ": unexpected token '&'\n");
-				return;
-			}
+	while (i > 0 && (' ' == line[i - 1] || '\t' == line[i - 1])) {
+		i--;
+	}
+	if ((i > 0 && !strchr(";|&({", line[i - 1])) || memchr(line + start, '/', end - start)) {
+		return false;
+	}
+	for (j = 0; j < NUM_BUILTINS; j++) {
+		if (0 == strncmp(builtins[j], line + start, end - start)) {
+			add_completion(c, builtins[j]);
+		}
+	}
+	complete_functions(line + start, end - start, c);
+	complete_commands(line + start, end - start, c);
+	return true;
+}
 
-			if (0 == strcmp(arg_str, "&")) {
-				commands->bg = true;
-			} else {
-				/* grow args buffer if necessary */
-				if (command->num_args + 1 >= args_buf_len) {
-					args_buf_len += 2;
-					command->args = realloc(command->args, args_buf_len * sizeof(*command->args));
-					if (!command->args) {
-						perror("realloc");
-						exit(EXIT_FAILURE);
-					}
-				}
+/* Returns the function of a builtin, or NULL if there's no such builtin */
+int (*builtin_func(const char *name))(char **) {
+	const SmshBuiltin *loadable;
+	int i;
+	for (i = 0; i < NUM_BUILTINS; i++) {
+		if (0 == strcmp(name, builtins[i])) {
+			return builtins_funcs[i];
+		}
+	}
+	/* Then those loaded with enable -f */
+	loadable = find_loadable(name);
+	return loadable ? loadable->func : NULL;
+}
 
-				command->args[command->num_args++] = arg_str;
-				/* Terminate the list with a NULL pointer as expected by execv */
-				command->args[command->num_args] = NULL;
+/* Waits for the foreground processes, storing their exit statuses.
+ * Returns the status of the last. */
+static int wait_fg(pid_t *pids, size_t n, int *statuses) {
+	int status = EXIT_SUCCESS;
+	struct timeval since;
+	size_t i;
+
+	fg_pids = pids;
+	fg_count = n;
+	watch_fg(true);
+	gettimeofday(&since, NULL);
+	for (i = 0; i < n; i++) {
+		int raw;
+		while (-1 == waitpid(pids[i], &raw, 0)) {
+			if (EINTR != errno) {
+				/* The process was already waited for, somehow */
+				raw = EXIT_FAILURE << 8;
+				break;
+			}
+			/* Woken up by the timer, maybe */
+			run_queued_jobs();
+			if (check_stalls()) {
+				report_stalls();
 			}
-			arg_str = strtok_r(NULL, delim, &save_space_ptr);
 		}
+		status = statuses[i] = exit_status(raw);
+	}
+	count_wait(&since);
+	watch_fg(false);
+	fg_count = 0;
+	fg_pids = NULL;
+	return status;
+}
 
-		/* grow commands buffer if necessary */
-		if (commands->length + 1 >= cmds_buf_len) {
-			cmds_buf_len += 2;
-			commands->cmds = realloc(commands->cmds, cmds_buf_len * sizeof(*commands->cmds));
-			if (!commands->cmds) {
-				perror("realloc");
-				exit(EXIT_FAILURE);
-			}
+/* Runs a pipeline, returning the exit status of its last command, or
+ * with pipefail of the last to fail. Background jobs succeed as soon as
+ * they've been started. */
+int exec(CommandList *commands) {
+	int status;
+
+	if (commands->bg || 1 < commands->length) {
+		status = exec_commands(commands);
+	} else if (commands->cmds[0]->compound) {
+		/* Compound commands run within the shell */
+		SavedInput saved;
+
+		status = EXIT_FAILURE;
+		if (redirect_shell(commands->cmds[0]->redirects, &saved)) {
+			status = exec_node(commands->cmds[0]->compound);
+			restore_shell(&saved);
 		}
-		commands->cmds[commands->length++] = command;
-		cmd_str = strtok_r(NULL, pipe_delim, &save_pipe_ptr);
+		set_pipe_status(&status, 1);
+	} else {
+		status = exec_cmd(commands->cmds[0]);
+		set_pipe_status(&status, 1);
+	}
 
+	if (commands->negate) {
+		status = EXIT_SUCCESS == status ? EXIT_FAILURE : EXIT_SUCCESS;
 	}
+	return status;
 }
 
+/* Runs a single command in the foreground */
 int exec_cmd(Command *command) {
-	/* Check for command in builtins first.
+	size_t num_assignments = count_assignments(command->args), i;
+	char **args = expand_args(command->args + num_assignments);
+	ShellFunction *function = NULL;
+	int (*builtin)(char **) = NULL;
+	pid_t child;
+	int input, status;
+
+	if (interrupted) {
+		/* The expansion failed */
+		free(args);
+		return EXIT_FAILURE;
+	}
+	if (args[0]) {
+		if (deferred_pending()) {
+			/* What the command needs, such as its alias, may be deferred */
+			run_deferred(args[0]);
+		}
+		function = find_function(command->args[num_assignments], args[0]);
+		builtin = function ? NULL : builtin_func(args[0]);
+	}
+
+	/* Check for command in functions and builtins first.
 	 * If it does not exist there then assume it's an existing command. */
-	int i;
-	for (i = 0; i < NUM_BUILTINS; i++) {
-		if (0 == strcmp(command->args[0], builtins[i])) {
-			int ret = (*builtins_funcs[i])(command->args);
-			free(command->args);
-			free(command);
-			return ret;
+	if (!args[0] || function || builtin) {
+		SavedInput saved;
+
+		if (!redirect_shell(command->redirects, &saved)) {
+			free(args);
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < num_assignments; i++) {
+			assign(command->args[i], false);
+		}
+		if (function) {
+			status = call_function(function, args);
+		} else {
+			status = builtin ? builtin(args) : EXIT_SUCCESS;
 		}
+		restore_shell(&saved);
+		free(args);
+		return status;
 	}
 
+	if (-2 == (input = open_input(command->redirects))) {
+		free(args);
+		return EXIT_FAILURE;
+	}
+
+	/* Looked up in the shell, so the PATH cache keeps the result */
+	resolve_command(args[0]);
+	/* Children share the offsets of files read has buffered */
+	sync_input();
+	fflush(NULL);
+
 	/* Fork the process and execute the command on the child process */
-	TRY_OR_EXIT(pid = fork(), "fork");
+	if (-1 == (child = fork())) {
+		perror("fork");
+		free(args);
+		if (-1 != input) {
+			close(input);
+		}
+		return EXIT_FAILURE;
+	}
 
-	if (0 == pid) { /* Start execution as child */
-		return run_cmd(command);
+	if (0 == child) { /* Start execution as child */
+		if (-1 != input) {
+			TRY_OR_EXIT(dup2(input, STDIN_FILENO), "dup2");
+			close(input);
+		}
+		for (i = 0; i < num_assignments; i++) {
+			assign(command->args[i], true);
+		}
+		return run_cmd(args);
 	}
 
 	/* Continue execution as parent */
-	free(command->args);
-	free(command);
-	return EXIT_SUCCESS;
+	free(args);
+	if (-1 != input) {
+		close(input);
+	}
+	fg_process = true;
+	return wait_fg(&child, 1, &status);
+}
+
+/* Space for the arguments of a command: ARG_MAX less the environment,
+ * which counts against the same limit. */
+long arg_space(void) {
+	long space = sysconf(_SC_ARG_MAX);
+	char **env;
+
+	if (space <= 0) {
+		/* The least POSIX allows */
+		space = 4096;
+	}
+	for (env = environ; *env; env++) {
+		space -= (long) (strlen(*env) + 1 + sizeof(*env));
+	}
+	/* Leave some headroom, as xargs does */
+	return space - 2048;
 }
 
-int run_cmd(Command *command) {
-	execvp(command->args[0], command->args);
+int run_cmd(char **args) {
+	long space = arg_space(), longest = 32 * sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	/* Rather than failing inside execvp, tell how far over the limit it is */
+	for (i = 0; args[i]; i++) {
+		long len = (long) strlen(args[i]);
+		if (len >= longest) {
+			fprintf(stderr, SMSH ": %s: argument %lu is too long (%ld bytes, the limit is %ld)\n",
+				args[0], (unsigned long) i, len, longest - 1);
+			exit(EXIT_FAILURE);
+		}
+		space -= len + 1 + (long) sizeof(*args);
+	}
+	if (space < 0) {
+		fprintf(stderr, SMSH ": %s: argument list too long (%lu arguments, %ld bytes over ARG_MAX)\n",
+			args[0], (unsigned long) i, -space);
+		exit(EXIT_FAILURE);
+	}
+
+	hide_shell_fds();
+	/* The shell looked the command up before forking. If it has moved
+	 * since, or isn't a binary, execvp sorts it out. */
+	exec_resolved(args);
+	execvp(args[0], args);
 	/* If we end up here an error has occurred */
 	perror(SMSH);
-	free(command->args);
-	free(command);
 	exit(EXIT_FAILURE);
 }
 
-int exec_commands(CommandList *commands, const size_t cmd_index, const int fd_in) {
-	Pipe pipefd;
-	int ret, status;
-	pid_t this_pid;
+/* Runs a command of a pipeline in its forked process */
+static int run_stage(Command *command, char **args, bool piped, bool last) {
+	size_t num_assignments, i;
+	int (*builtin)(char **);
+	ShellFunction *function;
+
+	if (command->compound) {
+		Node *node = command->compound;
+		if (piped && only_builtins(node)) {
+			/* Nothing but the shell reads the pipe, so read may buffer it */
+			claim_input(STDIN_FILENO, true);
+		}
+		/* Already in a process of its own */
+		return exec_node(NODE_SUBSHELL == node->type ? node->body : node);
+	}
 
-	if (cmd_index == commands->length - 1) {
-		/* The last command in the pipeline is special cased as it
-		 * shouldn't call itself recursively and additionally not
-		 * redirect STDOUT. */
-		size_t i;
-		TRY(pid = fork(), "fork");
-		if (0 == pid) {
-			/* Redirect the previous command's pipe to this
-			 * command's STDIN. */
-			TRY(dup2(fd_in, STDIN_FILENO), "dup2");
-			TRY(close(fd_in), "previous FD");
-			/* Hard code support for the `pager` command in pipes */
-			if (0 == strcmp(commands->cmds[cmd_index]->args[0], "pager")) {
-				const char *pager = getenv("PAGER");
-				/* If the PAGER environment variable contains something,
-				 * that command is tried first. */
-				if (pager) {
-					if (-1 == execlp(pager, pager, (char *) NULL)) {
-						perror(SMSH);
-					}
-				}
-				/* If that fails, less is tried */
-				if (-1 == execlp("less", "less", (char *) NULL)) {
-					perror(SMSH);
-				}
-				/* Finally, more is tried */
-				if (-1 == execlp("more", "more", (char *) NULL)) {
-					perror(SMSH);
-				}
-				/* If everything fails then exit the child with EXIT_FAILURE */
-				free(commands->cmds);
-				exit(EXIT_FAILURE);
+	num_assignments = count_assignments(command->args);
+	for (i = 0; i < num_assignments; i++) {
+		assign(command->args[i], true);
+	}
+	if (!args[0]) {
+		return EXIT_SUCCESS;
+	}
+	if (deferred_pending()) {
+		run_deferred(args[0]);
+	}
+	if (NULL != (function = find_function(command->args[num_assignments], args[0]))) {
+		return call_function(function, args);
+	}
+
+	/* Hard code support for the `pager` command in pipes */
+	if (last && 0 == strcmp(args[0], "pager")) {
+		const char *pager = getenv("PAGER");
+		hide_shell_fds();
+		/* If the PAGER environment variable contains something,
+		 * that command is tried first. */
+		if (pager) {
+			if (-1 == execlp(pager, pager, (char *) NULL)) {
+				perror(SMSH);
 			}
-			return run_cmd(commands->cmds[cmd_index]);
 		}
+		/* If that fails, less is tried */
+		if (-1 == execlp("less", "less", (char *) NULL)) {
+			perror(SMSH);
+		}
+		/* Finally, more is tried */
+		if (-1 == execlp("more", "more", (char *) NULL)) {
+			perror(SMSH);
+		}
+		/* If everything fails then exit the child with EXIT_FAILURE */
+		return EXIT_FAILURE;
+	}
 
-		/* Close the file descriptor from the
-		 * previous command's pipe. */
-		TRY(close(fd_in), "previous FD");
-
-		/* Free the commands as they are no longer needed */
-		for (i = 0; i < commands->length; i++) {
-			free(commands->cmds[i]->args);
-			free(commands->cmds[i]);
+	if (NULL != (builtin = builtin_func(args[0]))) {
+		const SmshBuiltin *loadable = find_loadable(args[0]);
+		if (loadable && !(loadable->flags & SMSH_PIPELINE_SAFE)) {
+			fprintf(stderr, SMSH ": %s: can't run in a pipeline or the background\n", args[0]);
+			return EXIT_FAILURE;
 		}
-		return EXIT_SUCCESS;
+		return builtin(args);
 	}
+	return run_cmd(args);
+}
 
-	/* The following code is for the general recursion,
-	 * i.e. first to second to last commands. */
+/* Forks every command in the pipeline, each reading the output of the
+ * one before it. Returns the exit status of the last command, or for
+ * background jobs success once they've been started. */
+int exec_commands(CommandList *commands) {
+	const char *held = NULL;
+	Pipe gate = { -1, -1 };
+	pid_t *pids, pgid = 0;
+	int fd_in = STDIN_FILENO, status = EXIT_SUCCESS, *statuses;
+	size_t i, started = 0;
+
+	if (commands->bg && NULL != (held = hold_job())) {
+		/* Held back; the processes are forked but wait at the gate */
+		TRY(shell_pipe(gate), "pipe");
+	}
+	if (!(pids = malloc(commands->length * sizeof(*pids))) ||
+			!(statuses = malloc(commands->length * sizeof(*statuses)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
 
-	TRY(pipe(pipefd), "pipe");
-	TRY(pid = fork(), "fork");
+	/* Children share the offsets of files read has buffered */
+	sync_input();
+	fflush(NULL);
+
+	for (i = 0; i < commands->length; i++) {
+		Command *command = commands->cmds[i];
+		bool last = i + 1 == commands->length;
+		Pipe pipefd = { -1, -1 };
+		char **args = NULL;
+		pid_t child;
+		int input;
+
+		if (!command->compound) {
+			/* Expand in the shell, so all commands see the same values */
+			args = expand_args(command->args + count_assignments(command->args));
+			if (interrupted) {
+				/* The expansion failed */
+				free(args);
+				break;
+			}
+			if (args[0]) {
+				/* Looked up in the shell, so the PATH cache keeps the result */
+				resolve_command(args[0]);
+			}
+		}
+		if (-2 == (input = open_input(command->redirects))) {
+			free(args);
+			break;
+		}
+		if (!last && -1 == shell_pipe(pipefd)) {
+			perror("pipe");
+			free(args);
+			if (-1 != input) {
+				close(input);
+			}
+			break;
+		}
+		if (-1 == (child = fork())) {
+			perror("fork");
+			free(args);
+			if (-1 != input) {
+				close(input);
+			}
+			if (!last) {
+				close(pipefd[PIPE_READ_SIDE]);
+				close(pipefd[PIPE_WRITE_SIDE]);
+			}
+			break;
+		}
 
-	if (0 == pid) {
-		/* fd_in is STDIN for the very first command */
-		if (fd_in != STDIN_FILENO) {
-			/* Redirect input pipes */
-			TRY(dup2(fd_in, STDIN_FILENO), "dup2");
-			TRY(close(fd_in), "previous FD");
+		if (0 == child) {
+			if (commands->bg) {
+				/* Background jobs get a process group of their own */
+				TRY_OR_EXIT(setpgid(0, pgid), "setpgid");
+			}
+			if (-1 != gate[PIPE_READ_SIDE]) {
+				char c;
+				close(gate[PIPE_WRITE_SIDE]);
+				while (-1 == read(gate[PIPE_READ_SIDE], &c, 1) && EINTR == errno);
+				close(gate[PIPE_READ_SIDE]);
+			}
+			/* fd_in is STDIN for the very first command */
+			if (fd_in != STDIN_FILENO) {
+				/* Redirect input pipes */
+				TRY_OR_EXIT(dup2(fd_in, STDIN_FILENO), "dup2");
+				TRY_OR_EXIT(close(fd_in), "previous FD");
+			}
+			if (-1 != input) {
+				/* A here-document takes the place of the pipe */
+				TRY_OR_EXIT(dup2(input, STDIN_FILENO), "dup2");
+				close(input);
+			}
+			if (!last) {
+				/* Redirect the output pipes */
+				TRY_OR_EXIT(dup2(pipefd[PIPE_WRITE_SIDE], STDOUT_FILENO), "dup2");
+				TRY_OR_EXIT(close(pipefd[PIPE_WRITE_SIDE]), "pipe write");
+				TRY_OR_EXIT(close(pipefd[PIPE_READ_SIDE]), "pipe read");
+			}
+			exit(run_stage(command, args, 0 < i, last));
 		}
 
-		/* Redirect the output pipes */
-		TRY(dup2(pipefd[PIPE_WRITE_SIDE], STDOUT_FILENO), "dup2");
-		TRY(close(pipefd[PIPE_WRITE_SIDE]), "pipe write");
-		TRY(close(pipefd[PIPE_READ_SIDE]), "pipe read");
+		if (commands->bg) {
+			/* Also set it here to not race with the child */
+			setpgid(child, pgid ? pgid : child);
+		}
+		if (!pgid) {
+			pgid = child;
+		}
+		pids[started++] = child;
+		free(args);
+		if (-1 != input) {
+			close(input);
+		}
 
-		return run_cmd(commands->cmds[cmd_index]);
+		/* Close the pipes and continue with the next command */
+		if (fd_in != STDIN_FILENO) {
+			close(fd_in);
+		}
+		if (!last) {
+			close(pipefd[PIPE_WRITE_SIDE]);
+			fd_in = pipefd[PIPE_READ_SIDE];
+		}
+	}
+	if (fd_in != STDIN_FILENO && started < commands->length) {
+		/* The pipeline was cut short */
+		close(fd_in);
+	}
+	if (-1 != gate[PIPE_READ_SIDE]) {
+		close(gate[PIPE_READ_SIDE]);
+		if (0 == started) {
+			close(gate[PIPE_WRITE_SIDE]);
+		}
 	}
 
-	/* Close the pipes and recurse */
-	TRY(close(pipefd[PIPE_WRITE_SIDE]), "pipe write");
-	if (fd_in != STDIN_FILENO) {
-		TRY(close(fd_in), "previous FD");
+	if (commands->bg) {
+		add_job(started ? pgid : 0, commands->text, gate[PIPE_WRITE_SIDE], started, held);
+		set_pipe_status(&status, 1);
+		free(pids);
+		free(statuses);
+		return EXIT_SUCCESS;
 	}
 
-	this_pid = pid;
-	ret = exec_commands(commands, cmd_index + 1, pipefd[PIPE_READ_SIDE]);
-	if (-1 != waitpid(this_pid, &status, 0) &&
-			(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)) {
-		/* The process was exited with an error (or not at all). */
-		return EXIT_FAILURE;
+	fg_process = true;
+	status = wait_fg(pids, started, statuses);
+	set_pipe_status(statuses, started);
+	for (i = 0; pipefail && i < started; i++) {
+		if (EXIT_SUCCESS != statuses[i]) {
+			status = statuses[i];
+		}
 	}
-	return ret;
+	free(pids);
+	free(statuses);
+	return status;
 }
 
 /* The built-in exit command */
 int exit_cmd(char **args) {
-	(void) args; /* Workaround for unused variable */
+	/* exit n, or plain exit with the status of the last command */
+	int status = EXIT_SUCCESS;
+	if (args) {
+		status = (args[1] ? atoi(args[1]) : atoi(get_var("?"))) & 0xff;
+	}
 #if SIGDET
 	/* "If the action for the SIGCHLD signal is set to SIG_IGN,
 	 * child processes of the calling processes shall
@@ -386,74 +802,41 @@ int exit_cmd(char **args) {
 	}
 #endif
 
-	/* Ignore SIGTERM in parent and send it to all child processes */
-	if (SIG_ERR == signal(SIGTERM, SIG_IGN)) {
-		perror("signal");
-		exit(EXIT_FAILURE);
-	}
-	if (-1 == kill(0, SIGTERM)) {
-		perror("kill");
-		exit(EXIT_FAILURE);
+	/* Background jobs live in process groups of their own */
+	kill_jobs();
+
+	/* Ignore SIGTERM in parent and send it to all child processes. The
+	 * whole process group is only signalled when the shell leads it;
+	 * otherwise it shares the group with whatever ran it, such as
+	 * another shell running it as a script. */
+	if (getpgrp() == getpid()) {
+		if (SIG_ERR == signal(SIGTERM, SIG_IGN)) {
+			perror("signal");
+			exit(EXIT_FAILURE);
+		}
+		if (-1 == kill(0, SIGTERM)) {
+			perror("kill");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		size_t i;
+		for (i = 0; i < fg_count; i++) {
+			kill(fg_pids[i], SIGTERM);
+		}
 	}
 
 #if !SIGDET
 	/* Poll and wait for child processes to finish */
-	while (-1 != waitpid(0, NULL, 0));
+	while (-1 != waitpid(-1, NULL, 0));
 #endif
 
-	exit(EXIT_SUCCESS);
-}
-
-static int cd(const char *dir) {
-	if (0 != chdir(dir)) {
-		perror("cd");
-	}
-	/* This is a workaround to prevent
-	 * the running time for the cd command
-	 * to print on completion. */
-	return EXIT_FAILURE;
-}
-
-/* The built-in cd command */
-int cd_cmd(char **args) {
-	/* For simplicity's sake, the directory is expected
-	 * to never be larger than 1024 characters.
-	 *
-	 * Additionally, $HOME is assumed to always be set
-	 * for the same reason. If it's undefined there's
-	 * nothing to do anyway. */
-	char dir[1024], *tmp;
-	memset(dir, 0, sizeof(dir));
-
-	if (!args[1]) {
-		/* 0 arguments given. */
-		return cd(getenv("HOME"));
-	}
-
-	if (args[2]) {
-		/* 2 (or more) arguments given. */
-		fprintf(stderr, "cd: only one argument is supported.\n");
-		return EXIT_FAILURE;
-	}
-
-	/* One argument was given; the directory.
-	 * First, perform substitution on ~, should it exist. */
-	tmp = args[1];
-	if (tmp[0] == '~') {
-		strcpy(dir, getenv("HOME"));
-		/* Copy everything after ~ to the dir. */
-		strcat(dir, &tmp[1]);
-	} else {
-		strcat(dir, tmp);
-	}
-
-	return cd(dir);
+	exit(status);
 }
 
 /* Used for creating commands in checkEnv to be passed into
  * exec. */
 #define CREATE_COMMAND(cmd) \
-cmd = malloc(sizeof(*cmd)); \
+cmd = calloc(1, sizeof(*cmd)); \
 cmd->num_args = 1; \
 cmd->args = calloc(2, sizeof(*cmd->args)); \
 cmd->args[0] = (char *) cmd ## _ ## s; \
@@ -467,10 +850,13 @@ static const char *grep_s = "grep";
 /* The built-in checkEnv command */
 int checkEnv_cmd(char **args) {
 	CommandList commands;
-	Command *printenv, *grep, *sort, *pager;
+	Command *printenv, *grep = NULL, *sort, *pager;
+	size_t i;
+	int status;
 
 	commands.bg = false;
 	commands.length = 0;
+	commands.text = NULL;
 	commands.cmds = calloc(args[1] ? 4 : 3, sizeof(*commands.cmds));
 
 	CREATE_COMMAND(printenv);
@@ -478,8 +864,7 @@ int checkEnv_cmd(char **args) {
 	/* If an argument is passed to checkEnv, pipe printenv into
 	 * grep with the supplied arguments. */
 	if (args[1]) {
-		size_t i;
-		grep = malloc(sizeof(*grep));
+		grep = calloc(1, sizeof(*grep));
 		grep->num_args = 0;
 		while (args[grep->num_args]) {
 			grep->num_args++;
@@ -487,7 +872,8 @@ int checkEnv_cmd(char **args) {
 		grep->args = calloc(grep->num_args + 1, sizeof(*grep->args));
 		grep->args[0] = (char *) grep_s;
 		for (i = 1; i < grep->num_args; i++) {
-			grep->args[i] = args[i];
+			/* The arguments are already expanded */
+			grep->args[i] = quote_word(args[i]);
 		}
 		commands.cmds[commands.length++] = grep;
 	}
@@ -495,7 +881,87 @@ int checkEnv_cmd(char **args) {
 	CREATE_COMMAND(sort);
 	CREATE_COMMAND(pager);
 
-	exec(&commands);
+	status = exec(&commands);
+
+	if (grep) {
+		for (i = 1; i < grep->num_args; i++) {
+			free(grep->args[i]);
+		}
+	}
+	for (i = 0; i < commands.length; i++) {
+		free(commands.cmds[i]->args);
+		free(commands.cmds[i]);
+	}
+	free(commands.cmds);
+	return status;
+}
+
+/* The built-in echo command */
+int echo_cmd(char **args) {
+	bool newline = true;
+	size_t i = 1;
+
+	if (args[1] && 0 == strcmp(args[1], "-n")) {
+		newline = false;
+		i++;
+	}
+	for (; args[i]; i++) {
+		fputs(args[i], stdout);
+		if (args[i + 1]) {
+			putchar(' ');
+		}
+	}
+	if (newline) {
+		putchar('\n');
+	}
+	return ferror(stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* The built-in true and : commands */
+int true_cmd(char **args) {
+	(void) args; /* Workaround for unused variable */
+	return EXIT_SUCCESS;
+}
+
+/* The built-in false command */
+int false_cmd(char **args) {
+	(void) args; /* Workaround for unused variable */
+	return EXIT_FAILURE;
+}
+
+/* The built-in stats command, printing the shell's own counters */
+int stats_cmd(char **args) {
+	(void) args; /* Workaround for unused variable */
+	parse_stats();
+	path_stats();
+	return EXIT_SUCCESS;
+}
+
+/* The built-in set command, which only sets options. Without any,
+ * or with just -o, it lists them. */
+int set_cmd(char **args) {
+	int i;
+
+	if (!args[1] || (0 == strcmp(args[1], "-o") && !args[2])) {
+		for (i = 0; i < NUM_OPTIONS; i++) {
+			printf("%-15s %s\n", options[i].name, *options[i].value ? "on" : "off");
+		}
+		return EXIT_SUCCESS;
+	}
+	for (args++; *args; args++) {
+		bool on = 0 == strcmp(*args, "-o");
+		if ((!on && 0 != strcmp(*args, "+o")) || !args[1]) {
+			fprintf(stderr, "set: usage: set [-o|+o option] ...\n");
+			return EXIT_FAILURE;
+		}
+		args++;
+		for (i = 0; i < NUM_OPTIONS && 0 != strcmp(*args, options[i].name); i++);
+		if (i == NUM_OPTIONS) {
+			fprintf(stderr, "set: %s: invalid option name\n", *args);
+			return EXIT_FAILURE;
+		}
+		*options[i].value = on;
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -522,34 +988,35 @@ void substitute_home(char *dst) {
 	}
 }
 
-/* The function handling the two signals that
- * are caught by the program: SIGINT and SIGCHLD. */
+/* The function handling the signals that are caught
+ * by the program: SIGTERM, SIGINT and SIGCHLD. */
 void signal_handler(int sig) {
+	size_t i;
+
 	switch (sig) {
 		case SIGTERM:
-			/* If the pid is greater than 0 then it wasn't a
-			 * termination of a process group and therefore of a single
-			 * command. Because it is we can exit safely and not have to
+			/* Forked copies of the shell, such as a loop in a pipeline,
+			 * exit. Because they do we can exit safely and not have to
 			 * worry about the parent process getting killed. */
-			if (pid > 0) {
+			if (getpid() != shell_pid) {
 				exit(EXIT_SUCCESS);
 			}
+			if (!at_prompt) {
+				return;
+			}
 			break;
 		case SIGINT:
-			/* Only kill if child and fg process */
-			if (fg_process && -1 != pid) {
-				if (-1 == kill(pid, SIGTERM)) {
-					/* Child couldn't be killed, but perror can't be used here
-					 * because it is not safe for use in a signal handler.
-					 * The error is purposefully ignored. */
-					return;
-				}
-				if (-1 == waitpid(pid, NULL, 0)) {
-					/* This probably means that the child for some reason
-					 * already has been waited for.
-					 * There's nothing that can be done and therefore
-					 * the error is ignored. */
+			if (!at_prompt) {
+				/* Stop what's running and pass it on to the children */
+				interrupted = 1;
+				for (i = 0; i < fg_count; i++) {
+					if (-1 == kill(fg_pids[i], SIGTERM)) {
+						/* Child couldn't be killed, but perror can't be used here
+						 * because it is not safe for use in a signal handler.
+						 * The error is purposefully ignored. */
+					}
 				}
+				return;
 			}
 			break;
 		case SIGCHLD:
@@ -557,7 +1024,7 @@ void signal_handler(int sig) {
 			/* Previously, the terminated background processes were
 			 * printed here. However, because printf is not safe for use in a signal
 			 * handler, it was updated to jump to the prompt instead. */
-			if (fg_process) {
+			if (!at_prompt) {
 				return;
 			}
 			break;
@@ -571,5 +1038,5 @@ void signal_handler(int sig) {
 		 * isn't vital this error is purposefully ignored. */
 	}
 	/* Jump back to prompt */
-	siglongjmp(prompt_mark, 1);
+	siglongjmp(prompt_mark, sig);
 }
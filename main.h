@@ -13,17 +13,39 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <setjmp.h>
-#include <readline/readline.h>
-#include <readline/history.h>
-
-#ifndef strtok_r
-extern char *strtok_r(char *, const char *, char **);
-#endif
+#include <ctype.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "plugin.h"
 
 #define SMSH "smsh"
+#define SMSH_VERSION "0.2"
 #define NUM_BUILTINS ((int) (sizeof(builtins) / sizeof(*builtins)))
 #define PIPE_READ_SIDE (0)
 #define PIPE_WRITE_SIDE (1)
+/* Minimum time between starting two jobs held back by admission control,
+ * giving the pressure averages a chance to reflect the previous one */
+#define ADMIT_INTERVAL_MS (1000)
+/* Minimum time between two tries at admitting a queued job, which
+ * scripts would otherwise make before every command */
+#define ADMIT_RETRY_MS (100)
+/* Shared memory segment holding the host's job tokens */
+#define GLOBAL_POOL "/smsh-tokens"
+#define GLOBAL_SLOTS (256)
+/* How long a shell tries to lock the pool before doing without it */
+#define POOL_LOCK_MS (100)
+/* File descriptors that read keeps input buffers for, and their size */
+#define READ_FDS (10)
+#define READ_BUFFER (64 * 1024)
+#define VAR_BUCKETS (256)
+#define FUNC_BUCKETS (64)
+#define PATH_BUCKETS (64)
 /* Checks a syscall's return value and returns on error */
 #define TRY(syscall, str) \
 if (-1 == (syscall)) { \
@@ -38,10 +60,30 @@ if (-1 == (syscall)) { \
 /* Make it obvious by type what's used as a pipe */
 typedef int Pipe[2];
 
+struct Node;
+
+typedef enum {
+	REDIR_HEREDOC, /* <<word, or <<-word which strips leading tabs */
+	REDIR_HERESTRING /* <<<word */
+} RedirType;
+
+/* e.g. "<<EOF", whose body is read from the lines after the command */
+typedef struct Redirect {
+	RedirType type;
+	bool strip_tabs;
+	char *word; /* The delimiter or the here-string, as written */
+	char *body; /* REDIR_HEREDOC */
+	bool expand; /* The delimiter wasn't quoted, so the body is expanded */
+	int cache; /* A sealed memfd of text that never changes, or -1 */
+	struct Redirect *next;
+} Redirect;
+
 /* e.g. "ls -aHpl" */
 typedef struct {
 	size_t num_args; /* 2 */
-	char **args; /* ["ls", "-aHpl", NULL] */
+	char **args; /* ["ls", "-aHpl", NULL], as written and expanded when run */
+	struct Node *compound; /* e.g. a while loop in a pipeline, instead of args */
+	Redirect *redirects;
 } Command;
 
 /* Used for Command(s) and if it should run in fg or bg */
@@ -49,29 +91,318 @@ typedef struct {
 	size_t length;
 	Command **cmds;
 	bool bg;
+	bool negate; /* "! pipeline" inverts its status */
+	char *text; /* Background jobs as written, for listing them */
 } CommandList;
 
-void exec(CommandList *);
-void parse_commands(CommandList *, char *);
+typedef enum {
+	NODE_PIPELINE,
+	NODE_IF,
+	NODE_WHILE,
+	NODE_UNTIL,
+	NODE_FOR,
+	NODE_CASE,
+	NODE_GROUP,
+	NODE_SUBSHELL,
+	NODE_ARITH,
+	NODE_ARITH_FOR,
+	NODE_AND, /* cond && body */
+	NODE_OR, /* cond || body */
+	NODE_FUNCTION /* name() body, defining a function */
+} NodeType;
+
+/* e.g. "a|b) echo ab ;;" */
+typedef struct CaseItem {
+	char **patterns;
+	struct Node *body;
+	struct CaseItem *next;
+} CaseItem;
+
+/* A parsed command, executed by walking the tree. Lists of
+ * commands, such as the body of a loop, are chained by next. */
+typedef struct Node {
+	NodeType type;
+	CommandList *pipeline; /* NODE_PIPELINE */
+	char *name; /* NODE_FOR: the variable, NODE_CASE: the word matched,
+	             * NODE_ARITH: the expression, NODE_FUNCTION: the name */
+	char **words; /* NODE_FOR: the words looped over,
+	               * NODE_ARITH_FOR: the init, condition and step */
+	CaseItem *items; /* NODE_CASE */
+	struct Node *cond; /* NODE_IF, NODE_WHILE and NODE_UNTIL, and the left
+	                    * side of NODE_AND and NODE_OR */
+	struct Node *body; /* then, do, the body of groups and subshells, and
+	                    * NODE_FUNCTION: the compound command */
+	struct Node *alt; /* NODE_IF: elif or else */
+	struct Node *next;
+} Node;
+
+/* One {...} of a word being brace expanded, and the text before it */
+typedef struct {
+	const char *text;
+	size_t text_len;
+	char **words; /* The alternatives of a list, or NULL for a sequence */
+	long first, step;
+	int width; /* Numbers are zero padded to this width */
+	bool letters; /* A sequence of letters rather than numbers */
+	unsigned long count, index;
+} BraceGroup;
+
+typedef struct {
+	BraceGroup *groups;
+	size_t num_groups;
+	const char *rest; /* The text after the last group */
+	bool escape;
+	bool done;
+	char *word; /* The current word */
+	size_t cap;
+} Braces;
+
+/* A background job, either running or held back by admission control */
+typedef enum {
+	JOB_QUEUED,
+	JOB_RUNNING
+} JobState;
+
+typedef struct Job {
+	int id;
+	pid_t pid; /* The job's process group, led by its first command */
+	JobState state;
+	char *line; /* The command line, for listing */
+	int gate; /* Queued jobs wait to read from this pipe, or -1 */
+	size_t num_procs; /* Processes waiting at the gate */
+	int token; /* Slot in the host-wide token pool, or -1 */
+	struct Job *next;
+} Job;
+
+/* A process in a job as of the last sample, see jtop.c */
+typedef struct {
+	pid_t pid;
+	unsigned long ticks; /* User and system CPU time */
+} SampledProcess;
+
+/* What the processes of a job add up to */
+typedef struct {
+	size_t procs;
+	unsigned long threads;
+	unsigned long ticks; /* Since the previous sample */
+	unsigned long rss; /* Pages */
+	uint64_t read, written; /* From and to storage */
+	uint64_t chars; /* Read and written in all, pipes included */
+	char state; /* Of the busiest process */
+} JobTotals;
+
+/* What's kept between samples of the jobs' processes */
+typedef struct {
+	SampledProcess *members; /* Sorted by pid */
+	size_t num_members, members_cap;
+	pid_t *others; /* Processes in no job, sorted */
+	size_t num_others, others_cap;
+	unsigned long samples;
+	struct timeval when;
+} Sampler;
+
+/* Input that read has buffered from a file descriptor */
+typedef struct {
+	char *data;
+	size_t start, end;
+	bool seekable; /* The leftovers can be given back with lseek */
+	bool owned; /* Claimed; nobody else reads from the fd */
+} InputBuffer;
+
+/* The shell's own stdin, set aside while a command run within the
+ * shell reads a here-document instead */
+typedef struct {
+	int fd; /* A copy of the original stdin, or -1 */
+	InputBuffer buffer;
+} SavedInput;
+
+/* A shell function or alias, see funcs.c */
+typedef struct ShellFunction ShellFunction;
+
+/* Possible completions of a word, ended by NULL */
+typedef struct {
+	char **names;
+	size_t num, cap;
+} Completions;
+/* Completes the word from start to end of the line, adding to the
+ * completions. Returns false to leave it to file name completion. */
+typedef bool Completer(const char *, size_t, size_t, Completions *);
+
+/* A parsed script, whose tree may live in a mapped cache file */
+typedef struct {
+	Node *tree;
+	void *arena; /* The nodes of a tree loaded from the cache, or NULL */
+	void *map;
+	size_t map_len;
+} Script;
+
+extern char **environ;
+
+/* Set when Ctrl-C should abort what the shell is running */
+extern volatile sig_atomic_t interrupted;
+/* --profile-startup: time the steps of loading the rc file */
+extern bool profile_startup;
+
+int exec(CommandList *);
 int exec_cmd(Command *);
-int exec_commands(CommandList *, const size_t, const int);
-int run_cmd(Command *);
+int exec_commands(CommandList *);
+int run_cmd(char **);
+long arg_space(void);
+int (*builtin_func(const char *))(char **);
 int exit_cmd(char **);
-int cd_cmd(char **);
 int checkEnv_cmd(char **);
+int echo_cmd(char **);
+int true_cmd(char **);
+int false_cmd(char **);
+int jobs_cmd(char **);
+int read_cmd(char **);
+int test_cmd(char **);
+int set_cmd(char **);
+int xargs_cmd(char **);
+int stats_cmd(char **);
 void substitute_home(char *);
 void signal_handler(int);
 
-/* Names of the supported built-in functions */
-static const char *builtins[] = {
-	"exit",
-	"cd",
-	"checkEnv"
-};
-
-/* Pointers to the built-in functions that the shell supports */
-static int (*builtins_funcs[]) (char **) = {
-	&exit_cmd,
-	&cd_cmd,
-	&checkEnv_cmd
-};
+/* parse.c */
+Node *parse_commands(const char *, bool *);
+void free_commands(CommandList *);
+void free_node(Node *);
+const char *heredoc_awaited(void);
+Node *copy_node(Node *);
+Node *parse_line(const char *, bool *, bool *);
+void parse_stats(void);
+
+/* script.c */
+bool cache_file(const char *, char *, size_t);
+bool load_script(const char *, Script *);
+void unload_script(Script *);
+int run_script(const char *);
+int source_script(const char *, char **, bool);
+int source_cmd(char **);
+void load_rc(bool);
+
+/* edit.c */
+void init_editor(bool, int (*)(void), Completer *);
+char *edit_line(const char *);
+void set_prompt(const char *);
+void remember_line(const char *);
+const char *edited_line(void);
+void leave_prompt(void);
+void back_to_prompt(void);
+void add_completion(Completions *, const char *);
+
+/* prompt.c */
+const char *build_prompt(void);
+const char *update_prompt(void);
+void prompt_duration(uint64_t);
+
+/* dirs.c */
+void note_cwd(void);
+int cd_cmd(char **);
+int dirs_cmd(char **);
+int pushd_cmd(char **);
+int popd_cmd(char **);
+
+/* jtop.c */
+long sample_jobs(Sampler *, JobTotals *);
+void end_sampling(Sampler *);
+int jtop_cmd(char **);
+
+/* stall.c */
+void init_stall(void);
+void watch_fg(bool);
+bool check_stalls(void);
+void report_stalls(void);
+
+/* replay.c */
+void count_wait(const struct timeval *);
+int replay(const char *, long);
+
+/* path.c */
+const char *resolve_command(const char *);
+void exec_resolved(char **);
+void speculate(const char *);
+int hash_cmd(char **);
+void path_stats(void);
+void complete_commands(const char *, size_t, Completions *);
+
+/* funcs.c */
+void define_function(const char *, Node *);
+ShellFunction *find_function(const char *, const char *);
+int call_function(ShellFunction *, char **);
+int alias_cmd(char **);
+int unalias_cmd(char **);
+int defer_cmd(char **);
+bool deferred_pending(void);
+void run_deferred(const char *);
+void complete_functions(const char *, size_t, Completions *);
+
+/* fds.c */
+void note_inherited_fds(void);
+int shell_pipe(Pipe);
+void hide_shell_fds(void);
+
+/* plugins.c */
+const SmshBuiltin *find_loadable(const char *);
+int enable_cmd(char **);
+
+/* redir.c */
+int open_input(Redirect *);
+bool redirect_shell(Redirect *, SavedInput *);
+void restore_shell(SavedInput *);
+void free_redirects(Redirect *);
+
+/* arith.c */
+bool arith(const char *, size_t, long *);
+
+/* braces.c */
+bool start_braces(Braces *, const char *, bool);
+const char *next_brace(Braces *);
+void end_braces(Braces *);
+
+/* interp.c */
+int exec_node(Node *);
+bool only_builtins(Node *);
+int break_cmd(char **);
+int continue_cmd(char **);
+int exec_function(Node *, bool *);
+int return_cmd(char **);
+
+/* jobs.c */
+void init_jobs(void);
+bool host_stalled(void);
+const char *hold_job(void);
+void add_job(pid_t, const char *, int, size_t, const char *);
+bool jobs_queued(void);
+bool jobs_pending(void);
+void run_queued_jobs(void);
+void reap_jobs(void);
+void kill_jobs(void);
+size_t count_jobs(void);
+const Job *first_job(void);
+
+/* vars.c */
+const char *get_var(const char *);
+const char *get_var_n(const char *, size_t);
+void set_var(const char *, const char *);
+bool is_name_char(char, bool);
+size_t count_assignments(char **);
+void assign(const char *, bool);
+char **expand_args(char **);
+char *expand_word(const char *, bool);
+char *expand_heredoc(const char *);
+void set_status(int);
+void set_pipe_status(const int *, size_t);
+char **set_positional(char **);
+void set_arg0(const char *);
+int shift_cmd(char **);
+int export_cmd(char **);
+char *quote_word(const char *);
+int exit_status(int);
+
+/* read.c */
+void claim_input(int, bool);
+void sync_input(void);
+ssize_t read_input(int, char *, size_t);
+void set_input_aside(int, InputBuffer *);
+void take_input_back(int, InputBuffer *);
@@ -0,0 +1,1219 @@
+#include "main.h"
+
+/*
+ * Parsing of command lines into trees of Nodes.
+ *
+ * The grammar is a subset of the POSIX shell's: pipelines, optionally
+ * negated with '!' and chained with '&&' and '||', separated by ';',
+ * '&' or newlines, and the compound commands if, while, until, for,
+ * case, { } and ( ), as well as (( )) and for (( ; ; )), and function
+ * definitions, "name() compound" or "function name compound". Words are
+ * kept as written, quotes and all, and are only expanded when the
+ * command runs, so that a loop body is parsed once and executed any
+ * number of times.
+ *
+ * The bodies of here-documents are the lines following the one their
+ * command is on, so they're read as soon as the lexer reaches its end.
+ */
+
+typedef enum {
+	TOK_WORD,
+	TOK_NEWLINE,
+	TOK_SEMI,
+	TOK_DSEMI,
+	TOK_AMP,
+	TOK_AND_IF, /* && */
+	TOK_PIPE,
+	TOK_OR_IF, /* || */
+	TOK_LPAREN,
+	TOK_RPAREN,
+	TOK_ARITH, /* (( ... )) */
+	TOK_DLESS, /* << */
+	TOK_DLESSDASH, /* <<- */
+	TOK_TLESS, /* <<< */
+	TOK_REDIRECT, /* Any other redirection, which isn't supported */
+	TOK_EOF
+} TokenType;
+
+typedef struct {
+	const char *src;
+	size_t pos; /* Where the next token starts looking */
+	TokenType type; /* The current token */
+	size_t start, len;
+	size_t prev_end; /* End of the token before the current one */
+	bool incomplete; /* More input is needed to finish the command */
+	bool error;
+	Redirect **heredocs; /* Here-documents whose bodies come next */
+	size_t num_heredocs, heredocs_cap;
+} Parser;
+
+/* The delimiter that the last incomplete input was waiting for */
+static char *awaited = NULL;
+
+/* Reserved words that end a list rather than start a command */
+static const char *terminators[] = {
+	"then", "elif", "else", "fi", "do", "done", "esac", "}"
+};
+#define NUM_TERMINATORS ((int) (sizeof(terminators) / sizeof(*terminators)))
+
+static void *xcalloc(size_t n, size_t size) {
+	void *p = calloc(n, size);
+	if (!p) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static char *copy(const char *src, size_t len) {
+	char *dst = malloc(len + 1);
+	if (!dst) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(dst, src, len);
+	dst[len] = 0;
+	return dst;
+}
+
+/* Skips a $( ) or ${ } expansion starting at the opening bracket.
+ * Returns the position after it, or 0 if it isn't closed. */
+static size_t skip_nested(const char *src, size_t pos) {
+	char open = src[pos], close = '(' == open ? ')' : '}';
+	int depth = 0;
+
+	for (; src[pos]; pos++) {
+		if ('\\' == src[pos] && src[pos + 1]) {
+			pos++;
+		} else if ('\'' == src[pos]) {
+			const char *end = strchr(&src[pos + 1], '\'');
+			if (!end) {
+				return 0;
+			}
+			pos = (size_t) (end - src);
+		} else if (open == src[pos]) {
+			depth++;
+		} else if (close == src[pos] && 0 == --depth) {
+			return pos + 1;
+		}
+	}
+	return 0;
+}
+
+/* Finds the ')' that closes the (( starting at pos: the end of an
+ * arithmetic command if another ')' follows it. */
+static size_t skip_arith(const char *src, size_t pos) {
+	int depth = 0;
+
+	for (pos += 2; src[pos]; pos++) {
+		if ('(' == src[pos]) {
+			depth++;
+		} else if (')' == src[pos] && 0 > --depth) {
+			break;
+		}
+	}
+	return pos;
+}
+
+/* Scans a word, leaving quotes and expansions in place */
+static void scan_word(Parser *p) {
+	const char *src = p->src;
+	size_t pos = p->pos;
+
+	while (src[pos] && !strchr(" \t\n|&;()<>", src[pos])) {
+		switch (src[pos]) {
+			case '\\':
+				if (!src[pos + 1] || ('\n' == src[pos + 1] && !src[pos + 2])) {
+					/* The line continues on the next one */
+					p->incomplete = true;
+					return;
+				}
+				pos += 2;
+				break;
+			case '\'': {
+				const char *end = strchr(&src[pos + 1], '\'');
+				if (!end) {
+					p->incomplete = true;
+					return;
+				}
+				pos = (size_t) (end - src) + 1;
+				break;
+			}
+			case '"':
+				for (pos++; src[pos] && '"' != src[pos]; pos++) {
+					if ('\\' == src[pos] && src[pos + 1]) {
+						pos++;
+					} else if ('$' == src[pos] && ('(' == src[pos + 1] || '{' == src[pos + 1])) {
+						size_t end = skip_nested(src, pos + 1);
+						if (!end) {
+							p->incomplete = true;
+							return;
+						}
+						pos = end - 1;
+					}
+				}
+				if (!src[pos]) {
+					p->incomplete = true;
+					return;
+				}
+				pos++;
+				break;
+			case '$':
+				if ('(' == src[pos + 1] || '{' == src[pos + 1]) {
+					size_t end = skip_nested(src, pos + 1);
+					if (!end) {
+						p->incomplete = true;
+						return;
+					}
+					pos = end;
+					break;
+				}
+				pos++;
+				break;
+			default:
+				pos++;
+		}
+	}
+	p->pos = pos;
+}
+
+/* Removes the quotes from a here-document delimiter */
+static char *unquote(const char *word, bool *quoted) {
+	char *dst = copy(word, strlen(word)), *out = dst;
+
+	*quoted = false;
+	for (; *word; word++) {
+		if ('\'' == *word || '"' == *word) {
+			char quote = *word;
+			*quoted = true;
+			for (word++; *word && quote != *word; word++) {
+				*out++ = *word;
+			}
+			if (!*word) {
+				break;
+			}
+		} else if ('\\' == *word && word[1]) {
+			*quoted = true;
+			*out++ = *++word;
+		} else {
+			*out++ = *word;
+		}
+	}
+	*out = 0;
+	return dst;
+}
+
+/* Reads the bodies of the here-documents on the line just ended, which
+ * are the lines up to their delimiters. */
+static void read_heredocs(Parser *p) {
+	size_t i;
+
+	for (i = 0; i < p->num_heredocs; i++) {
+		Redirect *r = p->heredocs[i];
+		bool quoted;
+		char *delim = unquote(r->word, &quoted);
+		size_t delim_len = strlen(delim), len = 0, cap = 64;
+
+		r->expand = !quoted;
+		r->body = xcalloc(cap, 1);
+		for (;;) {
+			const char *line = &p->src[p->pos], *newline = strchr(line, '\n');
+			size_t line_len;
+
+			if (!newline) {
+				p->incomplete = true;
+				/* Remembered so that the lines up to the delimiter
+				 * needn't all be parsed again as they come */
+				free(awaited);
+				awaited = delim;
+				p->num_heredocs = 0;
+				return;
+			}
+			p->pos = (size_t) (newline + 1 - p->src);
+			if (r->strip_tabs) {
+				while ('\t' == *line) {
+					line++;
+				}
+			}
+			line_len = (size_t) (newline - line);
+			if (line_len == delim_len && 0 == strncmp(line, delim, delim_len)) {
+				break;
+			}
+			if (len + line_len + 2 > cap) {
+				while (len + line_len + 2 > cap) {
+					cap *= 2;
+				}
+				if (!(r->body = realloc(r->body, cap))) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			memcpy(r->body + len, line, line_len + 1);
+			len += line_len + 1;
+			r->body[len] = 0;
+		}
+		free(delim);
+	}
+	p->num_heredocs = 0;
+}
+
+static void next_token(Parser *p) {
+	const char *src = p->src;
+
+	if (p->incomplete || p->error) {
+		p->type = TOK_EOF;
+		return;
+	}
+	p->prev_end = p->start + p->len;
+
+	for (;;) {
+		/* Skip blanks, comments and escaped newlines */
+		if (' ' == src[p->pos] || '\t' == src[p->pos]) {
+			p->pos++;
+		} else if ('\\' == src[p->pos] && '\n' == src[p->pos + 1]) {
+			p->pos += 2;
+			if (!src[p->pos]) {
+				p->incomplete = true;
+				p->type = TOK_EOF;
+				return;
+			}
+		} else if ('#' == src[p->pos]) {
+			while (src[p->pos] && '\n' != src[p->pos]) {
+				p->pos++;
+			}
+		} else {
+			break;
+		}
+	}
+
+	p->start = p->pos;
+	p->len = 1;
+	switch (src[p->pos]) {
+		case 0:
+			p->type = TOK_EOF;
+			p->len = 0;
+			if (p->num_heredocs) {
+				/* The bodies are still to come */
+				p->incomplete = true;
+			}
+			return;
+		case '\n':
+			p->type = TOK_NEWLINE;
+			break;
+		case ';':
+			if (';' == src[p->pos + 1]) {
+				p->type = TOK_DSEMI;
+				p->len = 2;
+			} else {
+				p->type = TOK_SEMI;
+			}
+			break;
+		case '&':
+			p->type = TOK_AMP;
+			if ('&' == src[p->pos + 1]) {
+				p->type = TOK_AND_IF;
+				p->len = 2;
+			}
+			break;
+		case '|':
+			p->type = TOK_PIPE;
+			if ('|' == src[p->pos + 1]) {
+				p->type = TOK_OR_IF;
+				p->len = 2;
+			}
+			break;
+		case '(':
+			p->type = TOK_LPAREN;
+			if ('(' == src[p->pos + 1]) {
+				size_t end = skip_arith(src, p->pos);
+				if (!src[end]) {
+					p->incomplete = true;
+					p->type = TOK_EOF;
+					p->len = 0;
+					return;
+				}
+				if (')' == src[end + 1]) {
+					p->type = TOK_ARITH;
+					p->len = end + 2 - p->pos;
+				}
+				/* Otherwise it's a subshell within a subshell */
+			}
+			break;
+		case ')':
+			p->type = TOK_RPAREN;
+			break;
+		case '<':
+			if ('<' == src[p->pos + 1] && '<' == src[p->pos + 2]) {
+				p->type = TOK_TLESS;
+				p->len = 3;
+			} else if ('<' == src[p->pos + 1]) {
+				p->type = '-' == src[p->pos + 2] ? TOK_DLESSDASH : TOK_DLESS;
+				p->len = '-' == src[p->pos + 2] ? 3 : 2;
+			} else {
+				p->type = TOK_REDIRECT;
+			}
+			break;
+		case '>':
+			p->type = TOK_REDIRECT;
+			break;
+		default:
+			p->type = TOK_WORD;
+			scan_word(p);
+			if (p->incomplete) {
+				p->type = TOK_EOF;
+				p->len = 0;
+				return;
+			}
+			p->len = p->pos - p->start;
+			return;
+	}
+	p->pos += p->len;
+	if (TOK_NEWLINE == p->type && p->num_heredocs) {
+		read_heredocs(p);
+	}
+}
+
+static bool is_word(Parser *p, const char *word) {
+	return TOK_WORD == p->type && strlen(word) == p->len &&
+		0 == strncmp(&p->src[p->start], word, p->len);
+}
+
+static bool at_terminator(Parser *p) {
+	int i;
+	if (TOK_EOF == p->type || TOK_RPAREN == p->type || TOK_DSEMI == p->type) {
+		return true;
+	}
+	for (i = 0; i < NUM_TERMINATORS; i++) {
+		if (is_word(p, terminators[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void skip_newlines(Parser *p) {
+	while (TOK_NEWLINE == p->type) {
+		next_token(p);
+	}
+}
+
+static void syntax_error(Parser *p) {
+	if (p->error || p->incomplete) {
+		return;
+	}
+	if (TOK_EOF == p->type) {
+		/* Ran out of input in the middle of a command */
+		p->incomplete = true;
+		return;
+	}
+	p->error = true;
+	if (TOK_NEWLINE == p->type) {
+		fprintf(stderr, SMSH ": unexpected token 'newline'\n");
+	} else {
+		fprintf(stderr, SMSH ": unexpected token '%.*s'\n", (int) p->len, &p->src[p->start]);
+	}
+}
+
+/* Consumes the reserved word, or fails */
+static bool expect(Parser *p, const char *word) {
+	if (!is_word(p, word)) {
+		syntax_error(p);
+		return false;
+	}
+	next_token(p);
+	return true;
+}
+
+static char *take_word(Parser *p) {
+	char *word = copy(&p->src[p->start], p->len);
+	next_token(p);
+	return word;
+}
+
+static bool at_redirect(Parser *p) {
+	return TOK_DLESS == p->type || TOK_DLESSDASH == p->type || TOK_TLESS == p->type ||
+		TOK_REDIRECT == p->type;
+}
+
+/* Parses a redirection, adding it at *tail */
+static void parse_redirect(Parser *p, Redirect ***tail) {
+	Redirect *r;
+
+	if (TOK_REDIRECT == p->type) {
+		fprintf(stderr, SMSH ": only here-documents and here-strings can be redirected\n");
+		p->error = true;
+		return;
+	}
+	r = xcalloc(1, sizeof(*r));
+	r->type = TOK_TLESS == p->type ? REDIR_HERESTRING : REDIR_HEREDOC;
+	r->strip_tabs = TOK_DLESSDASH == p->type;
+	r->cache = -1;
+	**tail = r;
+	*tail = &r->next;
+
+	next_token(p);
+	if (TOK_WORD != p->type) {
+		syntax_error(p);
+		return;
+	}
+	r->word = copy(&p->src[p->start], p->len);
+	if (REDIR_HEREDOC == r->type) {
+		/* Queued before the end of the line is reached */
+		if (p->num_heredocs == p->heredocs_cap) {
+			p->heredocs_cap = p->heredocs_cap ? 2 * p->heredocs_cap : 4;
+			if (!(p->heredocs = realloc(p->heredocs, p->heredocs_cap * sizeof(*p->heredocs)))) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		p->heredocs[p->num_heredocs++] = r;
+	}
+	next_token(p);
+}
+
+/* Collects words up to the next operator into a NULL-terminated array,
+ * and with redirects given, the redirections among them. */
+static char **take_words(Parser *p, size_t *num_words, Redirect **redirects) {
+	size_t n = 0, cap = 4;
+	char **words = xcalloc(cap, sizeof(*words));
+	Redirect **tail = redirects;
+
+	while (TOK_WORD == p->type || (redirects && at_redirect(p) && !p->error)) {
+		if (TOK_WORD != p->type) {
+			parse_redirect(p, &tail);
+			continue;
+		}
+		if (n + 1 >= cap) {
+			cap *= 2;
+			if (!(words = realloc(words, cap * sizeof(*words)))) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		words[n++] = take_word(p);
+	}
+	words[n] = NULL;
+	if (num_words) {
+		*num_words = n;
+	}
+	return words;
+}
+
+static Node *new_node(NodeType type) {
+	Node *node = xcalloc(1, sizeof(*node));
+	node->type = type;
+	return node;
+}
+
+static Node *parse_list(Parser *);
+static Command *parse_command(Parser *);
+static void free_words(char **);
+
+/* if/elif list; then list; [elif ...] [else list;] fi */
+static Node *parse_if(Parser *p) {
+	Node *node = new_node(NODE_IF);
+
+	next_token(p);
+	node->cond = parse_list(p);
+	if (!expect(p, "then")) {
+		return node;
+	}
+	node->body = parse_list(p);
+	if (is_word(p, "elif")) {
+		/* The rest is an if of its own, ending with the same fi */
+		node->alt = parse_if(p);
+	} else if (is_word(p, "else")) {
+		next_token(p);
+		node->alt = parse_list(p);
+		expect(p, "fi");
+	} else {
+		expect(p, "fi");
+	}
+	return node;
+}
+
+/* while/until list; do list; done */
+static Node *parse_while(Parser *p, NodeType type) {
+	Node *node = new_node(type);
+
+	next_token(p);
+	node->cond = parse_list(p);
+	if (expect(p, "do")) {
+		node->body = parse_list(p);
+		expect(p, "done");
+	}
+	return node;
+}
+
+/* The expression of the current (( )) token */
+static char *take_arith(Parser *p) {
+	char *expr = copy(&p->src[p->start + 2], p->len - 4);
+	next_token(p);
+	return expr;
+}
+
+/* for ((init; condition; step)) [;] do list; done */
+static Node *parse_arith_for(Parser *p) {
+	Node *node = new_node(NODE_ARITH_FOR);
+	char *expr = take_arith(p), *part = expr;
+	int n = 0, depth = 0;
+
+	node->words = xcalloc(4, sizeof(*node->words));
+	for (;;) {
+		char *end = part, *stop;
+		for (; *end && (';' != *end || depth); end++) {
+			if ('(' == *end) {
+				depth++;
+			} else if (')' == *end) {
+				depth--;
+			}
+		}
+		if (3 == n) {
+			/* More than two ; */
+			n++;
+			break;
+		}
+		/* Trimmed, so that an empty condition is easy to tell */
+		for (stop = end; part < stop && isspace((unsigned char) *part); part++);
+		for (; part < stop && isspace((unsigned char) stop[-1]); stop--);
+		node->words[n++] = copy(part, (size_t) (stop - part));
+		if (!*end) {
+			break;
+		}
+		part = end + 1;
+	}
+	free(expr);
+	if (3 != n) {
+		fprintf(stderr, SMSH ": for ((: expected init; condition; step\n");
+		p->error = true;
+		return node;
+	}
+
+	if (TOK_SEMI == p->type) {
+		next_token(p);
+	}
+	skip_newlines(p);
+	if (expect(p, "do")) {
+		node->body = parse_list(p);
+		expect(p, "done");
+	}
+	return node;
+}
+
+/* for name [in word...]; do list; done */
+static Node *parse_for(Parser *p) {
+	Node *node;
+	size_t i;
+
+	next_token(p);
+	if (TOK_ARITH == p->type) {
+		return parse_arith_for(p);
+	}
+	node = new_node(NODE_FOR);
+	if (TOK_WORD != p->type) {
+		syntax_error(p);
+		return node;
+	}
+	for (i = 0; i < p->len; i++) {
+		if (!is_name_char(p->src[p->start + i], 0 == i)) {
+			syntax_error(p);
+			return node;
+		}
+	}
+	node->name = take_word(p);
+	skip_newlines(p);
+
+	if (is_word(p, "in")) {
+		next_token(p);
+		node->words = take_words(p, NULL, NULL);
+		if (TOK_SEMI != p->type && TOK_NEWLINE != p->type) {
+			syntax_error(p);
+			return node;
+		}
+		next_token(p);
+	} else if (TOK_SEMI == p->type) {
+		next_token(p);
+	}
+	skip_newlines(p);
+
+	if (expect(p, "do")) {
+		node->body = parse_list(p);
+		expect(p, "done");
+	}
+	return node;
+}
+
+/* case word in [(]pattern[|pattern...]) list;; ... esac */
+static Node *parse_case(Parser *p) {
+	Node *node = new_node(NODE_CASE);
+	CaseItem **tail = &node->items;
+
+	next_token(p);
+	if (TOK_WORD != p->type) {
+		syntax_error(p);
+		return node;
+	}
+	node->name = take_word(p);
+	skip_newlines(p);
+	if (!expect(p, "in")) {
+		return node;
+	}
+	skip_newlines(p);
+
+	while (!is_word(p, "esac")) {
+		CaseItem *item = xcalloc(1, sizeof(*item));
+		size_t n = 0;
+
+		*tail = item;
+		tail = &item->next;
+		item->patterns = xcalloc(2, sizeof(*item->patterns));
+
+		if (TOK_LPAREN == p->type) {
+			next_token(p);
+		}
+		for (;;) {
+			if (TOK_WORD != p->type) {
+				syntax_error(p);
+				return node;
+			}
+			if (!(item->patterns = realloc(item->patterns, (n + 2) * sizeof(*item->patterns)))) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+			item->patterns[n++] = take_word(p);
+			item->patterns[n] = NULL;
+			if (TOK_PIPE != p->type) {
+				break;
+			}
+			next_token(p);
+		}
+		if (TOK_RPAREN != p->type) {
+			syntax_error(p);
+			return node;
+		}
+		next_token(p);
+
+		item->body = parse_list(p);
+		if (TOK_DSEMI == p->type) {
+			next_token(p);
+			skip_newlines(p);
+		} else if (!is_word(p, "esac")) {
+			syntax_error(p);
+			return node;
+		}
+	}
+	next_token(p);
+	return node;
+}
+
+/* Whether the word is followed by "()", which makes it the name of a
+ * function being defined. The parentheses are looked for in the source,
+ * as the lexer only sees one token at a time. */
+static bool at_definition(Parser *p) {
+	size_t pos = p->pos, i;
+
+	if (TOK_WORD != p->type || at_terminator(p)) {
+		return false;
+	}
+	for (i = 0; i < p->len; i++) {
+		if (!is_name_char(p->src[p->start + i], 0 == i)) {
+			return false;
+		}
+	}
+	for (; ' ' == p->src[pos] || '\t' == p->src[pos]; pos++);
+	if ('(' != p->src[pos++]) {
+		return false;
+	}
+	for (; ' ' == p->src[pos] || '\t' == p->src[pos]; pos++);
+	return ')' == p->src[pos];
+}
+
+/* name() compound or function name [()] compound, where the
+ * compound command may follow on later lines */
+static Node *parse_function(Parser *p) {
+	Node *node = new_node(NODE_FUNCTION);
+	Command *body;
+	size_t i;
+
+	if (is_word(p, "function")) {
+		next_token(p);
+	}
+	for (i = 0; TOK_WORD == p->type && i < p->len; i++) {
+		if (!is_name_char(p->src[p->start + i], 0 == i)) {
+			break;
+		}
+	}
+	if (TOK_WORD != p->type || i < p->len || at_terminator(p)) {
+		syntax_error(p);
+		return node;
+	}
+	node->name = take_word(p);
+	if (TOK_LPAREN == p->type) {
+		next_token(p);
+		if (TOK_RPAREN != p->type) {
+			syntax_error(p);
+			return node;
+		}
+		next_token(p);
+	}
+	skip_newlines(p);
+
+	body = parse_command(p);
+	node->body = body->compound;
+	if (!body->compound && !p->error && !p->incomplete) {
+		fprintf(stderr, SMSH ": %s: the body of a function must be a compound command\n", node->name);
+		p->error = true;
+	} else if (body->redirects && !p->error && !p->incomplete) {
+		fprintf(stderr, SMSH ": %s: functions can't be redirected\n", node->name);
+		p->error = true;
+	}
+	free_words(body->args);
+	free_redirects(body->redirects);
+	free(body);
+	return node;
+}
+
+static Command *parse_command(Parser *p) {
+	Command *command = xcalloc(1, sizeof(*command));
+
+	if (TOK_LPAREN == p->type) {
+		command->compound = new_node(NODE_SUBSHELL);
+		next_token(p);
+		command->compound->body = parse_list(p);
+		if (TOK_RPAREN != p->type) {
+			syntax_error(p);
+		} else {
+			next_token(p);
+		}
+	} else if (TOK_ARITH == p->type) {
+		command->compound = new_node(NODE_ARITH);
+		command->compound->name = take_arith(p);
+	} else if (is_word(p, "if")) {
+		command->compound = parse_if(p);
+	} else if (is_word(p, "while")) {
+		command->compound = parse_while(p, NODE_WHILE);
+	} else if (is_word(p, "until")) {
+		command->compound = parse_while(p, NODE_UNTIL);
+	} else if (is_word(p, "for")) {
+		command->compound = parse_for(p);
+	} else if (is_word(p, "case")) {
+		command->compound = parse_case(p);
+	} else if (is_word(p, "function") || at_definition(p)) {
+		command->compound = parse_function(p);
+	} else if (is_word(p, "{")) {
+		command->compound = new_node(NODE_GROUP);
+		next_token(p);
+		command->compound->body = parse_list(p);
+		expect(p, "}");
+	} else if ((TOK_WORD == p->type && !at_terminator(p)) || at_redirect(p)) {
+		command->args = take_words(p, &command->num_args, &command->redirects);
+	} else {
+		syntax_error(p);
+	}
+	if (command->compound) {
+		Redirect **tail = &command->redirects;
+		while (at_redirect(p) && !p->error && !p->incomplete) {
+			parse_redirect(p, &tail);
+		}
+	}
+	return command;
+}
+
+/* [!] command [| command...] */
+static Node *parse_pipeline(Parser *p) {
+	Node *node = new_node(NODE_PIPELINE);
+	CommandList *commands = xcalloc(1, sizeof(*commands));
+	size_t cmds_buf_len = 2;
+
+	node->pipeline = commands;
+	commands->cmds = xcalloc(cmds_buf_len, sizeof(*commands->cmds));
+	if (is_word(p, "!")) {
+		commands->negate = true;
+		next_token(p);
+	}
+
+	for (;;) {
+		/* grow commands buffer if necessary */
+		if (commands->length + 1 >= cmds_buf_len) {
+			cmds_buf_len += 2;
+			commands->cmds = realloc(commands->cmds, cmds_buf_len * sizeof(*commands->cmds));
+			if (!commands->cmds) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		commands->cmds[commands->length++] = parse_command(p);
+		if (p->error || p->incomplete || TOK_PIPE != p->type) {
+			break;
+		}
+		next_token(p);
+		skip_newlines(p);
+	}
+	return node;
+}
+
+/* pipeline [&& pipeline | || pipeline...], which run left to right,
+ * each one only if the status so far calls for it */
+static Node *parse_and_or(Parser *p) {
+	Node *node = parse_pipeline(p);
+
+	while (!p->error && !p->incomplete && (TOK_AND_IF == p->type || TOK_OR_IF == p->type)) {
+		Node *list = new_node(TOK_AND_IF == p->type ? NODE_AND : NODE_OR);
+		list->cond = node;
+		next_token(p);
+		skip_newlines(p);
+		list->body = parse_pipeline(p);
+		node = list;
+	}
+	return node;
+}
+
+/* Wraps a list such as "a && b" into a pipeline of its own, so that it
+ * can run in the background like one. */
+static Node *background_list(Parser *p, Node *list, size_t start) {
+	Node *node = new_node(NODE_PIPELINE);
+	CommandList *commands = xcalloc(1, sizeof(*commands));
+
+	node->pipeline = commands;
+	commands->cmds = xcalloc(2, sizeof(*commands->cmds));
+	commands->cmds[0] = xcalloc(1, sizeof(**commands->cmds));
+	commands->cmds[0]->compound = list;
+	commands->length = 1;
+	commands->text = copy(&p->src[start], p->prev_end > start ? p->prev_end - start : 0);
+	return node;
+}
+
+/* And-or lists separated by ';', '&' or newlines, up to a reserved word
+ * that ends the list (such as done), a ')' or the end of the input. */
+static Node *parse_list(Parser *p) {
+	Node *head = NULL, **tail = &head;
+
+	skip_newlines(p);
+	while (!p->error && !p->incomplete && !at_terminator(p)) {
+		size_t start = p->start;
+		Node *node = parse_and_or(p);
+
+		if (TOK_AMP == p->type && NODE_PIPELINE != node->type) {
+			node = background_list(p, node, start);
+		}
+		*tail = node;
+		tail = &node->next;
+		if (p->error || p->incomplete) {
+			break;
+		}
+
+		if (TOK_AMP == p->type) {
+			/* Only background jobs are listed, so only their text is kept */
+			if (!node->pipeline->text) {
+				node->pipeline->text = copy(&p->src[start], p->prev_end > start ? p->prev_end - start : 0);
+			}
+			node->pipeline->bg = true;
+			next_token(p);
+		} else if (TOK_SEMI == p->type || TOK_NEWLINE == p->type) {
+			next_token(p);
+		} else if (!at_terminator(p)) {
+			syntax_error(p);
+			break;
+		}
+		skip_newlines(p);
+	}
+	return head;
+}
+
+/* Parses the input into a list of commands. Returns NULL on syntax errors,
+ * empty input, or if more input is needed, which *incomplete is set for. */
+Node *parse_commands(const char *input, bool *incomplete) {
+	Parser parser;
+	Node *node;
+
+	memset(&parser, 0, sizeof(parser));
+	parser.src = input;
+	free(awaited);
+	awaited = NULL;
+	next_token(&parser);
+	node = parse_list(&parser);
+	if (!parser.error && !parser.incomplete && TOK_EOF != parser.type) {
+		/* A reserved word such as fi without its if */
+		syntax_error(&parser);
+	}
+
+	*incomplete = parser.incomplete;
+	free(parser.heredocs);
+	if (parser.error || parser.incomplete) {
+		free_node(node);
+		return NULL;
+	}
+	return node;
+}
+
+static void free_words(char **words) {
+	size_t i;
+	if (!words) {
+		return;
+	}
+	for (i = 0; words[i]; i++) {
+		free(words[i]);
+	}
+	free(words);
+}
+
+/* The delimiter of the here-document that the last incomplete input
+ * ended within, or NULL. Until a line matches it, the input can't be
+ * complete, which saves parsing long here-documents over and over. */
+const char *heredoc_awaited(void) {
+	return awaited;
+}
+
+void free_commands(CommandList *commands) {
+	size_t i;
+	for (i = 0; i < commands->length; i++) {
+		free_words(commands->cmds[i]->args);
+		free_redirects(commands->cmds[i]->redirects);
+		free_node(commands->cmds[i]->compound);
+		free(commands->cmds[i]);
+	}
+	free(commands->cmds);
+	free(commands->text);
+	commands->length = 0;
+}
+
+void free_node(Node *node) {
+	while (node) {
+		Node *next = node->next;
+		CaseItem *item = node->items;
+
+		if (node->pipeline) {
+			free_commands(node->pipeline);
+			free(node->pipeline);
+		}
+		free(node->name);
+		free_words(node->words);
+		while (item) {
+			CaseItem *next_item = item->next;
+			free_words(item->patterns);
+			free_node(item->body);
+			free(item);
+			item = next_item;
+		}
+		free_node(node->cond);
+		free_node(node->body);
+		free_node(node->alt);
+		free(node);
+		node = next;
+	}
+}
+
+/*
+ * The parse cache.
+ *
+ * Command lines recur, in loops read from a pipe as much as at the prompt,
+ * so the trees of the last PARSE_CACHE_LINES complete lines are kept,
+ * found by the hash of their text and evicted least recently used first.
+ * Trees are only read when run, so a cached one can run any number of
+ * times, and constant here-documents keep their memfds between runs.
+ */
+
+#define PARSE_CACHE_LINES (128)
+#define PARSE_CACHE_BUCKETS (256)
+/* Longer input, such as a pasted script, isn't worth keeping */
+#define PARSE_CACHE_MAX_TEXT (4096)
+
+typedef struct CachedLine {
+	uint64_t hash;
+	char *text;
+	Node *tree;
+	struct CachedLine *newer, *older; /* In order of use */
+	struct CachedLine *chain; /* In the same bucket */
+} CachedLine;
+
+static CachedLine *buckets[PARSE_CACHE_BUCKETS];
+static CachedLine *newest = NULL, *oldest = NULL;
+static size_t num_cached = 0;
+static unsigned long cache_hits = 0, cache_misses = 0;
+
+/* FNV-1a */
+static uint64_t hash_line(const char *text) {
+	uint64_t h = 14695981039346656037UL;
+	for (; *text; text++) {
+		h = (h ^ (unsigned char) *text) * 1099511628211UL;
+	}
+	return h;
+}
+
+static void unlink_line(CachedLine *line) {
+	if (line->newer) {
+		line->newer->older = line->older;
+	} else {
+		newest = line->older;
+	}
+	if (line->older) {
+		line->older->newer = line->newer;
+	} else {
+		oldest = line->newer;
+	}
+}
+
+static void push_line(CachedLine *line) {
+	line->newer = NULL;
+	line->older = newest;
+	if (newest) {
+		newest->newer = line;
+	} else {
+		oldest = line;
+	}
+	newest = line;
+}
+
+static void evict_oldest(void) {
+	CachedLine *line = oldest, **link = &buckets[line->hash % PARSE_CACHE_BUCKETS];
+
+	while (*link != line) {
+		link = &(*link)->chain;
+	}
+	*link = line->chain;
+	unlink_line(line);
+	free_node(line->tree);
+	free(line->text);
+	free(line);
+	num_cached--;
+}
+
+/* Like parse_commands, but looks the input up in the parse cache first.
+ * Sets *cached if the tree belongs to the cache, which frees it once
+ * evicted; otherwise it's the caller's to free. A cached tree is only
+ * evicted by a later call, so it's safe to run until then. */
+Node *parse_line(const char *input, bool *incomplete, bool *cached) {
+	size_t len = strlen(input);
+	uint64_t h = hash_line(input);
+	CachedLine *line;
+	Node *tree;
+
+	*cached = false;
+	if (len <= PARSE_CACHE_MAX_TEXT) {
+		for (line = buckets[h % PARSE_CACHE_BUCKETS]; line; line = line->chain) {
+			if (line->hash == h && 0 == strcmp(line->text, input)) {
+				/* What parse_commands would have left behind */
+				free(awaited);
+				awaited = NULL;
+				*incomplete = false;
+				*cached = true;
+				unlink_line(line);
+				push_line(line);
+				cache_hits++;
+				return line->tree;
+			}
+		}
+	}
+
+	/* Lines too long to keep, and those that don't parse, miss too */
+	cache_misses++;
+	tree = parse_commands(input, incomplete);
+	if (!tree || len > PARSE_CACHE_MAX_TEXT) {
+		return tree;
+	}
+	if (PARSE_CACHE_LINES == num_cached) {
+		evict_oldest();
+	}
+	line = xcalloc(1, sizeof(*line));
+	line->hash = h;
+	line->text = copy(input, len);
+	line->tree = tree;
+	line->chain = buckets[h % PARSE_CACHE_BUCKETS];
+	buckets[h % PARSE_CACHE_BUCKETS] = line;
+	push_line(line);
+	num_cached++;
+	*cached = true;
+	return tree;
+}
+
+/* Prints the parse cache's counters, for the stats builtin */
+void parse_stats(void) {
+	unsigned long lookups = cache_hits + cache_misses;
+	printf("parse cache: %lu hits, %lu misses (%lu%% hit), %lu of %d lines\n",
+		cache_hits, cache_misses, lookups ? 100 * cache_hits / lookups : 0UL,
+		(unsigned long) num_cached, PARSE_CACHE_LINES);
+}
+
+static char **copy_words(char **words) {
+	char **dst;
+	size_t n;
+
+	if (!words) {
+		return NULL;
+	}
+	for (n = 0; words[n]; n++);
+	dst = xcalloc(n + 1, sizeof(*dst));
+	while (n--) {
+		dst[n] = copy(words[n], strlen(words[n]));
+	}
+	return dst;
+}
+
+static char *copy_string(const char *str) {
+	return str ? copy(str, strlen(str)) : NULL;
+}
+
+static Redirect *copy_redirects(Redirect *r) {
+	Redirect *head = NULL, **tail = &head;
+
+	for (; r; r = r->next) {
+		Redirect *dst = xcalloc(1, sizeof(*dst));
+		dst->type = r->type;
+		dst->strip_tabs = r->strip_tabs;
+		dst->word = copy_string(r->word);
+		dst->body = copy_string(r->body);
+		dst->expand = r->expand;
+		/* The copy makes its own memfd when first run */
+		dst->cache = -1;
+		*tail = dst;
+		tail = &dst->next;
+	}
+	return head;
+}
+
+/* Copies a tree, and the nodes chained after it, into memory of its own,
+ * which free_node releases. This is how a function defined by a script
+ * outlives the script, whose tree may live in a cache file. */
+Node *copy_node(Node *node) {
+	Node *head = NULL, **tail = &head;
+
+	for (; node; node = node->next) {
+		Node *dst = new_node(node->type);
+		CaseItem *item, **items = &dst->items;
+
+		if (node->pipeline) {
+			CommandList *src = node->pipeline, *list = xcalloc(1, sizeof(*list));
+			size_t i;
+
+			list->length = src->length;
+			list->bg = src->bg;
+			list->negate = src->negate;
+			list->text = copy_string(src->text);
+			list->cmds = xcalloc(src->length + 1, sizeof(*list->cmds));
+			for (i = 0; i < src->length; i++) {
+				Command *cmd = xcalloc(1, sizeof(*cmd));
+				cmd->num_args = src->cmds[i]->num_args;
+				cmd->args = copy_words(src->cmds[i]->args);
+				cmd->compound = copy_node(src->cmds[i]->compound);
+				cmd->redirects = copy_redirects(src->cmds[i]->redirects);
+				list->cmds[i] = cmd;
+			}
+			dst->pipeline = list;
+		}
+		dst->name = copy_string(node->name);
+		dst->words = copy_words(node->words);
+		for (item = node->items; item; item = item->next) {
+			CaseItem *copied = xcalloc(1, sizeof(*copied));
+			copied->patterns = copy_words(item->patterns);
+			copied->body = copy_node(item->body);
+			*items = copied;
+			items = &copied->next;
+		}
+		dst->cond = copy_node(node->cond);
+		dst->body = copy_node(node->body);
+		dst->alt = copy_node(node->alt);
+		*tail = dst;
+		tail = &dst->next;
+	}
+	return head;
+}
@@ -0,0 +1,516 @@
+/* For readahead, dl_iterate_phdr, O_PATH and execveat */
+#define _GNU_SOURCE
+#include "main.h"
+#include <elf.h>
+#include <link.h>
+#include <dirent.h>
+
+/*
+ * The PATH cache, and prefetching of commands as they're typed.
+ *
+ * Commands are looked up along the PATH once and remembered, until the
+ * PATH changes or hash -r clears them. Lookups happen in the shell before
+ * it forks, so the children it forks inherit the results. A command that
+ * has moved since fails execv and is looked up again with execvp.
+ *
+ * Commands pinned with hash -p also keep an O_PATH descriptor of their
+ * file, which the children run with execveat. The kernel doesn't walk
+ * the path again, and what runs is the file the shell checked, even if
+ * the path is changed in between. Before each run the shell checks that
+ * the path still names the same, unmodified file, and pins it anew if
+ * it doesn't, so installing a new version takes effect right away.
+ *
+ * While the user pauses typing, readline's event hook hands us the line
+ * so far. If its first word names a command, the command is resolved
+ * and the kernel is asked to read it, and the libraries it needs, into
+ * the page cache. By the time Enter is pressed, a command that hasn't
+ * run for a while no longer waits on the disk. The reads happen in the
+ * kernel while the shell goes back to waiting for input.
+ */
+
+/* A command that was prefetched isn't again for this long */
+#define PREFETCH_INTERVAL (60)
+/* Limits on what's read of an ELF file's headers */
+#define MAX_PHDRS (64)
+#define MAX_DYNAMIC (512)
+#define MAX_STRTAB (64 * 1024)
+
+#if UINTPTR_MAX > 0xffffffffu
+#define ELF_CLASS ELFCLASS64
+typedef Elf64_Ehdr Ehdr;
+typedef Elf64_Phdr Phdr;
+typedef Elf64_Dyn Dyn;
+#else
+#define ELF_CLASS ELFCLASS32
+typedef Elf32_Ehdr Ehdr;
+typedef Elf32_Phdr Phdr;
+typedef Elf32_Dyn Dyn;
+#endif
+
+typedef struct PathEntry {
+	char *name;
+	char *path;
+	time_t prefetched; /* When it was last prefetched, or 0 */
+	int fd; /* An O_PATH descriptor of a pinned command's file, or -1 */
+	struct stat pinned; /* The file as it was when the descriptor was opened */
+	struct PathEntry *next;
+} PathEntry;
+
+static PathEntry *table[PATH_BUCKETS];
+/* The PATH that the table was filled from */
+static char *filled_from = NULL;
+static unsigned long path_hits = 0, path_misses = 0, prefetches = 0, repins = 0;
+/* The names of the commands to pin, kept across PATH changes and hash -r */
+static char **pins = NULL;
+static size_t num_pins = 0;
+/* The directories the shell's own libraries were loaded from, searched
+ * for the libraries of commands as the dynamic loader would */
+static char *lib_dirs = NULL;
+
+static unsigned long hash(const char *name) {
+	unsigned long h = 5381;
+	for (; *name; name++) {
+		h = h * 33 + (unsigned char) *name;
+	}
+	return h % PATH_BUCKETS;
+}
+
+static void clear_table(void) {
+	size_t i;
+	for (i = 0; i < PATH_BUCKETS; i++) {
+		while (table[i]) {
+			PathEntry *next = table[i]->next;
+			if (-1 != table[i]->fd) {
+				close(table[i]->fd);
+			}
+			free(table[i]->name);
+			free(table[i]->path);
+			free(table[i]);
+			table[i] = next;
+		}
+	}
+}
+
+static bool executable(const char *path) {
+	struct stat st;
+	return 0 == stat(path, &st) && S_ISREG(st.st_mode) && 0 == access(path, X_OK);
+}
+
+static bool is_pinned(const char *name) {
+	size_t i;
+	for (i = 0; i < num_pins && 0 != strcmp(pins[i], name); i++);
+	return i < num_pins;
+}
+
+/* Opens the descriptor of a pinned command, or closes it if the command
+ * isn't pinned or its file can't be opened */
+static void pin(PathEntry *entry) {
+	if (-1 != entry->fd) {
+		close(entry->fd);
+		entry->fd = -1;
+	}
+	if (!is_pinned(entry->name) || -1 == (entry->fd = open(entry->path, O_PATH | O_CLOEXEC))) {
+		return;
+	}
+	if (-1 == fstat(entry->fd, &entry->pinned) || !S_ISREG(entry->pinned.st_mode)) {
+		close(entry->fd);
+		entry->fd = -1;
+	}
+}
+
+/* Finds the entry for a command, searching the PATH on a miss */
+static PathEntry *find_entry(const char *name) {
+	const char *path_var = get_var("PATH"), *dir, *end;
+	char path[1100];
+	PathEntry *entry;
+
+	if (!path_var) {
+		path_var = "/usr/local/bin:/usr/bin:/bin";
+	}
+	if (!filled_from || 0 != strcmp(filled_from, path_var)) {
+		clear_table();
+		free(filled_from);
+		if (!(filled_from = strdup(path_var))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (entry = table[hash(name)]; entry; entry = entry->next) {
+		if (0 == strcmp(entry->name, name)) {
+			path_hits++;
+			return entry;
+		}
+	}
+
+	path_misses++;
+	for (dir = path_var; dir; dir = end ? end + 1 : NULL) {
+		size_t len;
+		end = strchr(dir, ':');
+		len = end ? (size_t) (end - dir) : strlen(dir);
+		/* Relative directories depend on where the shell is, so they're left to execvp */
+		if ('/' != *dir || (size_t) snprintf(path, sizeof(path), "%.*s/%s", (int) len, dir, name) >= sizeof(path) ||
+				!executable(path)) {
+			continue;
+		}
+		if (!(entry = calloc(1, sizeof(*entry))) || !(entry->name = strdup(name)) ||
+				!(entry->path = strdup(path))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		entry->fd = -1;
+		pin(entry);
+		entry->next = table[hash(name)];
+		table[hash(name)] = entry;
+		return entry;
+	}
+	return NULL;
+}
+
+/* Whether the path of a pinned command still names the file it was
+ * pinned to, as it was then */
+static bool pin_current(PathEntry *entry) {
+	struct stat st;
+	return 0 == stat(entry->path, &st) && st.st_dev == entry->pinned.st_dev &&
+		st.st_ino == entry->pinned.st_ino && st.st_size == entry->pinned.st_size &&
+		st.st_mtime == entry->pinned.st_mtime && st.st_ctime == entry->pinned.st_ctime;
+}
+
+/* The path of the command that name runs, or NULL if it isn't found in
+ * the PATH. Names with a slash are paths already. Called before forking,
+ * so a pinned command that has changed is pinned again here. */
+const char *resolve_command(const char *name) {
+	PathEntry *entry;
+
+	if (strchr(name, '/') || !*name) {
+		return name;
+	}
+	if (!(entry = find_entry(name))) {
+		return NULL;
+	}
+	if (-1 != entry->fd && !pin_current(entry)) {
+		repins++;
+		pin(entry);
+	}
+	return entry->path;
+}
+
+/* Runs the command as the shell resolved it, in a child it forked after
+ * resolve_command. Only returns if that fails. */
+void exec_resolved(char **args) {
+	PathEntry *entry;
+
+	if (strchr(args[0], '/') || !*args[0] || !(entry = find_entry(args[0]))) {
+		return;
+	}
+	if (-1 != entry->fd) {
+		/* Fails for scripts, whose interpreter can't open the descriptor
+		 * as it's closed on exec, so they're run by path instead */
+		execveat(entry->fd, "", args, environ, AT_EMPTY_PATH);
+	}
+	execv(entry->path, args);
+}
+
+/* Collects the directory of each library loaded into the shell, once */
+static int add_lib_dir(struct dl_phdr_info *info, size_t size, void *data) {
+	const char *name = info->dlpi_name, *slash = name ? strrchr(name, '/') : NULL, *dir;
+	size_t len = lib_dirs ? strlen(lib_dirs) : 0, dir_len;
+	char *dirs;
+
+	(void) size;
+	(void) data;
+	if (!slash || slash == name) {
+		return 0;
+	}
+	dir_len = (size_t) (slash - name);
+	for (dir = lib_dirs; dir; dir = strchr(dir, ':') ? strchr(dir, ':') + 1 : NULL) {
+		if (0 == strncmp(dir, name, dir_len) && (':' == dir[dir_len] || !dir[dir_len])) {
+			return 0;
+		}
+	}
+	if (!(dirs = realloc(lib_dirs, len + dir_len + 2))) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(dirs + len, "%s%.*s", len ? ":" : "", (int) dir_len, name);
+	lib_dirs = dirs;
+	return 0;
+}
+
+/* Asks the kernel to read the file into the page cache, without waiting
+ * for it. Returns the open file, or -1. */
+static int prefetch_file(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (-1 == fd) {
+		return -1;
+	}
+#ifdef POSIX_FADV_WILLNEED
+	if (0 != posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED))
+#endif
+	{
+		struct stat st;
+		if (0 == fstat(fd, &st)) {
+			readahead(fd, 0, (size_t) st.st_size);
+		}
+	}
+	return fd;
+}
+
+/* Prefetches the first of the library in the directories, which are
+ * separated by colons */
+static void prefetch_library(const char *name, const char *dirs) {
+	const char *dir, *end;
+	char path[1100];
+	int fd;
+
+	if (strchr(name, '/')) {
+		if (-1 != (fd = prefetch_file(name))) {
+			close(fd);
+		}
+		return;
+	}
+	for (dir = dirs; dir && *dir; dir = end ? end + 1 : NULL) {
+		size_t len;
+		end = strchr(dir, ':');
+		len = end ? (size_t) (end - dir) : strlen(dir);
+		if (0 == len || (size_t) snprintf(path, sizeof(path), "%.*s/%s", (int) len, dir, name) >= sizeof(path)) {
+			continue;
+		}
+		if (-1 != (fd = prefetch_file(path))) {
+			close(fd);
+			return;
+		}
+	}
+}
+
+/* The offset in the file of an address of its loaded image */
+static bool file_offset(const Phdr *phdrs, size_t n, uint64_t addr, off_t *offset) {
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (PT_LOAD == phdrs[i].p_type && phdrs[i].p_vaddr <= addr &&
+				addr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+			*offset = (off_t) (phdrs[i].p_offset + (addr - phdrs[i].p_vaddr));
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool read_at(int fd, void *buf, size_t len, off_t offset) {
+	return (ssize_t) len == pread(fd, buf, len, offset);
+}
+
+/* Prefetches the dynamic loader and the libraries an executable needs,
+ * as listed by its dynamic section. Their own dependencies are left
+ * out; they're mostly shared with everything else and already cached. */
+static void prefetch_libraries(int fd) {
+	Ehdr ehdr;
+	Phdr phdrs[MAX_PHDRS];
+	Dyn dyn[MAX_DYNAMIC];
+	char interp[256], *strtab = NULL;
+	const char *runpath = NULL, *env = getenv("LD_LIBRARY_PATH");
+	uint64_t strtab_addr = 0, strtab_size = 0;
+	size_t num_dyn = 0, i;
+	off_t offset;
+
+	if (!read_at(fd, &ehdr, sizeof(ehdr), 0) || 0 != memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+			ELF_CLASS != ehdr.e_ident[EI_CLASS] || sizeof(Phdr) != ehdr.e_phentsize ||
+			MAX_PHDRS < ehdr.e_phnum ||
+			!read_at(fd, phdrs, ehdr.e_phnum * sizeof(Phdr), (off_t) ehdr.e_phoff)) {
+		/* Not an executable we know, such as a script */
+		return;
+	}
+
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		if (PT_INTERP == phdrs[i].p_type && phdrs[i].p_filesz < sizeof(interp) &&
+				read_at(fd, interp, phdrs[i].p_filesz, (off_t) phdrs[i].p_offset)) {
+			interp[phdrs[i].p_filesz] = 0;
+			prefetch_library(interp, NULL);
+		} else if (PT_DYNAMIC == phdrs[i].p_type) {
+			num_dyn = phdrs[i].p_filesz / sizeof(Dyn);
+			num_dyn = num_dyn < MAX_DYNAMIC ? num_dyn : MAX_DYNAMIC;
+			if (!read_at(fd, dyn, num_dyn * sizeof(Dyn), (off_t) phdrs[i].p_offset)) {
+				num_dyn = 0;
+			}
+		}
+	}
+	for (i = 0; i < num_dyn && DT_NULL != dyn[i].d_tag; i++) {
+		if (DT_STRTAB == dyn[i].d_tag) {
+			strtab_addr = dyn[i].d_un.d_ptr;
+		} else if (DT_STRSZ == dyn[i].d_tag) {
+			strtab_size = dyn[i].d_un.d_val;
+		}
+	}
+	if (!strtab_addr || !strtab_size || MAX_STRTAB < strtab_size ||
+			!file_offset(phdrs, ehdr.e_phnum, strtab_addr, &offset) ||
+			!(strtab = malloc((size_t) strtab_size + 1)) ||
+			!read_at(fd, strtab, (size_t) strtab_size, offset)) {
+		free(strtab);
+		return;
+	}
+	strtab[strtab_size] = 0;
+
+	if (!lib_dirs) {
+		dl_iterate_phdr(&add_lib_dir, NULL);
+	}
+	for (i = 0; i < num_dyn && DT_NULL != dyn[i].d_tag; i++) {
+		if ((DT_RUNPATH == dyn[i].d_tag || DT_RPATH == dyn[i].d_tag) &&
+				dyn[i].d_un.d_val < strtab_size && !strchr(strtab + dyn[i].d_un.d_val, '$')) {
+			runpath = strtab + dyn[i].d_un.d_val;
+		}
+	}
+	for (i = 0; i < num_dyn && DT_NULL != dyn[i].d_tag; i++) {
+		const char *name;
+		if (DT_NEEDED != dyn[i].d_tag || dyn[i].d_un.d_val >= strtab_size) {
+			continue;
+		}
+		name = strtab + dyn[i].d_un.d_val;
+		if (runpath) {
+			prefetch_library(name, runpath);
+		}
+		prefetch_library(name, env);
+		prefetch_library(name, lib_dirs);
+	}
+	free(strtab);
+}
+
+/* Looks at the line being typed, and prefetches the command its first
+ * word names, if that hasn't been done lately. Called while readline
+ * waits for input. */
+void speculate(const char *line) {
+	static char last[256];
+	char word[256];
+	size_t len = 0;
+	PathEntry *entry;
+	time_t now;
+	int fd;
+
+	while (' ' == *line || '\t' == *line) {
+		line++;
+	}
+	while (line[len] && !strchr(" \t\n|&;()<>", line[len])) {
+		len++;
+	}
+	if (0 == len || len >= sizeof(word)) {
+		return;
+	}
+	memcpy(word, line, len);
+	word[len] = 0;
+	if (0 == strcmp(word, last)) {
+		return;
+	}
+	strcpy(last, word);
+	/* Only plain command names, and not what runs within the shell */
+	if (strpbrk(word, "/'\"\\$`=~{*?[") || builtin_func(word) || find_function(word, word)) {
+		return;
+	}
+
+	if (!(entry = find_entry(word)) || (time(&now) - entry->prefetched < PREFETCH_INTERVAL)) {
+		return;
+	}
+	entry->prefetched = now;
+	if (-1 == (fd = prefetch_file(entry->path))) {
+		return;
+	}
+	prefetches++;
+	prefetch_libraries(fd);
+	close(fd);
+}
+
+/* Pins or unpins a command, looking it up */
+static bool set_pinned(const char *name, bool pinned) {
+	PathEntry *entry;
+	size_t i;
+
+	for (i = 0; i < num_pins && 0 != strcmp(pins[i], name); i++);
+	if (pinned && i == num_pins) {
+		char **grown = realloc(pins, (num_pins + 1) * sizeof(*pins));
+		if (!grown || !(grown[num_pins] = strdup(name))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		pins = grown;
+		num_pins++;
+	} else if (!pinned && i < num_pins) {
+		free(pins[i]);
+		pins[i] = pins[--num_pins];
+	}
+	if (strchr(name, '/') || !(entry = find_entry(name))) {
+		return false;
+	}
+	pin(entry);
+	return true;
+}
+
+/* The built-in hash command. Without arguments it lists the commands
+ * found so far, -r forgets them and names are looked up. With -p the
+ * names are pinned, and with -u unpinned; -p alone lists the pins. */
+int hash_cmd(char **args) {
+	int status = EXIT_SUCCESS;
+	PathEntry *entry;
+	size_t i;
+	char mode = 0;
+
+	if (args[1] && (0 == strcmp(args[1], "-p") || 0 == strcmp(args[1], "-u"))) {
+		mode = args[1][1];
+		args++;
+	}
+	if (!args[1]) {
+		if ('p' == mode) {
+			for (i = 0; i < num_pins; i++) {
+				printf("%s\n", pins[i]);
+			}
+			return status;
+		}
+		for (i = 0; i < PATH_BUCKETS; i++) {
+			for (entry = table[i]; entry; entry = entry->next) {
+				printf("%s\t%s%s\n", entry->name, entry->path, -1 != entry->fd ? "\tpinned" : "");
+			}
+		}
+		return status;
+	}
+	if (!mode && 0 == strcmp(args[1], "-r")) {
+		clear_table();
+		return status;
+	}
+	for (args++; *args; args++) {
+		if ('u' == mode) {
+			set_pinned(*args, false);
+		} else if ('p' == mode ? !set_pinned(*args, true) : !resolve_command(*args)) {
+			fprintf(stderr, "hash: %s: not found\n", *args);
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
+
+/* Adds the commands in the PATH starting with the prefix */
+void complete_commands(const char *prefix, size_t len, Completions *c) {
+	const char *path_var = get_var("PATH"), *dir, *end;
+	char path[1100];
+
+	for (dir = path_var; dir && *dir; dir = end ? end + 1 : NULL) {
+		struct dirent *entry;
+		size_t dir_len;
+		DIR *d;
+
+		end = strchr(dir, ':');
+		dir_len = end ? (size_t) (end - dir) : strlen(dir);
+		if ((size_t) snprintf(path, sizeof(path), "%.*s", (int) dir_len, dir) >= sizeof(path) ||
+				NULL == (d = opendir(dir_len ? path : "."))) {
+			continue;
+		}
+		while (NULL != (entry = readdir(d))) {
+			if (0 == strncmp(entry->d_name, prefix, len) && '.' != entry->d_name[0]) {
+				add_completion(c, entry->d_name);
+			}
+		}
+		closedir(d);
+	}
+}
+
+/* Prints the PATH cache's counters, for the stats builtin */
+void path_stats(void) {
+	printf("path cache: %lu hits, %lu misses, %lu commands prefetched, %lu pins renewed\n",
+		path_hits, path_misses, prefetches, repins);
+}
@@ -0,0 +1,60 @@
+/*
+ * The interface of loadable builtins, for shared objects that are loaded
+ * with "enable -f file name ...".
+ *
+ * A plugin exports a single SmshPlugin named smsh_plugin, listing its
+ * builtins. The shell refuses plugins built for another SMSH_PLUGIN_ABI,
+ * which only changes when something here does in an incompatible way.
+ *
+ *	static int hello(char **args) {
+ *		printf("hello %s\n", args[1] ? args[1] : "world");
+ *		return 0;
+ *	}
+ *	static const SmshBuiltin builtins[] = {
+ *		{ "hello", &hello, SMSH_PIPELINE_SAFE },
+ *		{ NULL, NULL, 0 }
+ *	};
+ *	const SmshPlugin smsh_plugin = { SMSH_PLUGIN_ABI, builtins, NULL };
+ *
+ * Builtins run within the shell, like its own: args are the expanded
+ * words of the command, ended by NULL, and the return value is its exit
+ * status. They write to stdout and stderr with stdio or write.
+ */
+#ifndef SMSH_PLUGIN_H
+#define SMSH_PLUGIN_H
+
+#include <sys/types.h>
+
+#define SMSH_PLUGIN_ABI (1)
+
+/* The builtin may run in a forked process, as a stage of a pipeline or
+ * a command of xargs. Without it, it only runs as a command of its own. */
+#define SMSH_PIPELINE_SAFE (1 << 0)
+/* The builtin reads its stdin only with the host's read_input, which
+ * shares the input that the shell's read has buffered. Without it, the
+ * shell doesn't read ahead of input that the builtin might read. */
+#define SMSH_STREAMS (1 << 1)
+
+typedef struct {
+	const char *name;
+	int (*func)(char **);
+	unsigned int flags;
+} SmshBuiltin;
+
+/* What the shell offers its plugins */
+typedef struct {
+	int abi;
+	const char *(*get_var)(const char *);
+	void (*set_var)(const char *, const char *);
+	ssize_t (*read_input)(int, char *, size_t);
+} SmshHost;
+
+typedef struct {
+	int abi; /* SMSH_PLUGIN_ABI */
+	const SmshBuiltin *builtins; /* Ended by one with a NULL name */
+	/* Called once when the plugin is loaded, if given. Nonzero fails
+	 * the loading. The host outlives the plugin. */
+	int (*load)(const SmshHost *);
+} SmshPlugin;
+
+#endif
@@ -0,0 +1,217 @@
+#include "main.h"
+#include <dlfcn.h>
+
+/*
+ * Builtins loaded from shared objects, see plugin.h.
+ *
+ * enable -f loads a plugin with dlopen and enables the builtins named
+ * (or all of them), which are then looked up right after the shell's
+ * own. They run within the shell like those, without a fork or an exec.
+ * A plugin stays loaded while any of its builtins are enabled.
+ */
+
+typedef struct Plugin {
+	char *file; /* As given to enable -f, for listing */
+	void *handle;
+	const SmshPlugin *desc;
+	size_t enabled; /* How many of its builtins are */
+	struct Plugin *next;
+} Plugin;
+
+/* An enabled builtin */
+typedef struct Loadable {
+	const SmshBuiltin *builtin;
+	Plugin *plugin;
+	struct Loadable *next;
+} Loadable;
+
+static const SmshHost host = {
+	SMSH_PLUGIN_ABI,
+	&get_var,
+	&set_var,
+	&read_input
+};
+
+static Plugin *plugins = NULL;
+static Loadable *loadables = NULL;
+
+/* The enabled builtin of the name, or NULL */
+const SmshBuiltin *find_loadable(const char *name) {
+	Loadable *l;
+	for (l = loadables; l; l = l->next) {
+		if (0 == strcmp(l->builtin->name, name)) {
+			return l->builtin;
+		}
+	}
+	return NULL;
+}
+
+/* Opens the file, looking for a bare name in $SMSH_PLUGIN_PATH first */
+static void *open_plugin(const char *file) {
+	const char *dirs = get_var("SMSH_PLUGIN_PATH"), *dir, *end;
+	char path[1100];
+	void *handle;
+
+	for (dir = strchr(file, '/') ? NULL : dirs; dir && *dir; dir = end ? end + 1 : NULL) {
+		size_t len;
+		end = strchr(dir, ':');
+		len = end ? (size_t) (end - dir) : strlen(dir);
+		if (0 == len || (size_t) snprintf(path, sizeof(path), "%.*s/%s", (int) len, dir, file) >= sizeof(path) ||
+				0 != access(path, R_OK)) {
+			continue;
+		}
+		if (NULL != (handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+			return handle;
+		}
+		fprintf(stderr, "enable: %s\n", dlerror());
+		return NULL;
+	}
+	if (!(handle = dlopen(file, RTLD_NOW | RTLD_LOCAL))) {
+		fprintf(stderr, "enable: %s\n", dlerror());
+	}
+	return handle;
+}
+
+static Plugin *load_plugin(const char *file) {
+	const SmshPlugin *desc;
+	void *handle = open_plugin(file);
+	Plugin *p;
+
+	if (!handle) {
+		return NULL;
+	}
+	for (p = plugins; p; p = p->next) {
+		if (p->handle == handle) {
+			/* Loaded already; dlopen only counted another reference */
+			dlclose(handle);
+			return p;
+		}
+	}
+	if (!(desc = dlsym(handle, "smsh_plugin"))) {
+		fprintf(stderr, "enable: %s: not an " SMSH " plugin\n", file);
+		dlclose(handle);
+		return NULL;
+	}
+	if (SMSH_PLUGIN_ABI != desc->abi) {
+		fprintf(stderr, "enable: %s: built for plugin ABI %d, not %d\n", file, desc->abi, SMSH_PLUGIN_ABI);
+		dlclose(handle);
+		return NULL;
+	}
+	if (desc->load && 0 != desc->load(&host)) {
+		fprintf(stderr, "enable: %s: failed to load\n", file);
+		dlclose(handle);
+		return NULL;
+	}
+	if (!(p = calloc(1, sizeof(*p))) || !(p->file = strdup(file))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	p->handle = handle;
+	p->desc = desc;
+	p->next = plugins;
+	plugins = p;
+	return p;
+}
+
+/* Unloads the plugin once none of its builtins are enabled */
+static void release_plugin(Plugin *plugin) {
+	Plugin **link;
+
+	if (plugin->enabled) {
+		return;
+	}
+	for (link = &plugins; *link != plugin; link = &(*link)->next);
+	*link = plugin->next;
+	dlclose(plugin->handle);
+	free(plugin->file);
+	free(plugin);
+}
+
+static bool disable(const char *name) {
+	Loadable **link, *l;
+
+	for (link = &loadables; *link && 0 != strcmp((*link)->builtin->name, name); link = &(*link)->next);
+	if (!(l = *link)) {
+		return false;
+	}
+	*link = l->next;
+	l->plugin->enabled--;
+	release_plugin(l->plugin);
+	free(l);
+	return true;
+}
+
+static bool enable(Plugin *plugin, const SmshBuiltin *builtin) {
+	Loadable *l;
+
+	if (builtin_func(builtin->name) && !find_loadable(builtin->name)) {
+		fprintf(stderr, "enable: %s: is a shell builtin\n", builtin->name);
+		return false;
+	}
+	/* Enabling it again, maybe from another plugin, replaces it. It's
+	 * counted first, so that the plugin stays loaded meanwhile. */
+	plugin->enabled++;
+	disable(builtin->name);
+	if (!(l = malloc(sizeof(*l)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	l->builtin = builtin;
+	l->plugin = plugin;
+	l->next = loadables;
+	loadables = l;
+	return true;
+}
+
+/* The built-in enable command. "enable -f file [name ...]" loads the
+ * builtins of a plugin, all of them if none are named, "enable -d name
+ * ..." removes them and "enable" lists them. */
+int enable_cmd(char **args) {
+	int status = EXIT_SUCCESS;
+	const SmshBuiltin *b;
+	Plugin *plugin;
+	Loadable *l;
+
+	if (!args[1]) {
+		for (l = loadables; l; l = l->next) {
+			printf("enable -f %s %s\n", l->plugin->file, l->builtin->name);
+		}
+		return status;
+	}
+	if (0 == strcmp(args[1], "-d")) {
+		for (args += 2; *args; args++) {
+			if (!disable(*args)) {
+				fprintf(stderr, "enable: %s: not a loaded builtin\n", *args);
+				status = EXIT_FAILURE;
+			}
+		}
+		return status;
+	}
+	if (0 != strcmp(args[1], "-f") || !args[2]) {
+		fprintf(stderr, "enable: usage: enable [-f file [name ...]] [-d name ...]\n");
+		return 2;
+	}
+
+	if (!(plugin = load_plugin(args[2]))) {
+		return EXIT_FAILURE;
+	}
+	if (!args[3]) {
+		for (b = plugin->desc->builtins; b->name; b++) {
+			if (!enable(plugin, b)) {
+				status = EXIT_FAILURE;
+			}
+		}
+	}
+	for (args += 3; *args; args++) {
+		for (b = plugin->desc->builtins; b->name && 0 != strcmp(b->name, *args); b++);
+		if (!b->name) {
+			fprintf(stderr, "enable: %s: not found in %s\n", *args, plugin->file);
+			status = EXIT_FAILURE;
+		} else if (!enable(plugin, b)) {
+			status = EXIT_FAILURE;
+		}
+	}
+	/* Nothing may have been enabled from it */
+	release_plugin(plugin);
+	return status;
+}
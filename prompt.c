@@ -0,0 +1,521 @@
+/* For st_mtim and gethostname */
+#define _DEFAULT_SOURCE
+#include "main.h"
+
+/*
+ * The prompt, as configured by PS1.
+ *
+ * PS1 is compiled into a list of segments when it changes, and rendered
+ * from them for each prompt. It understands
+ *
+ *	\w  the working directory, with ~ for $HOME   \W  its last part
+ *	\u  the user              \h  the host name   \$  # for root, else $
+ *	\?  the last exit status  \D  how long the last command took
+ *	\j  the number of jobs    \g  the git branch, with * if it's modified
+ *	\e  an escape character   \[ \]  around what takes no room, like colors
+ *	\\  a backslash
+ *
+ * Everything but \g is known right away. The branch is read from HEAD,
+ * but telling whether the worktree is modified means a stat of every
+ * file in the index, which takes long in a large repository. That's
+ * done in slices of a few milliseconds while the line editor waits for
+ * keys, and the prompt is redrawn in place when it's done. Until then
+ * the prompt shows what was found for the repository last time, so it
+ * appears right away and never waits on the scan. A scan that takes
+ * longer than its budget gives up, leaving the state unknown.
+ */
+
+#define PROMPT_MAX (1024)
+#define PATH_LEN (1100)
+#define DEFAULT_PS1 "\\w ¥ "
+/* Repositories whose state is remembered */
+#define REPO_CACHE (16)
+/* A repository is scanned again after this long, if it hasn't changed */
+#define RESCAN_MS (2000)
+/* Time spent scanning per call while waiting for keys, and in all */
+#define SCAN_SLICE_MS (10)
+#define SCAN_BUDGET_MS (2000)
+/* What an entry of a version 2 or 3 index takes before its name */
+#define INDEX_ENTRY (62)
+
+typedef enum {
+	SEG_TEXT,
+	SEG_CWD,
+	SEG_CWD_BASE,
+	SEG_USER,
+	SEG_HOST,
+	SEG_SIGN,
+	SEG_STATUS,
+	SEG_DURATION,
+	SEG_JOBS,
+	SEG_GIT
+} SegmentType;
+
+typedef struct {
+	SegmentType type;
+	char *text; /* SEG_TEXT */
+} Segment;
+
+/* What was last seen of a repository */
+typedef struct {
+	char *root; /* The worktree, or NULL for an unused slot */
+	char *git_dir;
+	char branch[256];
+	int dirty; /* 1 or 0, or -1 when unknown */
+	int64_t scanned; /* When it was last scanned, in ms, or 0 */
+	struct timespec index_mtime; /* Of the index that was scanned */
+	unsigned long used; /* For dropping the least recently used */
+} Repo;
+
+static char *compiled_from = NULL;
+static Segment *segments = NULL;
+static size_t num_segments = 0;
+static char rendered[PROMPT_MAX];
+static uint64_t last_duration = 0;
+
+static Repo repos[REPO_CACHE];
+static Repo *current_repo = NULL;
+static unsigned long uses = 0;
+
+/* The scan of a repository's index that's in progress */
+static struct {
+	Repo *repo;
+	unsigned char *map;
+	size_t len, offset;
+	unsigned long left; /* Entries */
+	int version;
+	int64_t spent; /* ms */
+} scan;
+
+static int64_t now_ms(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void add_segment(SegmentType type, const char *text, size_t len) {
+	Segment *seg;
+
+	if (!(segments = realloc(segments, (num_segments + 1) * sizeof(*segments)))) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	seg = &segments[num_segments++];
+	seg->type = type;
+	seg->text = NULL;
+	if (SEG_TEXT == type) {
+		if (!(seg->text = malloc(len + 1))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(seg->text, text, len);
+		seg->text[len] = 0;
+	}
+}
+
+/* Compiles PS1 into segments, with runs of text in one */
+static void compile(const char *ps1) {
+	char text[PROMPT_MAX];
+	size_t len = 0, i;
+
+	for (i = 0; i < num_segments; i++) {
+		free(segments[i].text);
+	}
+	num_segments = 0;
+	for (; *ps1; ps1++) {
+		SegmentType type = SEG_TEXT;
+		char c = *ps1;
+
+		if ('\\' == c && ps1[1]) {
+			switch (*++ps1) {
+				case 'w': type = SEG_CWD; break;
+				case 'W': type = SEG_CWD_BASE; break;
+				case 'u': type = SEG_USER; break;
+				case 'h': type = SEG_HOST; break;
+				case '$': type = SEG_SIGN; break;
+				case '?': type = SEG_STATUS; break;
+				case 'D': type = SEG_DURATION; break;
+				case 'j': type = SEG_JOBS; break;
+				case 'g': type = SEG_GIT; break;
+				case 'e': c = '\033'; break;
+				/* Readline's markers of what takes no room */
+				case '[': c = '\001'; break;
+				case ']': c = '\002'; break;
+				default: c = *ps1;
+			}
+		}
+		if (SEG_TEXT != type) {
+			if (len) {
+				add_segment(SEG_TEXT, text, len);
+				len = 0;
+			}
+			add_segment(type, NULL, 0);
+		} else if (len + 1 < sizeof(text)) {
+			text[len++] = c;
+		}
+	}
+	if (len) {
+		add_segment(SEG_TEXT, text, len);
+	}
+}
+
+/* Finds the git directory of a worktree, which .git is or points to */
+static char *git_dir(const char *root) {
+	char path[PATH_LEN], buf[PATH_LEN + 16], *dir;
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	if ((size_t) snprintf(path, sizeof(path), "%s/.git", root) >= sizeof(path) || -1 == stat(path, &st)) {
+		return NULL;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		/* "gitdir: path" of a linked worktree or a submodule */
+		if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+			return NULL;
+		}
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n <= 8 || 0 != strncmp(buf, "gitdir: ", 8)) {
+			return NULL;
+		}
+		buf[n] = 0;
+		buf[strcspn(buf, "\n")] = 0;
+		if ('/' != buf[8]) {
+			snprintf(path, sizeof(path), "%s/%s", root, buf + 8);
+		} else {
+			snprintf(path, sizeof(path), "%s", buf + 8);
+		}
+	}
+	if (!(dir = strdup(path))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	return dir;
+}
+
+/* Reads the branch from HEAD, or the start of the commit when detached */
+static void read_branch(Repo *repo) {
+	char path[PATH_LEN], head[300];
+	ssize_t n = -1;
+	int fd;
+
+	repo->branch[0] = 0;
+	if ((size_t) snprintf(path, sizeof(path), "%s/HEAD", repo->git_dir) < sizeof(path) &&
+			-1 != (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+		n = read(fd, head, sizeof(head) - 1);
+		close(fd);
+	}
+	if (n <= 0) {
+		return;
+	}
+	head[n] = 0;
+	head[strcspn(head, "\n")] = 0;
+	if (0 == strncmp(head, "ref: refs/heads/", 16)) {
+		snprintf(repo->branch, sizeof(repo->branch), "%s", head + 16);
+	} else {
+		snprintf(repo->branch, sizeof(repo->branch), "%.7s", head);
+	}
+}
+
+static void end_scan(void) {
+	if (scan.map) {
+		munmap(scan.map, scan.len);
+	}
+	memset(&scan, 0, sizeof(scan));
+}
+
+/* The repository the directory is in, or NULL. The worktree is found
+ * by looking for .git in the directory and those above it. */
+static Repo *find_repo(const char *cwd) {
+	char root[PATH_LEN], *slash, *dir = NULL;
+	Repo *repo = NULL;
+	size_t i;
+
+	snprintf(root, sizeof(root), "%s", cwd);
+	for (;;) {
+		for (i = 0; i < REPO_CACHE; i++) {
+			if (repos[i].root && 0 == strcmp(repos[i].root, root)) {
+				repo = &repos[i];
+				break;
+			}
+		}
+		if (repo || NULL != (dir = git_dir(root))) {
+			break;
+		}
+		if (!(slash = strrchr(root, '/')) || slash == root) {
+			return NULL;
+		}
+		*slash = 0;
+	}
+
+	if (!repo) {
+		/* Take the slot used the longest time ago */
+		repo = &repos[0];
+		for (i = 1; i < REPO_CACHE; i++) {
+			if (!repos[i].root || (repo->root && repos[i].used < repo->used)) {
+				repo = &repos[i];
+			}
+		}
+		if (scan.repo == repo) {
+			end_scan();
+		}
+		free(repo->root);
+		free(repo->git_dir);
+		memset(repo, 0, sizeof(*repo));
+		if (!(repo->root = strdup(root))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		repo->git_dir = dir;
+		repo->dirty = -1;
+	}
+	repo->used = ++uses;
+	read_branch(repo);
+	return repo;
+}
+
+static unsigned long be32(const unsigned char *p) {
+	return (unsigned long) p[0] << 24 | (unsigned long) p[1] << 16 | (unsigned long) p[2] << 8 | p[3];
+}
+
+/* Starts scanning the repository's index, unless it was lately and
+ * hasn't changed since */
+static void start_scan(Repo *repo) {
+	char path[PATH_LEN];
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (scan.repo == repo) {
+		return;
+	}
+	if ((size_t) snprintf(path, sizeof(path), "%s/index", repo->git_dir) >= sizeof(path) ||
+			-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+		return;
+	}
+	if (-1 == fstat(fd, &st) || (size_t) st.st_size < 12 ||
+			(repo->scanned && now_ms() - repo->scanned < RESCAN_MS &&
+			st.st_mtim.tv_sec == repo->index_mtime.tv_sec && st.st_mtim.tv_nsec == repo->index_mtime.tv_nsec)) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map) {
+		return;
+	}
+	end_scan();
+	scan.repo = repo;
+	scan.map = map;
+	scan.len = (size_t) st.st_size;
+	scan.version = (int) be32(scan.map + 4);
+	scan.left = be32(scan.map + 8);
+	scan.offset = 12;
+	repo->index_mtime = st.st_mtim;
+	if (0 != memcmp(scan.map, "DIRC", 4) || (2 != scan.version && 3 != scan.version)) {
+		/* Version 4 compresses the names, and isn't read */
+		repo->dirty = -1;
+		end_scan();
+	}
+}
+
+/* Whether the file of the index entry at offset has changed. Moves the
+ * offset past the entry, or to the end if it's malformed. */
+static bool entry_changed(void) {
+	const unsigned char *entry = scan.map + scan.offset;
+	size_t name_at = INDEX_ENTRY, name_len, size;
+	unsigned long flags, mode;
+	char path[PATH_LEN];
+	struct stat st;
+
+	if (scan.offset + INDEX_ENTRY + 2 > scan.len) {
+		scan.offset = scan.len;
+		return false;
+	}
+	flags = (unsigned long) entry[60] << 8 | entry[61];
+	if (3 == scan.version && (flags & 0x4000)) {
+		/* Extended flags, with skip-worktree among them */
+		name_at += 2;
+		if (entry[62] & 0x40) {
+			flags |= 0x8000;
+		}
+	}
+	name_len = flags & 0xfff;
+	if (0xfff == name_len) {
+		const unsigned char *end = memchr(entry + name_at, 0, scan.len - scan.offset - name_at);
+		name_len = end ? (size_t) (end - entry - name_at) : scan.len;
+	}
+	size = (name_at + name_len + 8) & ~(size_t) 7;
+	if (scan.offset + size > scan.len) {
+		scan.offset = scan.len;
+		return false;
+	}
+	scan.offset += size;
+	mode = be32(entry + 24);
+	if ((flags & 0x8000) || S_ISLNK(mode) || 0160000 == (mode & 0170000)) {
+		/* Assumed unchanged, or a link or a submodule, which aren't checked */
+		return false;
+	}
+	if ((size_t) snprintf(path, sizeof(path), "%s/%.*s", scan.repo->root, (int) name_len,
+			(const char *) entry + name_at) >= sizeof(path)) {
+		return false;
+	}
+	/* The index keeps the low 32 bits of each */
+	return -1 == lstat(path, &st) || ((unsigned long) st.st_size & 0xffffffffUL) != be32(entry + 36) ||
+		((unsigned long) st.st_mtim.tv_sec & 0xffffffffUL) != be32(entry + 8) ||
+		(0 != be32(entry + 12) && (unsigned long) st.st_mtim.tv_nsec != be32(entry + 12));
+}
+
+/* Scans for a while, returning whether the repository's state changed */
+static bool scan_slice(void) {
+	int64_t start = now_ms(), now = start;
+	int dirty = 0, checked = 0;
+
+	while (scan.left && scan.offset < scan.len) {
+		scan.left--;
+		if (entry_changed()) {
+			dirty = 1;
+			break;
+		}
+		if (0 == ++checked % 64 && (now = now_ms()) - start >= SCAN_SLICE_MS) {
+			scan.spent += now - start;
+			if (scan.spent < SCAN_BUDGET_MS) {
+				return false;
+			}
+			dirty = -1;
+			break;
+		}
+	}
+	if (!dirty && scan.left) {
+		/* The index ended early */
+		dirty = -1;
+	}
+	scan.repo->scanned = now_ms();
+	if (dirty == scan.repo->dirty) {
+		end_scan();
+		return false;
+	}
+	scan.repo->dirty = dirty;
+	end_scan();
+	return true;
+}
+
+static void append(char **dst, const char *end, const char *src) {
+	while (*src && *dst < end) {
+		*(*dst)++ = *src++;
+	}
+}
+
+/* Renders the prompt from the segments as things stand */
+static const char *render(void) {
+	char *dst = rendered, *end = rendered + sizeof(rendered) - 1, buf[PATH_LEN];
+	size_t i;
+
+	for (i = 0; i < num_segments; i++) {
+		const char *slash;
+		buf[0] = 0;
+		switch (segments[i].type) {
+			case SEG_TEXT:
+				append(&dst, end, segments[i].text);
+				continue;
+			case SEG_CWD:
+			case SEG_CWD_BASE:
+				if (NULL == getcwd(buf, sizeof(buf) - 1)) {
+					/* Left out if it's gone or too long */
+					buf[0] = 0;
+				}
+				if (SEG_CWD == segments[i].type) {
+					substitute_home(buf);
+				} else if (NULL != (slash = strrchr(buf, '/')) && slash[1]) {
+					memmove(buf, slash + 1, strlen(slash));
+				}
+				break;
+			case SEG_USER: {
+				struct passwd *pw = getpwuid(getuid());
+				snprintf(buf, sizeof(buf), "%s", pw ? pw->pw_name : "");
+				break;
+			}
+			case SEG_HOST:
+				if (0 != gethostname(buf, 256)) {
+					buf[0] = 0;
+				}
+				buf[strcspn(buf, ".")] = 0;
+				break;
+			case SEG_SIGN:
+				strcpy(buf, 0 == geteuid() ? "#" : "$");
+				break;
+			case SEG_STATUS:
+				snprintf(buf, sizeof(buf), "%s", get_var("?"));
+				break;
+			case SEG_DURATION:
+				if (last_duration < 1000) {
+					sprintf(buf, "%lums", (unsigned long) last_duration);
+				} else if (last_duration < 60000) {
+					sprintf(buf, "%.1fs", (double) last_duration / 1000);
+				} else {
+					sprintf(buf, "%lum%lus", (unsigned long) (last_duration / 60000),
+						(unsigned long) (last_duration / 1000 % 60));
+				}
+				break;
+			case SEG_JOBS:
+				sprintf(buf, "%lu", (unsigned long) count_jobs());
+				break;
+			case SEG_GIT:
+				if (current_repo) {
+					snprintf(buf, sizeof(buf), "%s%s", current_repo->branch,
+						1 == current_repo->dirty ? "*" : -1 == current_repo->dirty &&
+						current_repo->scanned ? "?" : "");
+				}
+				break;
+		}
+		append(&dst, end, buf);
+	}
+	*dst = 0;
+	return rendered;
+}
+
+/* The prompt to show for a new command. Starts the scan of the git
+ * repository if PS1 shows it, without waiting for it. */
+const char *build_prompt(void) {
+	const char *ps1 = get_var("PS1");
+	char cwd[PATH_LEN];
+	size_t i;
+
+	if (!ps1) {
+		ps1 = DEFAULT_PS1;
+	}
+	if (!compiled_from || 0 != strcmp(compiled_from, ps1)) {
+		free(compiled_from);
+		if (!(compiled_from = strdup(ps1))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		compile(ps1);
+	}
+
+	current_repo = NULL;
+	for (i = 0; i < num_segments; i++) {
+		if (SEG_GIT == segments[i].type) {
+			if (NULL != getcwd(cwd, sizeof(cwd)) && NULL != (current_repo = find_repo(cwd))) {
+				start_scan(current_repo);
+			}
+			break;
+		}
+	}
+	return render();
+}
+
+/* Carries on with the scan while waiting for keys. Returns the prompt
+ * to show instead if it changed, or NULL. */
+const char *update_prompt(void) {
+	if (!scan.repo || !scan_slice()) {
+		return NULL;
+	}
+	return current_repo ? render() : NULL;
+}
+
+/* Notes how long the last command took, for \D */
+void prompt_duration(uint64_t ms) {
+	last_duration = ms;
+}
@@ -0,0 +1,271 @@
+#include "main.h"
+
+/*
+ * The read builtin.
+ *
+ * Reading a byte at a time is the only way to not consume input past
+ * the end of the line when the input is shared with other processes,
+ * but it costs a syscall per byte. Instead, input is read in large
+ * chunks whenever the leftovers can't be lost:
+ *
+ * - Regular files are buffered, and the file offset is moved back to
+ *   the end of the consumed input (sync_input) before anything else
+ *   gets a chance to read from the file.
+ * - Terminals in canonical mode never return more than one line.
+ * - Pipes claimed by a reader that is the only one to use them
+ *   (claim_input) are buffered as well.
+ *
+ * Everything else falls back to reading a byte at a time.
+ */
+
+static InputBuffer buffers[READ_FDS];
+
+/* Whether input from fd may be read past the end of the line */
+static bool can_buffer(int fd, InputBuffer *buffer) {
+	struct stat st;
+	struct termios term;
+
+	buffer->seekable = false;
+	if (-1 == fstat(fd, &st)) {
+		return false;
+	}
+	if (S_ISREG(st.st_mode)) {
+		buffer->seekable = true;
+		return true;
+	}
+	if (isatty(fd) && 0 == tcgetattr(fd, &term) && (term.c_lflag & ICANON)) {
+		return true;
+	}
+	return buffer->owned;
+}
+
+void claim_input(int fd, bool owned) {
+	if (0 <= fd && fd < READ_FDS) {
+		buffers[fd].owned = owned;
+		if (!owned) {
+			/* Whatever is left belonged to the previous owner */
+			buffers[fd].start = buffers[fd].end = 0;
+		}
+	}
+}
+
+/* Gives back buffered but unconsumed input, so that the file offset is
+ * where a byte-at-a-time reader would have left it. Called before
+ * anything else may read from the files. */
+void sync_input(void) {
+	int fd;
+	for (fd = 0; fd < READ_FDS; fd++) {
+		InputBuffer *buffer = &buffers[fd];
+		if (buffer->start == buffer->end || buffer->owned) {
+			continue;
+		}
+		if (buffer->seekable) {
+			lseek(fd, -(off_t) (buffer->end - buffer->start), SEEK_CUR);
+		}
+		buffer->start = buffer->end = 0;
+	}
+}
+
+/* Sets the buffer of fd aside while fd is redirected within the shell,
+ * so that what was buffered from the original is neither lost nor read
+ * in place of the redirection. */
+void set_input_aside(int fd, InputBuffer *aside) {
+	sync_input();
+	*aside = buffers[fd];
+	memset(&buffers[fd], 0, sizeof(buffers[fd]));
+}
+
+/* Puts back the buffer set aside once fd is restored */
+void take_input_back(int fd, InputBuffer *aside) {
+	free(buffers[fd].data);
+	buffers[fd] = *aside;
+}
+
+/* Reads whatever comes next from fd, starting with what read has
+ * buffered, for builtins such as xargs that consume all their input. */
+ssize_t read_input(int fd, char *buf, size_t len) {
+	InputBuffer *buffer = 0 <= fd && fd < READ_FDS ? &buffers[fd] : NULL;
+	ssize_t got;
+
+	if (buffer && buffer->start < buffer->end) {
+		size_t n = buffer->end - buffer->start;
+		n = n < len ? n : len;
+		memcpy(buf, buffer->data + buffer->start, n);
+		buffer->start += n;
+		return (ssize_t) n;
+	}
+	while (-1 == (got = read(fd, buf, len)) && EINTR == errno && !interrupted);
+	return got;
+}
+
+/* Appends len bytes to the growing line */
+static void append(char **line, size_t *len, size_t *cap, const char *src, size_t n) {
+	if (*len + n + 1 > *cap) {
+		while (*len + n + 1 > *cap) {
+			*cap *= 2;
+		}
+		if (!(*line = realloc(*line, *cap))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(*line + *len, src, n);
+	*len += n;
+	(*line)[*len] = 0;
+}
+
+/* Reads up to (not including) the next newline. Returns false on EOF
+ * or error if nothing was read. */
+static bool read_line(int fd, char **line, size_t *len, size_t *cap) {
+	InputBuffer *buffer = fd < READ_FDS ? &buffers[fd] : NULL;
+	bool any = false;
+
+	for (;;) {
+		char *start, *newline;
+		size_t n;
+
+		if (!buffer || buffer->start == buffer->end) {
+			ssize_t got;
+			char c;
+
+			if (!buffer || !can_buffer(fd, buffer)) {
+				/* Careful read, so that nothing after the line is consumed */
+				while (-1 == (got = read(fd, &c, 1)) && EINTR == errno && !interrupted);
+				if (1 != got) {
+					return any;
+				}
+				any = true;
+				if ('\n' == c) {
+					return true;
+				}
+				append(line, len, cap, &c, 1);
+				continue;
+			}
+
+			if (!buffer->data && !(buffer->data = malloc(READ_BUFFER))) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+			while (-1 == (got = read(fd, buffer->data, READ_BUFFER)) && EINTR == errno && !interrupted);
+			if (got <= 0) {
+				return any;
+			}
+			buffer->start = 0;
+			buffer->end = (size_t) got;
+		}
+
+		any = true;
+		start = buffer->data + buffer->start;
+		n = buffer->end - buffer->start;
+		if (NULL != (newline = memchr(start, '\n', n))) {
+			n = (size_t) (newline - start);
+		}
+		append(line, len, cap, start, n);
+		buffer->start += n;
+		if (newline) {
+			buffer->start++;
+			return true;
+		}
+	}
+}
+
+static bool is_ifs_space(const char *ifs, char c) {
+	return c && strchr(ifs, c) && isspace((unsigned char) c);
+}
+
+/* Splits the line into the variables, the last one getting the rest of
+ * the line. Unless raw, backslashes escape the next character. */
+static void assign_fields(char **names, char *line, bool raw) {
+	const char *ifs = get_var("IFS");
+	char *src = line;
+
+	if (!ifs) {
+		ifs = " \t\n";
+	}
+
+	for (; *names; names++) {
+		bool last = !names[1];
+		char *field, *dst, *end;
+
+		while (is_ifs_space(ifs, *src)) {
+			src++;
+		}
+		/* Unescaping shrinks the field, so it's done in place */
+		field = dst = end = src;
+		while (*src) {
+			bool escaped = false;
+			if (!raw && '\\' == *src && src[1]) {
+				src++;
+				escaped = true;
+			} else if (!last && strchr(ifs, *src)) {
+				break;
+			}
+			*dst++ = *src++;
+			if (escaped || !is_ifs_space(ifs, dst[-1])) {
+				/* Trailing whitespace is trimmed */
+				end = dst;
+			}
+		}
+
+		/* Skip the separator: whitespace and at most one other IFS character */
+		while (is_ifs_space(ifs, *src)) {
+			src++;
+		}
+		if (*src && !last && strchr(ifs, *src)) {
+			src++;
+			while (is_ifs_space(ifs, *src)) {
+				src++;
+			}
+		}
+
+		*end = 0;
+		set_var(*names, field);
+	}
+}
+
+/* The built-in read command */
+int read_cmd(char **args) {
+	static char *reply[] = { "REPLY", NULL };
+	char **names, *line;
+	size_t len = 0, cap = 128;
+	bool raw = false, more;
+	int fd = STDIN_FILENO;
+
+	for (args++; *args && '-' == (*args)[0]; args++) {
+		if (0 == strcmp(*args, "-r")) {
+			raw = true;
+		} else if (0 == strcmp(*args, "-u") && args[1] && 0 <= atoi(args[1])) {
+			fd = atoi(*++args);
+		} else if (0 == strcmp(*args, "--")) {
+			args++;
+			break;
+		} else {
+			fprintf(stderr, "read: usage: read [-r] [-u fd] [name ...]\n");
+			return EXIT_FAILURE;
+		}
+	}
+	names = *args ? args : reply;
+
+	if (!(line = malloc(cap))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	*line = 0;
+
+	/* A trailing backslash continues the line, unless raw */
+	while ((more = read_line(fd, &line, &len, &cap)) && !raw &&
+			0 < len && '\\' == line[len - 1]) {
+		size_t backslashes = 0;
+		while (backslashes < len && '\\' == line[len - 1 - backslashes]) {
+			backslashes++;
+		}
+		if (0 == backslashes % 2) {
+			break;
+		}
+		line[--len] = 0;
+	}
+
+	assign_fields(names, line, raw);
+	free(line);
+	return more ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,190 @@
+/* For memfd_create and file seals */
+#define _GNU_SOURCE
+#include "main.h"
+
+/*
+ * Here-documents and here-strings.
+ *
+ * The text is written with a single write into a memfd, which is sealed
+ * and becomes the command's stdin. There's no helper process feeding a
+ * pipe and no pipe buffer to fill up, however long the text. Text that
+ * doesn't need expanding is kept in its memfd for as long as the command
+ * is, and every run opens it anew through /proc/self/fd, with an offset
+ * of its own, so a here-document in a loop is written only once.
+ */
+
+/* Creates a file holding the text, positioned at its start */
+static int create_file(const char *text, size_t len) {
+	size_t done = 0;
+	int fd = -1;
+
+#ifdef MFD_ALLOW_SEALING
+	fd = memfd_create("smsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+	if (-1 == fd) {
+		/* Without memfds, an unlinked temporary file does the same */
+		FILE *tmp = tmpfile();
+		if (!tmp) {
+			perror("tmpfile");
+			return -1;
+		}
+		fd = fcntl(fileno(tmp), F_DUPFD_CLOEXEC, 0);
+		fclose(tmp);
+		if (-1 == fd) {
+			perror("fcntl");
+			return -1;
+		}
+	}
+
+	while (done < len) {
+		ssize_t n = write(fd, text + done, len - done);
+		if (-1 == n) {
+			if (EINTR == errno) {
+				continue;
+			}
+			perror("write");
+			close(fd);
+			return -1;
+		}
+		done += (size_t) n;
+	}
+#ifdef F_ADD_SEALS
+	/* Nothing may change the text once written. This fails, harmlessly,
+	 * for the temporary file. */
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+/* Opens the cached text anew, so it's read from the start */
+static int reopen(int fd) {
+	char path[64];
+	int copy;
+
+	sprintf(path, "/proc/self/fd/%d", fd);
+	if (-1 != (copy = open(path, O_RDONLY | O_CLOEXEC))) {
+		return copy;
+	}
+	/* Without /proc the offset is shared, which is fine as runs
+	 * of the same command don't overlap */
+	if (-1 == (copy = fcntl(fd, F_DUPFD_CLOEXEC, 0))) {
+		perror("fcntl");
+		return -1;
+	}
+	lseek(copy, 0, SEEK_SET);
+	return copy;
+}
+
+/* The text a redirection gives, expanded. Sets *constant if it would
+ * expand the same every time. */
+static char *redirect_text(Redirect *r, bool *constant) {
+	char *text, *line;
+	size_t len;
+
+	if (REDIR_HEREDOC == r->type) {
+		*constant = !r->expand || !strpbrk(r->body, "$\\");
+		if (r->expand) {
+			return expand_heredoc(r->body);
+		}
+		if (!(text = strdup(r->body))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		return text;
+	}
+
+	/* A here-string is the word with a newline added */
+	*constant = !strpbrk(r->word, "$~");
+	text = expand_word(r->word, false);
+	len = strlen(text);
+	if (!(line = realloc(text, len + 2))) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	line[len] = '\n';
+	line[len + 1] = 0;
+	return line;
+}
+
+/* Opens what the redirections give a command as its stdin, which is the
+ * last of them. Returns a close-on-exec fd that's the caller's to close,
+ * -1 if there are no redirections and -2 on errors, which are reported. */
+int open_input(Redirect *redirects) {
+	Redirect *last = redirects;
+	char *text;
+	bool constant;
+	int fd;
+
+	if (!last) {
+		return -1;
+	}
+	while (last->next) {
+		last = last->next;
+	}
+	if (-1 != last->cache) {
+		fd = reopen(last->cache);
+		return -1 == fd ? -2 : fd;
+	}
+
+	text = redirect_text(last, &constant);
+	if (interrupted) {
+		/* The expansion failed */
+		free(text);
+		return -2;
+	}
+	fd = create_file(text, strlen(text));
+	free(text);
+	if (-1 != fd && constant) {
+		last->cache = fd;
+		fd = reopen(fd);
+	}
+	return -1 == fd ? -2 : fd;
+}
+
+/* Redirects the stdin of the shell itself, for a builtin or compound
+ * command that runs within it, until restore_shell. Returns false on
+ * errors. */
+bool redirect_shell(Redirect *redirects, SavedInput *saved) {
+	int fd = open_input(redirects);
+
+	saved->fd = -1;
+	if (-1 == fd) {
+		return true;
+	}
+	if (-2 == fd) {
+		return false;
+	}
+	if (-1 == (saved->fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, READ_FDS))) {
+		perror("fcntl");
+		close(fd);
+		return false;
+	}
+	set_input_aside(STDIN_FILENO, &saved->buffer);
+	dup2(fd, STDIN_FILENO);
+	close(fd);
+	return true;
+}
+
+void restore_shell(SavedInput *saved) {
+	if (-1 == saved->fd) {
+		return;
+	}
+	take_input_back(STDIN_FILENO, &saved->buffer);
+	dup2(saved->fd, STDIN_FILENO);
+	close(saved->fd);
+	saved->fd = -1;
+}
+
+void free_redirects(Redirect *r) {
+	while (r) {
+		Redirect *next = r->next;
+		if (-1 != r->cache) {
+			close(r->cache);
+		}
+		free(r->word);
+		free(r->body);
+		free(r);
+		r = next;
+	}
+}
@@ -0,0 +1,258 @@
+#include "main.h"
+
+/*
+ * Replaying a recorded workload, "smsh --replay file [--sessions n]".
+ *
+ * The file's lines, such as those of a history file, are run one
+ * command at a time the way the main loop runs what's typed: parsed by
+ * parse_line, through its cache, and run by exec_node. Empty lines and
+ * those starting with # are skipped, and a command that continues over
+ * several lines is read whole first.
+ *
+ * Each command's time is split in two: the time the shell spent waiting
+ * for its children is their runtime, and the rest, parsing, expanding,
+ * forking and the builtins, is the shell's own overhead. With several
+ * sessions, each is a forked copy of the shell that replays the whole
+ * file, and sends its timings back to be added up once they're done.
+ * The report goes to stderr, leaving stdout to the commands.
+ */
+
+/* One command's time, in microseconds */
+typedef struct {
+	uint64_t shell, children;
+} Timing;
+
+typedef struct {
+	Timing *timings;
+	size_t num, cap;
+} Timings;
+
+/* Time spent waiting for children so far, in microseconds */
+static uint64_t waited = 0;
+
+static uint64_t us_between(const struct timeval *from, const struct timeval *to) {
+	return (uint64_t) (1000000 * (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec));
+}
+
+/* Counts the time since a wait for children started */
+void count_wait(const struct timeval *since) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	waited += us_between(since, &now);
+}
+
+static void add_timing(Timings *t, const Timing *timing) {
+	if (t->num == t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 256;
+		if (!(t->timings = realloc(t->timings, t->cap * sizeof(*t->timings)))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	t->timings[t->num++] = *timing;
+}
+
+/* Reads the whole file, to be freed, or NULL */
+static char *read_file(const char *file) {
+	struct stat st;
+	char *text;
+	ssize_t n;
+	size_t len = 0;
+	int fd;
+
+	if (-1 == (fd = open(file, O_RDONLY)) || -1 == fstat(fd, &st)) {
+		perror(file);
+		if (-1 != fd) {
+			close(fd);
+		}
+		return NULL;
+	}
+	if (!(text = malloc((size_t) st.st_size + 1))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	while (len < (size_t) st.st_size && 0 < (n = read(fd, text + len, (size_t) st.st_size - len))) {
+		len += (size_t) n;
+	}
+	close(fd);
+	text[len] = 0;
+	return text;
+}
+
+/* Runs the commands of the text, timing each */
+static void run_session(const char *text, Timings *t) {
+	char *pending = NULL;
+	size_t pending_len = 0;
+	const char *line, *end;
+
+	if (!(pending = malloc(strlen(text) + 1))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (line = text; *line && !interrupted; line = *end ? end + 1 : end) {
+		struct timeval start, done;
+		bool incomplete, cached;
+		uint64_t waited_before;
+		Timing timing;
+		Node *commands;
+		size_t len;
+
+		end = strchr(line, '\n');
+		if (!end) {
+			end = line + strlen(line);
+		}
+		len = (size_t) (end - line);
+		if (!pending_len && (0 == len || '#' == *line)) {
+			continue;
+		}
+		memcpy(pending + pending_len, line, len);
+		pending_len += len;
+		pending[pending_len++] = '\n';
+		pending[pending_len] = 0;
+
+		reap_jobs();
+		run_queued_jobs();
+		gettimeofday(&start, NULL);
+		waited_before = waited;
+		commands = parse_line(pending, &incomplete, &cached);
+		if (incomplete && *end) {
+			continue;
+		}
+		pending_len = 0;
+		if (commands) {
+			exec_node(commands);
+			if (!cached) {
+				free_node(commands);
+			}
+		}
+		gettimeofday(&done, NULL);
+		timing.children = waited - waited_before;
+		timing.shell = us_between(&start, &done) - timing.children;
+		add_timing(t, &timing);
+		fflush(NULL);
+	}
+	free(pending);
+}
+
+static int compare_us(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Prints the percentiles of one part of the timings */
+static void report(const char *name, const Timings *t, int part) {
+	static const double percentiles[] = { 0.5, 0.9, 0.99 };
+	uint64_t *us;
+	size_t i;
+
+	if (!(us = malloc(t->num * sizeof(*us)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < t->num; i++) {
+		us[i] = 0 == part ? t->timings[i].shell : 1 == part ? t->timings[i].children :
+			t->timings[i].shell + t->timings[i].children;
+	}
+	qsort(us, t->num, sizeof(*us), &compare_us);
+	fprintf(stderr, "%-9s", name);
+	for (i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++) {
+		/* The nearest rank */
+		size_t rank = (size_t) (percentiles[i] * (double) t->num + 0.999999);
+		fprintf(stderr, " %10lu", (unsigned long) us[rank ? rank - 1 : 0]);
+	}
+	fprintf(stderr, " %10lu\n", (unsigned long) us[t->num - 1]);
+	free(us);
+}
+
+/* Replays the commands of the file in as many sessions at once, and
+ * reports how long they took. Returns the exit status for the shell. */
+int replay(const char *file, long sessions) {
+	Timings all = { NULL, 0, 0 };
+	struct timeval start, done;
+	Pipe *results = NULL;
+	pid_t *pids = NULL;
+	char *text;
+	double seconds;
+	long i;
+
+	if (!(text = read_file(file))) {
+		return EXIT_FAILURE;
+	}
+	gettimeofday(&start, NULL);
+	if (1 == sessions) {
+		run_session(text, &all);
+	} else {
+		if (!(results = malloc((size_t) sessions * sizeof(*results))) ||
+				!(pids = malloc((size_t) sessions * sizeof(*pids)))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		fflush(NULL);
+		for (i = 0; i < sessions; i++) {
+			TRY(shell_pipe(results[i]), "pipe");
+			TRY(pids[i] = fork(), "fork");
+			if (0 == pids[i]) {
+				Timings mine = { NULL, 0, 0 };
+				const char *data;
+				size_t left;
+				ssize_t n;
+
+				close(results[i][PIPE_READ_SIDE]);
+				run_session(text, &mine);
+				data = (const char *) mine.timings;
+				for (left = mine.num * sizeof(*mine.timings); left; left -= (size_t) n, data += n) {
+					if (-1 == (n = write(results[i][PIPE_WRITE_SIDE], data, left))) {
+						perror("replay");
+						exit(EXIT_FAILURE);
+					}
+				}
+				exit(EXIT_SUCCESS);
+			}
+			close(results[i][PIPE_WRITE_SIDE]);
+		}
+		for (i = 0; i < sessions; i++) {
+			Timing timing;
+			char *data = NULL;
+			size_t len = 0, cap = 0, at;
+			ssize_t n;
+
+			do {
+				if (len == cap) {
+					cap = cap ? 2 * cap : 64 * sizeof(timing);
+					if (!(data = realloc(data, cap))) {
+						perror("realloc");
+						exit(EXIT_FAILURE);
+					}
+				}
+				if (0 < (n = read(results[i][PIPE_READ_SIDE], data + len, cap - len))) {
+					len += (size_t) n;
+				}
+			} while (0 < n || (-1 == n && EINTR == errno));
+			for (at = 0; at + sizeof(timing) <= len; at += sizeof(timing)) {
+				memcpy(&timing, data + at, sizeof(timing));
+				add_timing(&all, &timing);
+			}
+			free(data);
+			close(results[i][PIPE_READ_SIDE]);
+			while (-1 == waitpid(pids[i], NULL, 0) && EINTR == errno);
+		}
+		free(results);
+		free(pids);
+	}
+	gettimeofday(&done, NULL);
+	free(text);
+
+	seconds = (double) us_between(&start, &done) / 1e6;
+	fprintf(stderr, "replayed %lu commands in %ld session%s, %.3f s, %.1f commands/s\n",
+			(unsigned long) all.num, sessions, 1 == sessions ? "" : "s", seconds,
+			seconds > 0 ? (double) all.num / seconds : 0.0);
+	if (all.num) {
+		fprintf(stderr, "%-9s %10s %10s %10s %10s\n", "us", "p50", "p90", "p99", "max");
+		report("shell", &all, 0);
+		report("children", &all, 1);
+		report("total", &all, 2);
+	}
+	free(all.timings);
+	return interrupted ? 128 + SIGINT : EXIT_SUCCESS;
+}
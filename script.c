@@ -0,0 +1,842 @@
+/* For MAP_ANONYMOUS */
+#define _DEFAULT_SOURCE
+#include "main.h"
+
+/*
+ * Scripts, and the cache of their parsed trees.
+ *
+ * A script is parsed as a whole, and the tree is saved to a cache file
+ * named after the hash of the script's text. Running the same script
+ * again maps the cache file instead of parsing: the file holds the tree
+ * as a stream of variable-length numbers that refer to a table of
+ * strings by offset, so it can be mapped anywhere. Each distinct string
+ * is stored once. Loading it takes a single allocation for all of the
+ * nodes, whose strings point into the mapping itself.
+ *
+ * Sourced scripts, the rc file among them, load the same way but run
+ * within the shell, so that what they define stays defined.
+ */
+
+#define CACHE_MAGIC "smshbc\n"
+/* Bumped whenever the layout of the records changes */
+#define CACHE_VERSION (2)
+/* Smaller scripts parse about as fast as their cache files load */
+#define CACHE_MIN_SIZE (4 * 1024)
+/* Optional fields are stored plus one, with 0 for none */
+#define NONE (0)
+/* Nesting a corrupt file could claim, which would exhaust the stack */
+#define MAX_LOAD_DEPTH (1000)
+/* Scripts sourcing each other, which would otherwise recurse forever */
+#define MAX_SOURCE_DEPTH (100)
+#define RC_FILE ".smshrc"
+#define ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t pointer_size; /* The loaded tree's layout depends on it */
+	uint64_t hash; /* Of the script's text and the shell's version */
+	uint64_t code_len, strings_len;
+	uint64_t arena_len; /* Bytes that the loaded nodes take up */
+} CacheHeader;
+
+typedef struct {
+	unsigned char *data;
+	size_t len, cap;
+} Buffer;
+
+typedef struct {
+	Buffer code, strings;
+	size_t arena_len;
+	uint32_t *seen; /* Open addressing table of strings stored, by offset plus one */
+	size_t seen_cap, num_seen;
+} Writer;
+
+typedef struct {
+	const unsigned char *pos, *end;
+	const char *strings;
+	size_t strings_len;
+	char *arena;
+	size_t arena_len, arena_used;
+	bool error;
+} Reader;
+
+/* FNV-1a */
+static uint64_t hash_text(const char *text, size_t len) {
+	const char *version = SMSH_VERSION;
+	uint64_t h = 14695981039346656037UL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) text[i]) * 1099511628211UL;
+	}
+	for (; *version; version++) {
+		h = (h ^ (unsigned char) *version) * 1099511628211UL;
+	}
+	return h;
+}
+
+/* The path of a file in the shell's cache directory, which is made if
+ * it doesn't exist, or false if there's no cache */
+bool cache_file(const char *name, char *path, size_t size) {
+	const char *dir = get_var("SMSH_CACHE"), *home = get_var("HOME"), *xdg = get_var("XDG_CACHE_HOME");
+	char base[1024];
+
+	if (dir) {
+		/* Set but empty turns the cache off */
+		if (!*dir || strlen(dir) >= sizeof(base)) {
+			return false;
+		}
+		strcpy(base, dir);
+	} else if (xdg && *xdg && strlen(xdg) + 6 < sizeof(base)) {
+		sprintf(base, "%s/smsh", xdg);
+	} else if (home && strlen(home) + 13 < sizeof(base)) {
+		sprintf(base, "%s/.cache", home);
+		mkdir(base, 0700);
+		strcat(base, "/smsh");
+	} else {
+		return false;
+	}
+	mkdir(base, 0700);
+	return (size_t) snprintf(path, size, "%s/%s", base, name) < size;
+}
+
+/* The path of the cache file for a hash, or false if there's no cache */
+static bool cache_path(uint64_t hash, char *path, size_t size) {
+	char name[32];
+
+	sprintf(name, "%016" PRIx64 ".smc", hash);
+	return cache_file(name, path, size);
+}
+
+static void put(Buffer *b, const void *src, size_t n) {
+	if (b->len + n > b->cap) {
+		while (b->len + n > b->cap) {
+			b->cap = b->cap ? 2 * b->cap : 4096;
+		}
+		if (!(b->data = realloc(b->data, b->cap))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(b->data + b->len, src, n);
+	b->len += n;
+}
+
+/* Seven bits at a time, the last byte without its top bit set */
+static void put_u32(Writer *w, uint32_t value) {
+	unsigned char bytes[5];
+	size_t n = 0;
+
+	while (value >= 0x80) {
+		bytes[n++] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	bytes[n++] = (unsigned char) value;
+	put(&w->code, bytes, n);
+}
+
+static void put_string(Writer *w, const char *str) {
+	size_t i, len;
+	uint64_t h;
+
+	if (!str) {
+		put_u32(w, NONE);
+		return;
+	}
+	if (2 * (w->num_seen + 1) > w->seen_cap) {
+		/* Grow the table, putting the strings back in their new places */
+		uint32_t *old = w->seen;
+		size_t old_cap = w->seen_cap;
+
+		w->seen_cap = old_cap ? 2 * old_cap : 1024;
+		if (!(w->seen = calloc(w->seen_cap, sizeof(*w->seen)))) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < old_cap; i++) {
+			if (old[i]) {
+				const char *s = (const char *) w->strings.data + old[i] - 1;
+				size_t j = (size_t) hash_text(s, strlen(s)) & (w->seen_cap - 1);
+				while (w->seen[j]) {
+					j = (j + 1) & (w->seen_cap - 1);
+				}
+				w->seen[j] = old[i];
+			}
+		}
+		free(old);
+	}
+
+	len = strlen(str);
+	h = hash_text(str, len);
+	for (i = (size_t) h & (w->seen_cap - 1); w->seen[i]; i = (i + 1) & (w->seen_cap - 1)) {
+		if (0 == strcmp((const char *) w->strings.data + w->seen[i] - 1, str)) {
+			put_u32(w, w->seen[i]);
+			return;
+		}
+	}
+	w->seen[i] = (uint32_t) w->strings.len + 1;
+	w->num_seen++;
+	put_u32(w, w->seen[i]);
+	put(&w->strings, str, len + 1);
+}
+
+static void put_words(Writer *w, char **words) {
+	uint32_t n = 0, i;
+
+	if (!words) {
+		put_u32(w, NONE);
+		return;
+	}
+	while (words[n]) {
+		n++;
+	}
+	put_u32(w, n + 1);
+	for (i = 0; i < n; i++) {
+		put_string(w, words[i]);
+	}
+	w->arena_len += ALIGN((n + 1) * sizeof(*words));
+}
+
+static void put_nodes(Writer *, Node *);
+
+static void put_command(Writer *w, Command *command) {
+	Redirect *r;
+	uint32_t n = 0;
+
+	w->arena_len += ALIGN(sizeof(*command));
+	put_words(w, command->args);
+	put_nodes(w, command->compound);
+	for (r = command->redirects; r; r = r->next) {
+		n++;
+	}
+	put_u32(w, n);
+	for (r = command->redirects; r; r = r->next) {
+		w->arena_len += ALIGN(sizeof(*r));
+		put_u32(w, (uint32_t) r->type | (r->strip_tabs ? 0x100 : 0) | (r->expand ? 0x200 : 0));
+		put_string(w, r->word);
+		put_string(w, r->body);
+	}
+}
+
+/* A list of nodes: how many, and then each one */
+static void put_nodes(Writer *w, Node *node) {
+	Node *n;
+	uint32_t count = 0;
+
+	for (n = node; n; n = n->next) {
+		count++;
+	}
+	put_u32(w, count);
+	for (; node; node = node->next) {
+		CaseItem *item;
+		size_t i;
+
+		w->arena_len += ALIGN(sizeof(*node));
+		put_u32(w, (uint32_t) node->type);
+		put_string(w, node->name);
+		put_words(w, node->words);
+		if (node->pipeline) {
+			CommandList *commands = node->pipeline;
+			w->arena_len += ALIGN(sizeof(*commands)) + ALIGN(commands->length * sizeof(*commands->cmds));
+			put_u32(w, (uint32_t) commands->length + 1);
+			put_u32(w, (commands->bg ? 1 : 0) | (commands->negate ? 2 : 0));
+			put_string(w, commands->text);
+			for (i = 0; i < commands->length; i++) {
+				put_command(w, commands->cmds[i]);
+			}
+		} else {
+			put_u32(w, NONE);
+		}
+		for (count = 0, item = node->items; item; item = item->next) {
+			count++;
+		}
+		put_u32(w, count);
+		for (item = node->items; item; item = item->next) {
+			w->arena_len += ALIGN(sizeof(*item));
+			put_words(w, item->patterns);
+			put_nodes(w, item->body);
+		}
+		put_nodes(w, node->cond);
+		put_nodes(w, node->body);
+		put_nodes(w, node->alt);
+	}
+}
+
+/* Writes the tree to the cache, replacing the file at once so that
+ * no other shell maps it half written. Failing is harmless. */
+static void save_cache(Node *tree, uint64_t hash) {
+	CacheHeader header;
+	Writer w;
+	char path[1100], tmp[1200];
+	FILE *file;
+	bool ok;
+
+	if (!cache_path(hash, path, sizeof(path))) {
+		return;
+	}
+	memset(&w, 0, sizeof(w));
+	put_nodes(&w, tree);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.pointer_size = sizeof(void *);
+	header.hash = hash;
+	header.code_len = w.code.len;
+	header.strings_len = w.strings.len;
+	header.arena_len = w.arena_len;
+
+	sprintf(tmp, "%s.%ld", path, (long) getpid());
+	if (NULL != (file = fopen(tmp, "wbe"))) {
+		ok = 1 == fwrite(&header, sizeof(header), 1, file) &&
+			w.code.len == fwrite(w.code.data, 1, w.code.len, file) &&
+			w.strings.len == fwrite(w.strings.data, 1, w.strings.len, file);
+		ok = 0 == fclose(file) && ok;
+		if (!ok || -1 == rename(tmp, path)) {
+			unlink(tmp);
+		}
+	}
+	free(w.code.data);
+	free(w.strings.data);
+	free(w.seen);
+}
+
+static uint32_t get_u32(Reader *r) {
+	uint32_t value = 0;
+	int shift;
+
+	for (shift = 0; shift < 35; shift += 7) {
+		if (r->pos == r->end) {
+			break;
+		}
+		value |= (uint32_t) (*r->pos & 0x7f) << shift;
+		if (!(*r->pos++ & 0x80)) {
+			return value;
+		}
+	}
+	r->error = true;
+	return 0;
+}
+
+static void *get_space(Reader *r, size_t size) {
+	void *p;
+	size = ALIGN(size);
+	if (r->arena_len - r->arena_used < size) {
+		r->error = true;
+		return NULL;
+	}
+	p = r->arena + r->arena_used;
+	r->arena_used += size;
+	memset(p, 0, size);
+	return p;
+}
+
+/* A string of the table, in place */
+static char *get_string(Reader *r) {
+	uint32_t offset = get_u32(r);
+	if (NONE == offset-- || r->error) {
+		return NULL;
+	}
+	if (offset >= r->strings_len || !memchr(r->strings + offset, 0, r->strings_len - offset)) {
+		r->error = true;
+		return NULL;
+	}
+	return (char *) r->strings + offset;
+}
+
+static char **get_words(Reader *r, size_t *num_words) {
+	uint32_t n = get_u32(r), i;
+	char **words;
+
+	if (NONE == n-- || r->error || n > (size_t) (r->end - r->pos) ||
+			!(words = get_space(r, (n + 1) * sizeof(*words)))) {
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(words[i] = get_string(r))) {
+			r->error = true;
+			return NULL;
+		}
+	}
+	if (num_words) {
+		*num_words = n;
+	}
+	return words;
+}
+
+static Node *get_nodes(Reader *, int);
+
+/* Whether a loaded node has the fields that running its type takes. A
+ * corrupt file can be well formed and still claim any type. */
+static bool valid_node(const Node *node, size_t num_words) {
+	switch (node->type) {
+		case NODE_PIPELINE:
+			/* A background job is listed by its text */
+			return node->pipeline && 0 < node->pipeline->length &&
+				(!node->pipeline->bg || node->pipeline->text);
+		case NODE_GROUP:
+		case NODE_SUBSHELL:
+			return true;
+		case NODE_FOR:
+		case NODE_CASE:
+		case NODE_ARITH:
+			return NULL != node->name;
+		case NODE_ARITH_FOR:
+			return node->words && 3 == num_words;
+		case NODE_IF:
+		case NODE_WHILE:
+		case NODE_UNTIL:
+		case NODE_AND:
+		case NODE_OR:
+			return NULL != node->cond;
+		case NODE_FUNCTION:
+			return node->name && node->body;
+	}
+	return false;
+}
+
+static Command *get_command(Reader *r, int depth) {
+	Command *command = get_space(r, sizeof(*command));
+	Redirect **tail;
+	uint32_t n, i;
+
+	if (!command) {
+		return NULL;
+	}
+	command->args = get_words(r, &command->num_args);
+	command->compound = get_nodes(r, depth);
+	n = get_u32(r);
+	tail = &command->redirects;
+	for (i = 0; i < n && !r->error; i++) {
+		Redirect *redirect = get_space(r, sizeof(*redirect));
+		uint32_t flags = get_u32(r);
+		if (!redirect) {
+			break;
+		}
+		redirect->type = (RedirType) (flags & 0xff);
+		redirect->strip_tabs = 0 != (flags & 0x100);
+		redirect->expand = 0 != (flags & 0x200);
+		redirect->word = get_string(r);
+		redirect->body = get_string(r);
+		redirect->cache = -1;
+		if (REDIR_HERESTRING < redirect->type || !redirect->word ||
+				(REDIR_HEREDOC == redirect->type && !redirect->body)) {
+			r->error = true;
+		}
+		*tail = redirect;
+		tail = &redirect->next;
+	}
+	/* A simple command or a compound one, never both */
+	if (!command->args == !command->compound) {
+		r->error = true;
+	}
+	return command;
+}
+
+static Node *get_nodes(Reader *r, int depth) {
+	Node *head = NULL, **tail = &head;
+	uint32_t count = get_u32(r), i;
+
+	if (MAX_LOAD_DEPTH < depth) {
+		r->error = true;
+		return NULL;
+	}
+	for (i = 0; i < count && !r->error; i++) {
+		Node *node = get_space(r, sizeof(*node));
+		CaseItem **items;
+		size_t num_words = 0;
+		uint32_t n, j;
+
+		if (!node) {
+			break;
+		}
+		*tail = node;
+		tail = &node->next;
+		node->type = (NodeType) get_u32(r);
+		node->name = get_string(r);
+		node->words = get_words(r, &num_words);
+		if (NONE != (n = get_u32(r)) && !r->error && n-- <= (size_t) (r->end - r->pos)) {
+			CommandList *commands = get_space(r, sizeof(*commands));
+			uint32_t flags = get_u32(r);
+			if (!commands || !(commands->cmds = get_space(r, n * sizeof(*commands->cmds)))) {
+				break;
+			}
+			commands->bg = 0 != (flags & 1);
+			commands->negate = 0 != (flags & 2);
+			commands->text = get_string(r);
+			for (j = 0; j < n && !r->error; j++) {
+				commands->cmds[commands->length++] = get_command(r, depth + 1);
+			}
+			node->pipeline = commands;
+		}
+		n = get_u32(r);
+		items = &node->items;
+		for (j = 0; j < n && !r->error; j++) {
+			CaseItem *item = get_space(r, sizeof(*item));
+			if (!item) {
+				break;
+			}
+			/* Running the case goes through each item's patterns */
+			if (!(item->patterns = get_words(r, NULL))) {
+				r->error = true;
+				break;
+			}
+			item->body = get_nodes(r, depth + 1);
+			*items = item;
+			items = &item->next;
+		}
+		node->cond = get_nodes(r, depth + 1);
+		node->body = get_nodes(r, depth + 1);
+		node->alt = get_nodes(r, depth + 1);
+		if (!r->error && !valid_node(node, num_words)) {
+			r->error = true;
+		}
+	}
+	return head;
+}
+
+/* Maps the cache file for the hash and loads the tree from it.
+ * Returns false if there's no usable cache file. */
+static bool load_cache(uint64_t hash, Script *script) {
+	CacheHeader header;
+	Reader r;
+	struct stat st;
+	char path[1100];
+	const char *map;
+	int fd;
+
+	if (!cache_path(hash, path, sizeof(path)) || -1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+		return false;
+	}
+	if (-1 == fstat(fd, &st) || (size_t) st.st_size < sizeof(header)) {
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map) {
+		return false;
+	}
+	memcpy(&header, map, sizeof(header));
+	if (0 != memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) ||
+			CACHE_VERSION != header.version || sizeof(void *) != header.pointer_size ||
+			hash != header.hash || (uint64_t) st.st_size < header.code_len ||
+			(uint64_t) st.st_size < header.strings_len ||
+			sizeof(header) + header.code_len + header.strings_len != (uint64_t) st.st_size ||
+			/* Each part of the tree takes at least a byte of the code,
+			 * and none loads into more than a node does */
+			header.code_len * ALIGN(sizeof(Node)) < header.arena_len) {
+		munmap((void *) map, (size_t) st.st_size);
+		return false;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.pos = (const unsigned char *) map + sizeof(header);
+	r.end = r.pos + header.code_len;
+	r.strings = (const char *) r.end;
+	r.strings_len = (size_t) header.strings_len;
+	r.arena_len = (size_t) header.arena_len;
+	if (!(r.arena = malloc(r.arena_len ? r.arena_len : 1))) {
+		/* Parsing may yet get by with less */
+		munmap((void *) map, (size_t) st.st_size);
+		return false;
+	}
+	script->tree = get_nodes(&r, 0);
+	if (r.error || r.pos != r.end) {
+		/* Corrupt; it's parsed and written again instead */
+		free(r.arena);
+		munmap((void *) map, (size_t) st.st_size);
+		return false;
+	}
+	script->arena = r.arena;
+	script->map = (void *) map;
+	script->map_len = (size_t) st.st_size;
+	return true;
+}
+
+/* Maps a regular file read-only, followed by at least one 0 byte so
+ * that it can be parsed in place as a string: the file's last page is
+ * padded with zeros, and a file that fills whole pages gets a page of
+ * zeros after it. Its pages are the page cache's, so a large script
+ * costs next to nothing to load, and they're gone once it's unmapped. */
+static char *map_file(int fd, size_t len, size_t *map_len) {
+	long page = sysconf(_SC_PAGESIZE);
+	char *map;
+
+	*map_len = (len / (size_t) page + 1) * (size_t) page;
+	map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == map) {
+		return NULL;
+	}
+	if (len && MAP_FAILED == mmap(map, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0)) {
+		munmap(map, *map_len);
+		return NULL;
+	}
+	return map;
+}
+
+/* Reads the whole file into memory, or maps it if it's a regular file,
+ * in which case *map_len is set. */
+static char *read_file(const char *path, size_t *len, size_t *map_len) {
+	char *text = NULL;
+	size_t cap = 0;
+	struct stat st;
+	ssize_t got;
+	int fd;
+
+	*map_len = 0;
+	if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+		perror(path);
+		return NULL;
+	}
+	if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) &&
+			NULL != (text = map_file(fd, (size_t) st.st_size, map_len))) {
+		close(fd);
+		*len = (size_t) st.st_size;
+		return text;
+	}
+	/* Such as a pipe */
+	*len = 0;
+	do {
+		if (*len + 1 >= cap) {
+			cap = cap ? 2 * cap : 64 * 1024;
+			if (!(text = realloc(text, cap))) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		while (-1 == (got = read(fd, text + *len, cap - *len - 1)) && EINTR == errno);
+		if (0 < got) {
+			*len += (size_t) got;
+		}
+	} while (0 < got);
+	close(fd);
+	if (-1 == got) {
+		perror(path);
+		free(text);
+		return NULL;
+	}
+	text[*len] = 0;
+	return text;
+}
+
+/* Whether the text is nothing but blank lines and comments */
+static bool blank(const char *text) {
+	while (*text) {
+		if ('#' == *text) {
+			text += strcspn(text, "\n");
+		} else if (!isspace((unsigned char) *text)) {
+			return false;
+		} else {
+			text++;
+		}
+	}
+	return true;
+}
+
+/* Loads the script at path, from the cache if it has been parsed
+ * before. Returns false, having said why, if it can't be run. */
+bool load_script(const char *path, Script *script) {
+	size_t len, map_len;
+	char *text = read_file(path, &len, &map_len);
+	bool ok = true, incomplete;
+	uint64_t hash;
+
+	memset(script, 0, sizeof(*script));
+	if (!text) {
+		return false;
+	}
+	if (memchr(text, 0, len)) {
+		fprintf(stderr, SMSH ": %s: cannot run a binary file\n", path);
+		ok = false;
+	} else if (hash = hash_text(text, len), len < CACHE_MIN_SIZE || !load_cache(hash, script)) {
+		/* The words are copied out of the text, which can then go.
+		 * Everything that reads the tree takes NUL-terminated words,
+		 * and ending one in place would copy its page of the mapping
+		 * anyway. Trees loaded from the cache use their words where
+		 * they're mapped. */
+		script->tree = parse_commands(text, &incomplete);
+		if (incomplete) {
+			fprintf(stderr, SMSH ": %s: unexpected end of file\n", path);
+		}
+		/* Without a tree, it was empty or had a syntax error, which has been printed */
+		ok = NULL != script->tree || (!incomplete && blank(text));
+		if (script->tree && len >= CACHE_MIN_SIZE) {
+			save_cache(script->tree, hash);
+		}
+	}
+
+	if (map_len) {
+		munmap(text, map_len);
+	} else {
+		free(text);
+	}
+	return ok;
+}
+
+/* Closes the here-documents that runs of a loaded tree have cached */
+static void close_caches(Node *node) {
+	for (; node; node = node->next) {
+		CaseItem *item;
+		size_t i;
+
+		for (i = 0; node->pipeline && i < node->pipeline->length; i++) {
+			Redirect *r;
+			for (r = node->pipeline->cmds[i]->redirects; r; r = r->next) {
+				if (-1 != r->cache) {
+					close(r->cache);
+				}
+			}
+			close_caches(node->pipeline->cmds[i]->compound);
+		}
+		for (item = node->items; item; item = item->next) {
+			close_caches(item->body);
+		}
+		close_caches(node->cond);
+		close_caches(node->body);
+		close_caches(node->alt);
+	}
+}
+
+void unload_script(Script *script) {
+	if (script->arena) {
+		/* The tree lives in the arena and the mapping */
+		close_caches(script->tree);
+		free(script->arena);
+		munmap(script->map, script->map_len);
+	} else {
+		free_node(script->tree);
+	}
+	memset(script, 0, sizeof(*script));
+}
+
+/* Runs the script at path, returning the status of its last command */
+int run_script(const char *path) {
+	Script script;
+	int status;
+
+	if (!load_script(path, &script)) {
+		return EXIT_FAILURE;
+	}
+	status = exec_node(script.tree);
+	unload_script(&script);
+	return interrupted ? 128 + SIGINT : status;
+}
+
+/* A short description of a command, as written, for profiles */
+static void describe(Node *node, char *buf, size_t size) {
+	static const char *keywords[] = {
+		"", "if", "while", "until", "for", "case", "{", "(", "((", "for ((", "", "", ""
+	};
+	const size_t num_keywords = sizeof(keywords) / sizeof(*keywords);
+	size_t len = 0, i;
+
+	if (NODE_PIPELINE == node->type) {
+		Command *command = node->pipeline->cmds[0];
+		if (command->compound) {
+			describe(command->compound, buf, size);
+			len = strlen(buf);
+		}
+		for (i = 0; command->args && command->args[i] && len < size; i++) {
+			len += (size_t) snprintf(buf + len, size - len, "%s%s", i ? " " : "", command->args[i]);
+		}
+		if (1 < node->pipeline->length && len < size) {
+			snprintf(buf + len, size - len, " | ...");
+		}
+	} else if (NODE_FUNCTION == node->type) {
+		snprintf(buf, size, "%s()", node->name);
+	} else if (NODE_AND == node->type || NODE_OR == node->type) {
+		describe(node->cond, buf, size);
+		len = strlen(buf);
+		if (len < size) {
+			snprintf(buf + len, size - len, NODE_AND == node->type ? " && ..." : " || ...");
+		}
+	} else {
+		snprintf(buf, size, "%s ...", (size_t) node->type < num_keywords ? keywords[node->type] : "");
+	}
+}
+
+static double elapsed_ms(struct timeval *since) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (double) (now.tv_sec - since->tv_sec) * 1000 + (double) (now.tv_usec - since->tv_usec) / 1000;
+}
+
+/* Runs the script at path within the shell. With args, they're its
+ * positional parameters while it runs. With profile, the time each
+ * command at the top of the script takes is written to stderr. */
+int source_script(const char *path, char **args, bool profile) {
+	static int depth = 0;
+	struct timeval start, step;
+	char **saved = NULL, what[64];
+	bool returned = false;
+	Script script;
+	Node *node;
+	int status = EXIT_SUCCESS;
+
+	if (MAX_SOURCE_DEPTH <= depth) {
+		fprintf(stderr, SMSH ": %s: too many nested sources\n", path);
+		return EXIT_FAILURE;
+	}
+	gettimeofday(&start, NULL);
+	if (!load_script(path, &script)) {
+		return EXIT_FAILURE;
+	}
+	if (profile) {
+		fprintf(stderr, SMSH ": %s\n%10.3f ms  load\n", path, elapsed_ms(&start));
+	}
+	if (args) {
+		saved = set_positional(args);
+	}
+
+	depth++;
+	if (!profile) {
+		status = exec_function(script.tree, NULL);
+	}
+	/* Profiled, each command runs on its own */
+	for (node = profile ? script.tree : NULL; node && !returned && !interrupted; node = node->next) {
+		Node *next = node->next;
+
+		gettimeofday(&step, NULL);
+		node->next = NULL;
+		status = exec_function(node, &returned);
+		set_status(status);
+		node->next = next;
+		describe(node, what, sizeof(what));
+		fprintf(stderr, "%10.3f ms  %s\n", elapsed_ms(&step), what);
+	}
+	depth--;
+
+	if (profile) {
+		fprintf(stderr, "%10.3f ms  total\n", elapsed_ms(&start));
+	}
+	if (args) {
+		set_positional(saved);
+	}
+	unload_script(&script);
+	return status;
+}
+
+/* The built-in source and . commands */
+int source_cmd(char **args) {
+	if (!args[1]) {
+		fprintf(stderr, "%s: filename argument required\n", args[0]);
+		return 2;
+	}
+	return source_script(args[1], args[2] ? args + 2 : NULL, false);
+}
+
+/* Sources ~/.smshrc, if there is one */
+void load_rc(bool profile) {
+	const char *home = get_var("HOME");
+	char path[1100];
+	struct stat st;
+
+	if (!home || (size_t) snprintf(path, sizeof(path), "%s/" RC_FILE, home) >= sizeof(path) ||
+			-1 == stat(path, &st)) {
+		return;
+	}
+	source_script(path, NULL, profile);
+	interrupted = 0;
+}
@@ -0,0 +1,308 @@
+/* For F_GETPIPE_SZ */
+#define _GNU_SOURCE
+#include "main.h"
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/*
+ * The stall detector, a watchdog for commands that stop making progress
+ * without exiting.
+ *
+ * With SMSH_STALL set to a number of seconds, the processes of the
+ * foreground commands and of each background job are sampled every
+ * second, the same way as jtop does. A job that has used no CPU time and
+ * read or written nothing, pipes included, for that long is reported as
+ * stalled, once until it moves again. The report shows, for each of its
+ * processes, where in the kernel it waits, the read or write it's
+ * blocked in and how full the pipe it's on is, and the top of its
+ * kernel stack where that's readable.
+ *
+ * Background jobs are checked while the line editor waits for input,
+ * and all of them while the shell waits for foreground commands, which
+ * a timer wakes it from every second.
+ */
+
+#define STALL_CHECK_MS (1000)
+/* Kernel stack frames shown */
+#define STALL_FRAMES (4)
+
+/* A job's counters as of when it last made progress */
+typedef struct {
+	pid_t pgid; /* 0 for the foreground commands */
+	uint64_t chars;
+	size_t procs;
+	struct timeval since;
+	bool reported;
+	bool due; /* Stalled, and yet to be reported */
+} Progress;
+
+static Sampler sampler;
+static Progress *progress = NULL;
+static size_t num_progress = 0;
+static struct timeval last_check;
+static pid_t watcher = -1;
+static bool timer_on = false;
+
+/* Notes the process that watches, rather than forked copies of it */
+void init_stall(void) {
+	watcher = getpid();
+}
+
+static long ms_between(const struct timeval *from, const struct timeval *to) {
+	return 1000 * (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1000;
+}
+
+/* Seconds without progress that make a stall, or 0 when not watching */
+static long stall_limit(void) {
+	const char *value = get_var("SMSH_STALL");
+	long limit = value ? atol(value) : 0;
+
+	if (limit <= 0 || getpid() != watcher) {
+		if (num_progress) {
+			/* Turned off; start over if it's turned on again */
+			end_sampling(&sampler);
+			free(progress);
+			progress = NULL;
+			num_progress = 0;
+		}
+		return 0;
+	}
+	return limit;
+}
+
+/* Starts or stops the timer that wakes the wait for foreground commands
+ * up to check on them, and to admit queued background jobs */
+void watch_fg(bool on) {
+	struct itimerval timer;
+	size_t i;
+
+	if (on ? !stall_limit() && !jobs_queued() : !timer_on) {
+		return;
+	}
+	timer_on = on;
+	memset(&timer, 0, sizeof(timer));
+	if (on) {
+		timer.it_interval.tv_sec = timer.it_value.tv_sec = STALL_CHECK_MS / 1000;
+		/* Other foreground commands were timed until now */
+		for (i = 0; i < num_progress; i++) {
+			if (0 == progress[i].pgid) {
+				progress[i].procs = (size_t) -1;
+			}
+		}
+	}
+	setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+/* Samples the jobs if it's time to. Returns whether any are newly
+ * stalled, for report_stalls to show. */
+bool check_stalls(void) {
+	long limit = stall_limit();
+	struct timeval now;
+	Progress *next;
+	JobTotals *totals;
+	const Job *job;
+	bool due = false;
+	size_t n, i, j;
+
+	gettimeofday(&now, NULL);
+	if (!limit || (num_progress && ms_between(&last_check, &now) < STALL_CHECK_MS)) {
+		return false;
+	}
+	last_check = now;
+
+	n = count_jobs();
+	if (!(totals = calloc(n + 1, sizeof(*totals))) || !(next = calloc(n + 1, sizeof(*next)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	if (-1 == sample_jobs(&sampler, totals)) {
+		free(totals);
+		free(next);
+		return false;
+	}
+	for (i = 0, job = first_job(); i <= n; i++, job = job ? job->next : NULL) {
+		JobTotals *t = &totals[i];
+		Progress *p = &next[i];
+
+		p->pgid = i < n ? job->pid : 0;
+		for (j = 0; j < num_progress && progress[j].pgid != p->pgid; j++);
+		if (j < num_progress) {
+			*p = progress[j];
+		}
+		/* Queued and stopped jobs wait on purpose */
+		if (j == num_progress || t->ticks || t->chars != p->chars || t->procs != p->procs ||
+				!t->procs || 'T' == t->state || (i < n && JOB_QUEUED == job->state)) {
+			p->chars = t->chars;
+			p->procs = t->procs;
+			p->since = now;
+			p->reported = false;
+		} else if (!p->reported && ms_between(&p->since, &now) >= 1000 * limit) {
+			due = p->due = true;
+		}
+	}
+	free(totals);
+	free(progress);
+	progress = next;
+	num_progress = n + 1;
+	return due;
+}
+
+/* Reads a small file of /proc into buf, returning its length or -1 */
+static ssize_t read_proc(const char *path, char *buf, size_t size) {
+	ssize_t n;
+	int fd;
+
+	if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+		return -1;
+	}
+	n = read(fd, buf, size - 1);
+	close(fd);
+	buf[n > 0 ? n : 0] = 0;
+	return n;
+}
+
+/* What the process has open as fd, with how full it is if it's a pipe */
+static void describe_fd(pid_t pid, long fd, char *buf, size_t size) {
+	char path[64], target[256];
+	ssize_t n;
+	int queued, capacity, pipe_fd;
+
+	sprintf(path, "/proc/%d/fd/%ld", (int) pid, fd);
+	if (-1 == (n = readlink(path, target, sizeof(target) - 1))) {
+		snprintf(buf, size, "fd %ld", fd);
+		return;
+	}
+	target[n] = 0;
+	/* Opening the pipe anew, without reading, shows what's in it */
+	if (0 != strncmp(target, "pipe:", 5) ||
+			-1 == (pipe_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC))) {
+		snprintf(buf, size, "fd %ld, %s", fd, target);
+		return;
+	}
+	if (-1 == ioctl(pipe_fd, FIONREAD, &queued)) {
+		queued = -1;
+	}
+	capacity = fcntl(pipe_fd, F_GETPIPE_SZ);
+	close(pipe_fd);
+	if (queued < 0) {
+		snprintf(buf, size, "fd %ld, %s", fd, target);
+	} else if (0 == queued) {
+		snprintf(buf, size, "fd %ld, %s, empty", fd, target);
+	} else {
+		snprintf(buf, size, "fd %ld, %s, %d of %d bytes%s", fd, target, queued, capacity,
+				queued >= capacity ? " (full)" : "");
+	}
+}
+
+/* The syscall the process is blocked in, if it's a read or write */
+static void describe_syscall(pid_t pid, char *buf, size_t size) {
+	char path[64], line[256];
+	unsigned long fd;
+	long nr;
+	const char *name;
+
+	buf[0] = 0;
+	sprintf(path, "/proc/%d/syscall", (int) pid);
+	if (read_proc(path, line, sizeof(line)) <= 0 || 2 != sscanf(line, "%ld %lx", &nr, &fd)) {
+		return;
+	}
+	switch (nr) {
+		case SYS_read: name = "read"; break;
+		case SYS_readv: name = "readv"; break;
+		case SYS_write: name = "write"; break;
+		case SYS_writev: name = "writev"; break;
+		case SYS_splice: name = "splice"; break;
+		default:
+			snprintf(buf, size, ", in syscall %ld", nr);
+			return;
+	}
+	snprintf(buf, size, ", in %s on ", name);
+	describe_fd(pid, (long) fd, buf + strlen(buf), size - strlen(buf));
+}
+
+/* The innermost frames of the process's kernel stack */
+static void describe_stack(pid_t pid, char *buf, size_t size) {
+	char path[64], stack[4096], *frame, *end;
+	size_t len = 0;
+	int frames = 0;
+
+	sprintf(path, "/proc/%d/stack", (int) pid);
+	if (read_proc(path, stack, sizeof(stack)) <= 0) {
+		snprintf(buf, size, "unavailable");
+		return;
+	}
+	buf[0] = 0;
+	/* Lines like "[<0>] pipe_read+0x2ff/0x4b0" */
+	for (frame = strtok(stack, "\n"); frame && frames < STALL_FRAMES && len < size; frame = strtok(NULL, "\n")) {
+		if ((frame = strchr(frame, ' '))) {
+			frame++;
+			if ((end = strchr(frame, '+'))) {
+				*end = 0;
+			}
+			len += (size_t) snprintf(buf + len, size - len, "%s%s", frames++ ? " < " : "", frame);
+		}
+	}
+}
+
+/* Describes the processes of the job with the group, or the foreground
+ * commands for 0 */
+static void describe_job(pid_t pgid) {
+	char path[64], buf[1024], wchan[64], call[400], stack[256], comm[64], state, *p;
+	struct dirent *entry;
+	long ppid, pgrp;
+	DIR *proc;
+
+	if (!(proc = opendir("/proc"))) {
+		return;
+	}
+	while (NULL != (entry = readdir(proc))) {
+		pid_t pid = (pid_t) atoi(entry->d_name);
+
+		sprintf(path, "/proc/%d/stat", (int) pid);
+		if (!pid || read_proc(path, buf, sizeof(buf)) <= 0 || !(p = strrchr(buf, ')')) ||
+				3 != sscanf(p + 2, "%c %ld %ld", &state, &ppid, &pgrp)) {
+			continue;
+		}
+		if (pgid ? (pid_t) pgrp != pgid : (pid_t) pgrp != getpgrp() || (pid_t) ppid != getpid()) {
+			continue;
+		}
+		*p = 0;
+		snprintf(comm, sizeof(comm), "%s", strchr(buf, '(') ? strchr(buf, '(') + 1 : "?");
+		sprintf(path, "/proc/%d/wchan", (int) pid);
+		if (read_proc(path, wchan, sizeof(wchan)) <= 0 || 0 == strcmp(wchan, "0")) {
+			strcpy(wchan, "-");
+		}
+		describe_syscall(pid, call, sizeof(call));
+		describe_stack(pid, stack, sizeof(stack));
+		fprintf(stderr, "  %d %s %c, waiting in %s%s\n      stack: %s\n", (int) pid, comm, state, wchan, call, stack);
+	}
+	closedir(proc);
+}
+
+/* Shows the jobs that check_stalls found stalled */
+void report_stalls(void) {
+	struct timeval now;
+	const Job *job;
+	size_t i;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < num_progress; i++) {
+		Progress *p = &progress[i];
+
+		if (!p->due) {
+			continue;
+		}
+		p->due = false;
+		p->reported = true;
+		for (job = first_job(); job && job->pid != p->pgid; job = job->next);
+		if (job) {
+			fprintf(stderr, SMSH ": [%d] %d stalled for %ld s: %s\n", job->id, (int) job->pid,
+					ms_between(&p->since, &now) / 1000, job->line);
+		} else {
+			fprintf(stderr, SMSH ": foreground stalled for %ld s\n", ms_between(&p->since, &now) / 1000);
+		}
+		describe_job(p->pgid);
+	}
+	fflush(stderr);
+}
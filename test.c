@@ -0,0 +1,188 @@
+#include "main.h"
+
+/*
+ * The test (and [) builtin, so that the conditions of ifs and loops
+ * are evaluated within the shell.
+ *
+ * expr: expr -o expr | expr -a expr | ! expr | ( expr ) | primary
+ */
+
+typedef struct {
+	char **args;
+	int pos, end;
+	bool error;
+} Test;
+
+static bool test_or(Test *);
+
+static bool file_test(char op, const char *path) {
+	struct stat st;
+
+	if ('L' == op || 'h' == op) {
+		return 0 == lstat(path, &st) && S_ISLNK(st.st_mode);
+	}
+	if (-1 == stat(path, &st)) {
+		return false;
+	}
+	switch (op) {
+		case 'e': return true;
+		case 'f': return S_ISREG(st.st_mode);
+		case 'd': return S_ISDIR(st.st_mode);
+		case 'p': return S_ISFIFO(st.st_mode);
+		case 's': return 0 < st.st_size;
+		case 'r': return 0 == access(path, R_OK);
+		case 'w': return 0 == access(path, W_OK);
+		case 'x': return 0 == access(path, X_OK);
+	}
+	return false;
+}
+
+static bool is_unary(const char *arg) {
+	return '-' == arg[0] && arg[1] && !arg[2] && strchr("nzefdpsrwxLh", arg[1]);
+}
+
+static long number(Test *t, const char *arg) {
+	char *end;
+	long n = strtol(arg, &end, 10);
+	if (!*arg || *end) {
+		fprintf(stderr, "test: %s: integer expected\n", arg);
+		t->error = true;
+	}
+	return n;
+}
+
+static bool binary(Test *t, const char *left, const char *op, const char *right) {
+	if (0 == strcmp(op, "=") || 0 == strcmp(op, "==")) {
+		return 0 == strcmp(left, right);
+	}
+	if (0 == strcmp(op, "!=")) {
+		return 0 != strcmp(left, right);
+	}
+	if (0 == strcmp(op, "-eq")) {
+		return number(t, left) == number(t, right);
+	}
+	if (0 == strcmp(op, "-ne")) {
+		return number(t, left) != number(t, right);
+	}
+	if (0 == strcmp(op, "-lt")) {
+		return number(t, left) < number(t, right);
+	}
+	if (0 == strcmp(op, "-le")) {
+		return number(t, left) <= number(t, right);
+	}
+	if (0 == strcmp(op, "-gt")) {
+		return number(t, left) > number(t, right);
+	}
+	if (0 == strcmp(op, "-ge")) {
+		return number(t, left) >= number(t, right);
+	}
+	fprintf(stderr, "test: %s: binary operator expected\n", op);
+	t->error = true;
+	return false;
+}
+
+static bool is_binary(const char *arg) {
+	static const char *ops[] = {
+		"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge"
+	};
+	size_t i;
+	for (i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+		if (0 == strcmp(arg, ops[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool test_primary(Test *t) {
+	char **args = t->args;
+	int left = t->end - t->pos;
+
+	if (0 >= left) {
+		fprintf(stderr, "test: argument expected\n");
+		t->error = true;
+		return false;
+	}
+	if (0 == strcmp(args[t->pos], "!")) {
+		t->pos++;
+		return !test_primary(t);
+	}
+	if (0 == strcmp(args[t->pos], "(") && 3 <= left) {
+		bool result;
+		t->pos++;
+		result = test_or(t);
+		if (t->pos >= t->end || 0 != strcmp(args[t->pos], ")")) {
+			fprintf(stderr, "test: ')' expected\n");
+			t->error = true;
+			return false;
+		}
+		t->pos++;
+		return result;
+	}
+	if (3 <= left && is_binary(args[t->pos + 1])) {
+		t->pos += 3;
+		return binary(t, args[t->pos - 3], args[t->pos - 2], args[t->pos - 1]);
+	}
+	if (2 <= left && is_unary(args[t->pos])) {
+		char op = args[t->pos][1];
+		const char *arg = args[t->pos + 1];
+		t->pos += 2;
+		if ('n' == op) {
+			return 0 != *arg;
+		}
+		if ('z' == op) {
+			return 0 == *arg;
+		}
+		return file_test(op, arg);
+	}
+	/* A lone string is true if it's not empty */
+	return 0 != *args[t->pos++];
+}
+
+static bool test_and(Test *t) {
+	bool result = test_primary(t);
+	while (t->pos < t->end && 0 == strcmp(t->args[t->pos], "-a")) {
+		t->pos++;
+		result = test_primary(t) && result;
+	}
+	return result;
+}
+
+static bool test_or(Test *t) {
+	bool result = test_and(t);
+	while (t->pos < t->end && 0 == strcmp(t->args[t->pos], "-o")) {
+		t->pos++;
+		result = test_and(t) || result;
+	}
+	return result;
+}
+
+/* The built-in test and [ commands */
+int test_cmd(char **args) {
+	Test t;
+	bool result;
+
+	t.args = args;
+	t.pos = 1;
+	t.error = false;
+	for (t.end = 0; args[t.end]; t.end++);
+
+	if (0 == strcmp(args[0], "[")) {
+		if (0 != strcmp(args[t.end - 1], "]")) {
+			fprintf(stderr, "[: missing ']'\n");
+			return 2;
+		}
+		t.end--;
+	}
+	if (t.pos == t.end) {
+		/* No expression is false */
+		return EXIT_FAILURE;
+	}
+
+	result = test_or(&t);
+	if (!t.error && t.pos != t.end) {
+		fprintf(stderr, "test: %s: unexpected argument\n", args[t.pos]);
+		t.error = true;
+	}
+	return t.error ? 2 : result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
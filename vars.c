@@ -0,0 +1,1085 @@
+/* For memmem */
+#define _GNU_SOURCE
+#include "main.h"
+
+/*
+ * Shell variables and their expansion.
+ *
+ * Variables live in a hash table of their own. Looking up a name that
+ * isn't a shell variable falls back to the environment, so $HOME and
+ * friends work without being imported first. Variables that are in the
+ * environment, or were exported, are kept in it when they're set, so
+ * that the commands the shell runs see them.
+ */
+
+typedef struct Var {
+	char *name;
+	char *value;
+	bool exported;
+	struct Var *next;
+} Var;
+
+static Var *vars[VAR_BUCKETS];
+
+/* The status of the last command, $?, and of each command of the last
+ * pipeline, ${PIPESTATUS[@]} */
+static int last_status = EXIT_SUCCESS;
+static int *statuses = NULL;
+static size_t num_statuses = 0, statuses_cap = 0;
+
+/* $0, and $1 onwards with their count, $#. The arguments are the caller's,
+ * a script's or a function's, and live for as long as they're set. */
+static const char *arg0 = SMSH;
+static char **positional = NULL;
+static size_t num_positional = 0;
+
+static unsigned long hash(const char *name, size_t len) {
+	unsigned long h = 5381;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h = h * 33 + (unsigned char) name[i];
+	}
+	return h % VAR_BUCKETS;
+}
+
+static Var *find_var(const char *name, size_t len) {
+	Var *var;
+	for (var = vars[hash(name, len)]; var; var = var->next) {
+		if (0 == strncmp(var->name, name, len) && !var->name[len]) {
+			return var;
+		}
+	}
+	return NULL;
+}
+
+/* The positional parameters joined by spaces, as $* and unquoted $@ */
+static const char *join_positional(void) {
+	static char *joined = NULL;
+	static size_t cap = 0;
+	size_t len = 1, i;
+
+	for (i = 0; i < num_positional; i++) {
+		len += strlen(positional[i]) + 1;
+	}
+	if (len > cap) {
+		cap = len;
+		if (!(joined = realloc(joined, cap))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0, len = 0; i < num_positional; i++) {
+		len += (size_t) sprintf(joined + len, "%s%s", i ? " " : "", positional[i]);
+	}
+	joined[len] = 0;
+	return joined;
+}
+
+/* Looks up a variable given by the first len characters of name */
+const char *get_var_n(const char *name, size_t len) {
+	static char status[32];
+	Var *var = find_var(name, len);
+	char env[256];
+
+	if (1 == len && '?' == *name) {
+		sprintf(status, "%d", last_status);
+		return status;
+	}
+	if (isdigit((unsigned char) *name)) {
+		size_t n = 0, i;
+		for (i = 0; i < len; i++) {
+			n = n * 10 + (size_t) (name[i] - '0');
+		}
+		return 0 == n ? arg0 : n <= num_positional ? positional[n - 1] : NULL;
+	}
+	if (1 == len && '#' == *name) {
+		sprintf(status, "%lu", (unsigned long) num_positional);
+		return status;
+	}
+	if (1 == len && ('@' == *name || '*' == *name)) {
+		return join_positional();
+	}
+	if (10 == len && 0 == strncmp(name, "PIPESTATUS", len)) {
+		/* Without a subscript, the first element */
+		sprintf(status, "%d", num_statuses ? statuses[0] : last_status);
+		return status;
+	}
+	if (var) {
+		return var->value;
+	}
+	if (len >= sizeof(env)) {
+		return NULL;
+	}
+	memcpy(env, name, len);
+	env[len] = 0;
+	return getenv(env);
+}
+
+const char *get_var(const char *name) {
+	return get_var_n(name, strlen(name));
+}
+
+/* Sets a variable, returning it */
+static Var *store_var(const char *name, const char *value) {
+	size_t len = strlen(name), value_len = strlen(value);
+	Var *var = find_var(name, len);
+	char *copy;
+
+	if (var && value_len <= strlen(var->value)) {
+		/* Reuse the old value, which counters in loops mostly fit in */
+		memcpy(var->value, value, value_len + 1);
+		return var;
+	}
+	if (!(copy = strdup(value))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	if (var) {
+		free(var->value);
+		var->value = copy;
+		return var;
+	}
+	if (!(var = malloc(sizeof(*var))) || !(var->name = strdup(name))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	var->value = copy;
+	/* Such as PATH, which commands should see changed */
+	var->exported = NULL != getenv(name);
+	var->next = vars[hash(name, len)];
+	vars[hash(name, len)] = var;
+	return var;
+}
+
+void set_var(const char *name, const char *value) {
+	Var *var = store_var(name, value);
+
+	if (var->exported && -1 == setenv(name, value, 1)) {
+		perror("setenv");
+	}
+}
+
+void set_status(int status) {
+	last_status = status;
+}
+
+void set_pipe_status(const int *pipe_statuses, size_t n) {
+	if (n > statuses_cap) {
+		statuses_cap = n;
+		if (!(statuses = realloc(statuses, n * sizeof(*statuses)))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (n) {
+		memcpy(statuses, pipe_statuses, n * sizeof(*statuses));
+	}
+	num_statuses = n;
+}
+
+/* Sets $1 onwards to the NULL-terminated args, returning the
+ * ones they replace for restoring them */
+char **set_positional(char **args) {
+	char **old = positional;
+	positional = args;
+	for (num_positional = 0; args && args[num_positional]; num_positional++);
+	return old;
+}
+
+void set_arg0(const char *name) {
+	arg0 = name;
+}
+
+/* The shift builtin, dropping the first n positional parameters */
+int shift_cmd(char **args) {
+	char *end;
+	long n = args[1] ? strtol(args[1], &end, 10) : 1;
+
+	if ((args[1] && (*end || !*args[1])) || n < 0 || (size_t) n > num_positional) {
+		fprintf(stderr, "shift: %s: shift count out of range\n", args[1] ? args[1] : "1");
+		return EXIT_FAILURE;
+	}
+	positional += n;
+	num_positional -= (size_t) n;
+	return EXIT_SUCCESS;
+}
+
+bool is_name_char(char c, bool first) {
+	return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || '_' == c ||
+		(!first && '0' <= c && c <= '9');
+}
+
+/* Returns the length of the name in an assignment word such as
+ * "x=1", or 0 if the word isn't one. */
+static size_t assignment_name(const char *word) {
+	size_t len = 0;
+	while (is_name_char(word[len], 0 == len)) {
+		len++;
+	}
+	return 0 < len && '=' == word[len] ? len : 0;
+}
+
+/* Counts the assignments, such as "x=1", that a command starts with */
+size_t count_assignments(char **words) {
+	size_t n = 0;
+	while (words[n] && assignment_name(words[n])) {
+		n++;
+	}
+	return n;
+}
+
+/* Performs an assignment, either to a shell variable or,
+ * for a command about to be run, to the environment. */
+void assign(const char *word, bool env) {
+	size_t len = assignment_name(word);
+	char *value = expand_word(&word[len + 1], false), *name;
+
+	if (!(name = malloc(len + strlen(value) + 2))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(name, word, len);
+	name[len] = 0;
+	/* Set in the child too, as what it looks up before the exec, such
+	 * as the PATH, must see the command's own value */
+	set_var(name, value);
+	if (env) {
+		/* putenv keeps the string, which is fine in a child about to exec */
+		sprintf(name + len, "=%s", value);
+		putenv(name);
+	} else {
+		free(name);
+	}
+	free(value);
+}
+
+/* The export builtin, "export name[=value] ...", putting variables in
+ * the environment of the commands the shell runs; an unset one is
+ * exported empty. Without names, it lists the environment. */
+int export_cmd(char **args) {
+	int status = EXIT_SUCCESS;
+	char **env;
+
+	if (!args[1]) {
+		for (env = environ; *env; env++) {
+			const char *eq = strchr(*env, '=');
+			char *quoted;
+
+			if (!eq) {
+				continue;
+			}
+			quoted = quote_word(eq + 1);
+			printf("export %.*s=%s\n", (int) (eq - *env), *env, quoted);
+			free(quoted);
+		}
+		fflush(stdout);
+		return status;
+	}
+	for (args++; *args; args++) {
+		size_t len = assignment_name(*args), i;
+		const char *value;
+		Var *var;
+
+		for (i = 0; !len && is_name_char((*args)[i], 0 == i); i++);
+		if (!len && (!i || (*args)[i])) {
+			fprintf(stderr, "export: %s: not a valid identifier\n", *args);
+			status = EXIT_FAILURE;
+			continue;
+		}
+		if (len) {
+			(*args)[len] = 0;
+			var = store_var(*args, *args + len + 1);
+			(*args)[len] = '=';
+		} else if (!(var = find_var(*args, strlen(*args)))) {
+			/* From the environment, or unset */
+			value = getenv(*args);
+			var = store_var(*args, value ? value : "");
+		}
+		var->exported = true;
+		if (-1 == setenv(var->name, var->value, 1)) {
+			perror("export");
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
+
+/*
+ * Expansion of words.
+ *
+ * A word is expanded in a single pass into a scratch buffer that is kept
+ * between expansions: parameters are substituted, quotes removed and
+ * unquoted expansions split into fields on IFS. The fields are then
+ * copied out in one allocation, so expanding a command in a loop costs
+ * a single malloc once the scratch buffer has grown to fit.
+ */
+
+typedef struct {
+	char *data;
+	size_t len, cap;
+	size_t num_fields; /* Fields in data, each terminated by a 0 */
+	bool started; /* The current field exists, even if empty */
+	bool split; /* Unquoted expansions are split into fields */
+	bool pattern; /* Quoted characters are escaped for fnmatch */
+} Expansion;
+
+static Expansion scratch;
+
+static void grow(void **buf, size_t *cap, size_t need, size_t size) {
+	if (need <= *cap) {
+		return;
+	}
+	while (*cap < need) {
+		*cap = *cap ? *cap * 2 : 64;
+	}
+	if (!(*buf = realloc(*buf, *cap * size))) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void emit(Expansion *e, char c) {
+	grow((void **) &e->data, &e->cap, e->len + 2, 1);
+	e->data[e->len++] = c;
+	e->started = true;
+}
+
+/* Emits a character that can't split fields or act as a pattern */
+static void emit_quoted(Expansion *e, char c) {
+	if (e->pattern && strchr("*?[]\\", c)) {
+		emit(e, '\\');
+	}
+	emit(e, c);
+}
+
+static void end_field(Expansion *e) {
+	if (!e->started) {
+		return;
+	}
+	emit(e, 0);
+	e->num_fields++;
+	e->started = false;
+}
+
+/* Emits the value of an expansion, splitting it unless quoted */
+static void emit_value(Expansion *e, const char *value, size_t len, bool quoted) {
+	const char *ifs;
+	size_t i;
+
+	if (quoted || !e->split) {
+		for (i = 0; i < len; i++) {
+			if (quoted) {
+				emit_quoted(e, value[i]);
+			} else {
+				emit(e, value[i]);
+			}
+		}
+		/* Even an empty quoted expansion makes a field */
+		e->started = e->started || quoted;
+		return;
+	}
+	if (NULL == (ifs = get_var("IFS"))) {
+		ifs = " \t\n";
+	}
+	for (i = 0; i < len; i++) {
+		if (value[i] && strchr(ifs, value[i])) {
+			end_field(e);
+		} else {
+			emit(e, value[i]);
+		}
+	}
+}
+
+static void expand_range(Expansion *, const char *, const char *, bool);
+
+/* Scratch buffers for the words within ${...}, such as patterns, one per
+ * level of nesting. Like the main one they're kept between expansions. */
+static Expansion operands[4];
+static int nesting = 0;
+#define MAX_NESTING ((int) (sizeof(operands) / sizeof(*operands)))
+
+/* Finds the first of the stops that isn't quoted or nested within
+ * the text, or the end of it. */
+static const char *scan_to(const char *src, const char *stops) {
+	int depth = 0;
+
+	for (; *src && (depth || !strchr(stops, *src)); src++) {
+		if ('\\' == *src && src[1]) {
+			src++;
+		} else if ('\'' == *src || '"' == *src) {
+			const char *quote = strchr(src + 1, *src);
+			if (!quote) {
+				return src + strlen(src);
+			}
+			src = quote;
+		} else if ('{' == *src) {
+			depth++;
+		} else if ('}' == *src && depth) {
+			depth--;
+		}
+	}
+	return src;
+}
+
+/* Copies a string into the operand buffer, returning its offset */
+static size_t store(Expansion *o, const char *str, size_t len) {
+	size_t offset = o->len;
+	grow((void **) &o->data, &o->cap, o->len + len + 1, 1);
+	memcpy(o->data + o->len, str, len);
+	o->len += len;
+	o->data[o->len++] = 0;
+	return offset;
+}
+
+/* Expands a word of the operator, unsplit, into the operand buffer */
+static size_t store_word(Expansion *o, const char *src, const char *end, bool pattern) {
+	size_t offset = o->len;
+	o->split = false;
+	o->pattern = pattern;
+	expand_range(o, src, end, false);
+	emit(o, 0);
+	return offset;
+}
+
+/* Whether the pattern matches value[from, to). The value is
+ * terminated at to for fnmatch, and then restored. */
+static bool match(const char *pattern, char *value, size_t from, size_t to) {
+	char saved = value[to];
+	bool matched;
+
+	value[to] = 0;
+	matched = 0 == fnmatch(pattern, value + from, 0);
+	value[to] = saved;
+	return matched;
+}
+
+/* What can be told about the strings a pattern matches without fnmatch */
+typedef struct {
+	long width; /* Characters matched, or -1 if it varies, as with '*' */
+	bool literal; /* Without special characters, so it only matches itself */
+	int first, last; /* Characters a match starts and ends with, or -1 */
+} PatternShape;
+
+/* The end of the bracket expression at p, or NULL if it's unterminated */
+static const char *bracket_end(const char *p) {
+	p++;
+	if ('!' == *p || '^' == *p) {
+		p++;
+	}
+	if (']' == *p) {
+		p++;
+	}
+	while (*p && ']' != *p) {
+		if ('[' == *p && p[1] && strchr(":=.", p[1])) {
+			/* [:class:], [=equivalence=] or [.collating.] */
+			const char *close = p + 2;
+			while (*close && (close[0] != p[1] || ']' != close[1])) {
+				close++;
+			}
+			if (!*close) {
+				return NULL;
+			}
+			p = close + 2;
+		} else if ('\\' == *p && p[1]) {
+			p += 2;
+		} else {
+			p++;
+		}
+	}
+	return *p ? p : NULL;
+}
+
+/* Reads the pattern element by element. Anything unusual, such as an
+ * unterminated bracket, is taken to match any number of characters,
+ * which leaves it to fnmatch. */
+static void shape_pattern(const char *p, PatternShape *shape) {
+	bool varies = false;
+	const char *end;
+	long width;
+
+	shape->literal = true;
+	shape->first = shape->last = -1;
+	for (width = 0; *p; p++, width++) {
+		int c = -1;
+
+		if ('\\' == *p && p[1]) {
+			c = (unsigned char) *++p;
+		} else if ('[' == *p && NULL != (end = bracket_end(p))) {
+			p = end;
+		} else if ('*' == *p || '[' == *p || '\\' == *p) {
+			varies = true;
+		} else if ('?' != *p) {
+			c = (unsigned char) *p;
+		}
+		if (-1 == c) {
+			shape->literal = false;
+		}
+		if (0 == width) {
+			shape->first = c;
+		}
+		shape->last = c;
+	}
+	shape->width = varies ? -1 : width;
+}
+
+/* Removes the escapes of a literal pattern, in place */
+static void unescape(char *pattern) {
+	char *to = pattern;
+
+	for (; *pattern; pattern++) {
+		if ('\\' == *pattern) {
+			pattern++;
+		}
+		*to++ = *pattern;
+	}
+	*to = 0;
+}
+
+/* Like match, but strings that can't match the pattern's shape are
+ * ruled out first, and literal patterns, unescaped, are compared */
+static bool match_shaped(const PatternShape *shape, const char *pattern, char *value, size_t from, size_t to) {
+	if ((0 <= shape->width && (size_t) shape->width != to - from) ||
+			(-1 != shape->first && (from == to || (unsigned char) value[from] != shape->first)) ||
+			(-1 != shape->last && (from == to || (unsigned char) value[to - 1] != shape->last))) {
+		return false;
+	}
+	if (shape->literal) {
+		return 0 == memcmp(value + from, pattern, to - from);
+	}
+	return match(pattern, value, from, to);
+}
+
+static void bad_substitution(const char *src, const char *end) {
+	fprintf(stderr, SMSH ": %.*s: bad substitution\n", (int) (end + 1 - src), src);
+	/* Like Ctrl-C, this abandons the rest of the input */
+	interrupted = 1;
+}
+
+/* ${name#pattern}, ${name##pattern}, ${name%pattern} and ${name%%pattern} */
+static void remove_affix(Expansion *e, Expansion *o, const char *op, const char *end,
+		size_t value_offset, bool quoted) {
+	bool longest = op[0] == op[1];
+	size_t pattern_offset = store_word(o, op + (longest ? 2 : 1), end, true);
+	char *value = o->data + value_offset, *pattern = o->data + pattern_offset;
+	size_t len = strlen(value), from = 0, to = len, i;
+
+	for (i = 0; i <= len; i++) {
+		if ('#' == op[0]) {
+			/* Prefixes, the shortest first unless longest */
+			size_t cut = longest ? len - i : i;
+			if (match(pattern, value, 0, cut)) {
+				from = cut;
+				break;
+			}
+		} else {
+			/* Suffixes, the shortest first unless longest */
+			size_t cut = longest ? i : len - i;
+			if (match(pattern, value, cut, len)) {
+				to = cut;
+				break;
+			}
+		}
+	}
+	emit_value(e, value + from, to - from, quoted);
+}
+
+/* ${name/pattern/string}, replacing the first match, or all with //.
+ * With /# the match must be at the start and with /% at the end. */
+static void replace(Expansion *e, Expansion *o, const char *op, const char *end,
+		size_t value_offset, bool quoted) {
+	char mode = strchr("/#%", op[1]) ? op[1] : 0;
+	const char *pattern_end = scan_to(op + (mode ? 2 : 1), "/}");
+	size_t pattern_offset, string_offset, len, limit, pos = 0, done = 0;
+	char *value, *pattern, *string, *last;
+	PatternShape shape;
+
+	pattern_offset = store_word(o, op + (mode ? 2 : 1), pattern_end, true);
+	string_offset = store_word(o, '/' == *pattern_end ? pattern_end + 1 : end, end, false);
+	value = o->data + value_offset;
+	pattern = o->data + pattern_offset;
+	string = o->data + string_offset;
+	len = strlen(value);
+	shape_pattern(pattern, &shape);
+	if (shape.literal) {
+		unescape(pattern);
+	}
+	/* No match ends after the last of the character the pattern ends with */
+	limit = len;
+	if (-1 != shape.last) {
+		last = memrchr(value, shape.last, len);
+		limit = last ? (size_t) (last - value) + 1 : 0;
+	}
+
+	/* Matches are never empty, so each one moves pos forward */
+	while (*pattern && pos < limit) {
+		bool found = false;
+		size_t to = len;
+
+		if (shape.literal && ('/' == mode || !mode)) {
+			/* Straight to the next occurrence */
+			const char *at = memmem(value + pos, len - pos, pattern, (size_t) shape.width);
+			if (!at) {
+				break;
+			}
+			pos = (size_t) (at - value);
+			to = pos + (size_t) shape.width;
+			found = true;
+		} else if ('%' == mode) {
+			if (0 <= shape.width && pos + (size_t) shape.width < len) {
+				/* The only place a match could start */
+				pos = len - (size_t) shape.width;
+			}
+			found = match_shaped(&shape, pattern, value, pos, len);
+		} else if (('#' != mode || 0 == pos) && 0 <= shape.width) {
+			/* The only match there could be at pos */
+			to = pos + (size_t) shape.width;
+			found = to <= len && match_shaped(&shape, pattern, value, pos, to);
+		} else if ('#' != mode || 0 == pos) {
+			/* The longest match at pos */
+			for (to = limit; to > pos && !(found = match_shaped(&shape, pattern, value, pos, to)); to--);
+		}
+		if (!found) {
+			if ('#' == mode || ('%' == mode && 0 <= shape.width)) {
+				break;
+			}
+			pos++;
+			continue;
+		}
+		emit_value(e, value + done, pos - done, quoted);
+		emit_value(e, string, strlen(string), quoted);
+		done = pos = to;
+		if ('/' != mode) {
+			break;
+		}
+	}
+	emit_value(e, value + done, len - done, quoted);
+}
+/* ${name:offset} and ${name:offset:length}, both arithmetic. A negative
+ * offset counts from the end, as does a negative length. */
+static void substring(Expansion *e, const char *op, const char *end, const char *value, bool quoted) {
+	const char *colon = scan_to(op + 1, ":}");
+	long len = value ? (long) strlen(value) : 0, from, to;
+
+	if (!arith(op + 1, (size_t) (colon - op - 1), &from) ||
+			(':' == *colon && !arith(colon + 1, (size_t) (end - colon - 1), &to))) {
+		/* Like Ctrl-C, a bad expression abandons the rest of the input */
+		interrupted = 1;
+		return;
+	}
+	if (from < 0) {
+		from += len;
+	}
+	from = from < 0 ? 0 : from > len ? len : from;
+	if (':' != *colon) {
+		to = len;
+	} else if (to < 0) {
+		to += len;
+	} else {
+		to += from;
+	}
+	to = to < from ? from : to > len ? len : to;
+	if (value) {
+		emit_value(e, value + from, (size_t) (to - from), quoted);
+	}
+}
+
+/* The operators of ${name<op>word}, op pointing at the operator */
+static void expand_operator(Expansion *e, const char *src, const char *name, size_t name_len,
+		const char *op, const char *end, bool quoted) {
+	const char *value = get_var_n(name, name_len);
+	Expansion local, *o = &local;
+	bool colon = ':' == *op && strchr("-=+?", op[1]), unset;
+
+	if (colon) {
+		op++;
+	}
+	unset = !value || (colon && !*value);
+	switch (*op) {
+		case '-':
+		case '+':
+			if (unset == ('+' == *op)) {
+				if (!unset) {
+					emit_value(e, value, strlen(value), quoted);
+				}
+				return;
+			}
+			if (quoted || !e->split) {
+				expand_range(e, op + 1, end, quoted);
+				return;
+			}
+			/* Unquoted, the word is split like any other value */
+			break;
+		case ':':
+			substring(e, op, end, value, quoted);
+			return;
+		case '=':
+		case '?':
+		case '#':
+		case '%':
+		case '/':
+			break;
+		default:
+			bad_substitution(src, end);
+			return;
+	}
+	if (('=' == *op || '?' == *op) && !unset) {
+		emit_value(e, value, strlen(value), quoted);
+		return;
+	}
+
+	/* The rest need words expanded to the side */
+	if (nesting < MAX_NESTING) {
+		o = &operands[nesting];
+	} else {
+		memset(o, 0, sizeof(*o));
+	}
+	nesting++;
+	o->len = 0;
+
+	if ('-' == *op || '+' == *op) {
+		size_t word = store_word(o, op + 1, end, false);
+		emit_value(e, o->data + word, strlen(o->data + word), false);
+	} else if ('=' == *op) {
+		size_t name_offset = store(o, name, name_len), value_offset;
+		value_offset = store_word(o, op + 1, end, false);
+		set_var(o->data + name_offset, o->data + value_offset);
+		emit_value(e, o->data + value_offset, strlen(o->data + value_offset), quoted);
+	} else if ('?' == *op) {
+		size_t message = store_word(o, op + 1, end, false);
+		fprintf(stderr, SMSH ": %.*s: %s\n", (int) name_len, name,
+			o->data[message] ? o->data + message : "parameter null or not set");
+		interrupted = 1;
+	} else {
+		/* The value is copied so that matching can cut it short in place */
+		size_t value_offset = store(o, value ? value : "", value ? strlen(value) : 0);
+		if ('/' == *op) {
+			replace(e, o, op, end, value_offset, quoted);
+		} else {
+			remove_affix(e, o, op, end, value_offset, quoted);
+		}
+	}
+
+	nesting--;
+	if (o == &local) {
+		free(local.data);
+	}
+}
+
+/* ${PIPESTATUS[index]}, counting from the end if negative, or all of
+ * the statuses for @ or *. Quoted, @ makes a field of each. */
+static void expand_element(Expansion *e, const char *index, const char *end, bool quoted) {
+	char num[32];
+	size_t i;
+	long n;
+
+	if (1 == end - index && ('@' == *index || '*' == *index)) {
+		for (i = 0; i < num_statuses; i++) {
+			if (i && '@' == *index && quoted && e->split) {
+				end_field(e);
+			} else if (i) {
+				emit_value(e, " ", 1, quoted);
+			}
+			sprintf(num, "%d", statuses[i]);
+			emit_value(e, num, strlen(num), quoted);
+		}
+		return;
+	}
+	if (!arith(index, (size_t) (end - index), &n)) {
+		interrupted = 1;
+		return;
+	}
+	if (n < 0) {
+		n += (long) num_statuses;
+	}
+	if (0 <= n && (size_t) n < num_statuses) {
+		sprintf(num, "%d", statuses[n]);
+		emit_value(e, num, strlen(num), quoted);
+	}
+}
+
+/* Expands the parameter that src points at (at its $), returning
+ * where the word continues after it. */
+static const char *expand_parameter(Expansion *e, const char *src, bool quoted) {
+	const char *name = src + 1, *value, *end;
+	size_t name_len = 0;
+	bool braced = '{' == *name, length = false;
+
+	if (braced) {
+		name++;
+		if ('#' == *name && (is_name_char(name[1], false) || (name[1] && strchr("?@*", name[1])))) {
+			/* ${#name}, the length of the value */
+			length = true;
+			name++;
+		}
+	}
+	if (isdigit((unsigned char) *name)) {
+		/* A positional parameter, where only ${10} has more than a digit */
+		for (name_len = 1; braced && isdigit((unsigned char) name[name_len]); name_len++);
+	} else if (*name && strchr("?#@*", *name)) {
+		/* The special parameters $?, $#, $@ and $* */
+		name_len = 1;
+	} else {
+		while (is_name_char(name[name_len], 0 == name_len)) {
+			name_len++;
+		}
+	}
+	end = braced ? scan_to(name + name_len, "}") : name + name_len;
+	if (0 == name_len || (braced && '}' != *end)) {
+		/* Not a parameter; the $ is kept as is */
+		emit_quoted(e, '$');
+		return src + 1;
+	}
+
+	if (braced && '[' == name[name_len]) {
+		/* PIPESTATUS is the only array */
+		if (length || ']' != end[-1] || 10 != name_len || 0 != strncmp(name, "PIPESTATUS", 10)) {
+			bad_substitution(src, end);
+		} else {
+			expand_element(e, name + name_len + 1, end - 1, quoted);
+		}
+		return end + 1;
+	}
+
+	if (braced && end != name + name_len) {
+		if (length) {
+			bad_substitution(src, end);
+		} else {
+			expand_operator(e, src, name, name_len, name + name_len, end, quoted);
+		}
+		return end + 1;
+	}
+	if (!length && 1 == name_len && '@' == *name && quoted && e->split) {
+		/* "$@" makes a field of each, and none at all without any */
+		size_t i;
+		for (i = 0; i < num_positional; i++) {
+			if (i) {
+				end_field(e);
+			}
+			emit_value(e, positional[i], strlen(positional[i]), true);
+		}
+		return braced ? end + 1 : end;
+	}
+	value = get_var_n(name, name_len);
+	if (length) {
+		char num[32];
+		sprintf(num, "%lu", (unsigned long) (value ? strlen(value) : 0));
+		emit_value(e, num, strlen(num), quoted);
+	} else if (value) {
+		emit_value(e, value, strlen(value), quoted);
+	}
+	return braced ? end + 1 : end;
+}
+
+/* Expands the arithmetic expansion, $((...)), that src points at,
+ * returning where the word continues after it. */
+static const char *expand_arith(Expansion *e, const char *src, bool quoted) {
+	const char *expr = src + 3, *end;
+	char num[32];
+	int depth = 0;
+	long value;
+
+	for (end = expr; *end; end++) {
+		if ('(' == *end) {
+			depth++;
+		} else if (')' == *end && 0 > --depth) {
+			break;
+		}
+	}
+	if (')' != end[0] || ')' != end[1]) {
+		/* Not arithmetic; the $ is kept as is */
+		emit_quoted(e, '$');
+		return src + 1;
+	}
+
+	if (!arith(expr, (size_t) (end - expr), &value)) {
+		/* Like Ctrl-C, a bad expression abandons the rest of the input */
+		interrupted = 1;
+		return end + 2;
+	}
+	sprintf(num, "%ld", value);
+	emit_value(e, num, strlen(num), quoted);
+	return end + 2;
+}
+
+/* Expands the text from src up to end into e. It starts out quoted
+ * for words within double quotes, such as the one in "${x:-a b}". */
+static void expand_range(Expansion *e, const char *src, const char *end, bool quoted) {
+	const char *word = src;
+
+	while (src < end) {
+		switch (*src) {
+			case '\'':
+				if (quoted) {
+					emit_quoted(e, *src++);
+					break;
+				}
+				for (src++; *src && '\'' != *src; src++) {
+					emit_quoted(e, *src);
+				}
+				e->started = true;
+				if (*src) {
+					src++;
+				}
+				break;
+			case '"':
+				quoted = !quoted;
+				e->started = true;
+				src++;
+				break;
+			case '\\':
+				if ('\n' == src[1]) {
+					/* An escaped newline is removed altogether */
+					src += 2;
+				} else if (!src[1]) {
+					emit_quoted(e, *src++);
+				} else if (quoted && !strchr("$`\"\\", src[1])) {
+					/* Within double quotes, only some characters are escaped */
+					emit_quoted(e, *src++);
+				} else {
+					emit_quoted(e, src[1]);
+					src += 2;
+				}
+				break;
+			case '$':
+				if ('(' == src[1] && '(' == src[2]) {
+					src = expand_arith(e, src, quoted);
+					break;
+				}
+				src = expand_parameter(e, src, quoted);
+				break;
+			case '~':
+				if (src == word && !quoted && (src + 1 == end || '/' == src[1])) {
+					const char *home = get_var("HOME");
+					emit_value(e, home ? home : "~", home ? strlen(home) : 1, true);
+					src++;
+					break;
+				}
+				/* Fall through */
+			default:
+				if (quoted) {
+					emit_quoted(e, *src++);
+				} else {
+					emit(e, *src++);
+				}
+		}
+	}
+}
+
+/* Expands a word into the fields of e */
+static void expand_into(Expansion *e, const char *src) {
+	expand_range(e, src, src + strlen(src), false);
+	end_field(e);
+}
+
+/* Brace expands and then expands all arguments into a single allocation
+ * holding both the NULL-terminated array and the strings, so one free()
+ * releases it. */
+char **expand_args(char **args) {
+	Expansion *e = &scratch;
+	char **expanded, *dst;
+	size_t i, start = 0;
+
+	e->len = e->num_fields = 0;
+	e->started = false;
+	e->split = true;
+	e->pattern = false;
+	for (i = 0; args[i]; i++) {
+		Braces braces;
+		const char *word;
+
+		if (!strchr(args[i], '{') || !start_braces(&braces, args[i], true)) {
+			expand_into(e, args[i]);
+			continue;
+		}
+		while (NULL != (word = next_brace(&braces))) {
+			expand_into(e, word);
+		}
+		end_braces(&braces);
+	}
+
+	if (!(expanded = malloc((e->num_fields + 1) * sizeof(*expanded) + e->len))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	dst = (char *) (expanded + e->num_fields + 1);
+	if (e->len) {
+		memcpy(dst, e->data, e->len);
+	}
+	for (i = 0; i < e->num_fields; i++) {
+		expanded[i] = dst + start;
+		start += strlen(dst + start) + 1;
+	}
+	expanded[e->num_fields] = NULL;
+	return expanded;
+}
+
+/* Expands a word without splitting it, such as the value of an
+ * assignment. As a pattern, quoted characters match literally. */
+char *expand_word(const char *word, bool pattern) {
+	Expansion e;
+	memset(&e, 0, sizeof(e));
+	e.pattern = pattern;
+
+	expand_into(&e, word);
+	if (0 == e.len) {
+		emit(&e, 0);
+	}
+	return e.data;
+}
+
+/* Expands the body of a here-document: like text within double quotes,
+ * except that double quotes are kept, and so is a backslash before one. */
+char *expand_heredoc(const char *body) {
+	Expansion e;
+	const char *src = body;
+
+	memset(&e, 0, sizeof(e));
+	while (*src) {
+		if ('\\' == *src && src[1] && strchr("$`\\\n", src[1])) {
+			if ('\n' != src[1]) {
+				emit(&e, src[1]);
+			}
+			src += 2;
+		} else if ('$' == *src) {
+			src = '(' == src[1] && '(' == src[2] ? expand_arith(&e, src, true) :
+				expand_parameter(&e, src, true);
+		} else {
+			emit(&e, *src++);
+		}
+	}
+	emit(&e, 0);
+	return e.data;
+}
+
+/* Quotes a string so that it expands to itself */
+char *quote_word(const char *str) {
+	char *quoted = malloc(4 * strlen(str) + 3), *dst = quoted;
+	if (!quoted) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	*dst++ = '\'';
+	for (; *str; str++) {
+		if ('\'' == *str) {
+			/* End the quote, add an escaped ' and start over */
+			memcpy(dst, "'\\''", 4);
+			dst += 4;
+		} else {
+			*dst++ = *str;
+		}
+	}
+	*dst++ = '\'';
+	*dst = 0;
+	return quoted;
+}
+
+/* Turns a status from waitpid into an exit status */
+int exit_status(int status) {
+	if (WIFEXITED(status)) {
+		return WEXITSTATUS(status);
+	}
+	if (WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+	return EXIT_FAILURE;
+}
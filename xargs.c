@@ -0,0 +1,314 @@
+#include "main.h"
+
+/*
+ * The xargs builtin.
+ *
+ * Items read from standard input are packed into as few commands as
+ * will run: the arguments and the environment together must fit within
+ * ARG_MAX (see arg_space), and no argument may be longer than the kernel
+ * allows a single one to be. A batch is started as soon as the next item
+ * doesn't fit, up to -P batches at a time, but only one at a time while
+ * the host is under pressure (see host_stalled).
+ *
+ * Batches run in the foreground like any other command, so Ctrl-C
+ * reaches them as well.
+ */
+
+typedef struct {
+	char **args; /* The command, its initial arguments and then the items */
+	size_t args_cap;
+	size_t fixed; /* The command and its initial arguments */
+	char *data; /* The items of the batch being filled, each 0 terminated */
+	size_t len, cap;
+	size_t *items; /* Offsets of the items in data */
+	size_t num_items, items_cap;
+	long space, max_space; /* Bytes left and the total for items */
+	size_t max_items;
+	long longest; /* Longest argument the kernel allows */
+	bool nul, trace;
+	int max_procs;
+
+	pid_t *pids; /* The running batches */
+	int running;
+	/* For --stats */
+	unsigned long total_items, batches, failed;
+	size_t most_items;
+	long most_bytes;
+	int most_running;
+} Xargs;
+
+static void *grow_array(void *array, size_t *cap, size_t need, size_t size) {
+	if (need <= *cap) {
+		return array;
+	}
+	while (*cap < need) {
+		*cap = *cap ? *cap * 2 : 64;
+	}
+	if (!(array = realloc(array, *cap * size))) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return array;
+}
+
+/* Waits for one of the running batches to finish */
+static void wait_batch(Xargs *x) {
+	struct timeval since;
+	int status, i;
+	pid_t pid;
+
+	gettimeofday(&since, NULL);
+	for (;;) {
+		if (-1 == (pid = waitpid(-1, &status, 0))) {
+			if (EINTR == errno) {
+				continue;
+			}
+			x->running = 0;
+			count_wait(&since);
+			return;
+		}
+		for (i = 0; i < x->running && x->pids[i] != pid; i++);
+		if (i < x->running) {
+			break;
+		}
+		/* Not a batch, but a background job that finished meanwhile */
+	}
+	x->pids[i] = x->pids[--x->running];
+	if (EXIT_SUCCESS != exit_status(status)) {
+		x->failed++;
+	}
+}
+
+/* Starts the batch filled so far */
+static void run_batch(Xargs *x) {
+	int (*builtin)(char **) = builtin_func(x->args[0]);
+	pid_t child;
+	size_t i;
+
+	if (0 == x->num_items || interrupted) {
+		return;
+	}
+	x->args = grow_array(x->args, &x->args_cap, x->fixed + x->num_items + 1, sizeof(*x->args));
+	for (i = 0; i < x->num_items; i++) {
+		x->args[x->fixed + i] = x->data + x->items[i];
+	}
+	x->args[x->fixed + x->num_items] = NULL;
+
+	if (x->trace) {
+		/* Written at once, so it doesn't mix with the output of batches */
+		char *line;
+		size_t len = 0;
+		for (i = 0; x->args[i]; i++) {
+			len += strlen(x->args[i]) + 1;
+		}
+		if (!(line = malloc(len + 1))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0, len = 0; x->args[i]; i++) {
+			len += (size_t) sprintf(line + len, "%s%s", i ? " " : "", x->args[i]);
+		}
+		line[len++] = '\n';
+		if (-1 == write(STDERR_FILENO, line, len)) {
+			/* Tracing is best effort */
+		}
+		free(line);
+	}
+
+	/* Only one batch at a time while the host is stalled */
+	while (0 < x->running && (x->running >= x->max_procs || host_stalled())) {
+		wait_batch(x);
+	}
+
+	if (!builtin) {
+		/* Looked up once for all the batches */
+		resolve_command(x->args[0]);
+	}
+	sync_input();
+	fflush(NULL);
+	if (-1 == (child = fork())) {
+		perror("fork");
+		x->failed++;
+	} else if (0 == child) {
+		int null = open("/dev/null", O_RDONLY);
+		/* The items came from stdin, which the commands mustn't read */
+		if (-1 != null) {
+			dup2(null, STDIN_FILENO);
+			close(null);
+		}
+		exit(builtin ? builtin(x->args) : run_cmd(x->args));
+	} else {
+		x->pids[x->running++] = child;
+		x->batches++;
+		if (x->running > x->most_running) {
+			x->most_running = x->running;
+		}
+	}
+
+	if (x->num_items > x->most_items) {
+		x->most_items = x->num_items;
+	}
+	if (x->max_space - x->space > x->most_bytes) {
+		x->most_bytes = x->max_space - x->space;
+	}
+	x->len = x->num_items = 0;
+	x->space = x->max_space;
+}
+
+/* Adds the item at the end of data, starting a batch first if it
+ * doesn't fit in the current one. */
+static bool add_item(Xargs *x, size_t start) {
+	size_t len = x->len - start;
+	long cost = (long) (len + 1 + sizeof(char *));
+
+	if ((long) len >= x->longest || cost > x->max_space) {
+		fprintf(stderr, "xargs: item too long (%lu bytes)\n", (unsigned long) len);
+		return false;
+	}
+	x->data = grow_array(x->data, &x->cap, x->len + 1, 1);
+	x->data[x->len++] = 0;
+
+	if (x->num_items && (cost > x->space || x->num_items == x->max_items)) {
+		/* Start the batch so far; this item begins the next one */
+		run_batch(x);
+		memmove(x->data, x->data + start, len + 1);
+		x->len = len + 1;
+		start = 0;
+	}
+	x->items = grow_array(x->items, &x->items_cap, x->num_items + 1, sizeof(*x->items));
+	x->items[x->num_items++] = start;
+	x->space -= cost;
+	x->total_items++;
+	return true;
+}
+
+static bool number_arg(char **args, long *value) {
+	char *end;
+	if (!args[1]) {
+		return false;
+	}
+	*value = strtol(args[1], &end, 10);
+	return !*end && 0 <= *value;
+}
+
+/* The built-in xargs command */
+int xargs_cmd(char **args) {
+	static char *echo[] = { "echo", NULL };
+	Xargs x;
+	char *buf;
+	size_t start = 0, i;
+	bool stats = false, in_item = false, ok = true;
+	struct timeval before, after;
+	long value;
+	ssize_t got;
+
+	memset(&x, 0, sizeof(x));
+	x.max_procs = 1;
+	x.max_space = arg_space();
+	x.longest = 32 * sysconf(_SC_PAGESIZE);
+	gettimeofday(&before, NULL);
+
+	for (args++; *args && '-' == (*args)[0]; args++) {
+		if (0 == strcmp(*args, "-0")) {
+			x.nul = true;
+		} else if (0 == strcmp(*args, "-t")) {
+			x.trace = true;
+		} else if (0 == strcmp(*args, "--stats")) {
+			stats = true;
+		} else if (0 == strcmp(*args, "-n") && number_arg(args, &value) && 0 < value) {
+			x.max_items = (size_t) value;
+			args++;
+		} else if (0 == strcmp(*args, "-s") && number_arg(args, &value)) {
+			x.max_space = value < x.max_space ? value : x.max_space;
+			args++;
+		} else if (0 == strcmp(*args, "-P") && number_arg(args, &value)) {
+			/* 0 runs as many at a time as there are processors */
+			x.max_procs = 0 < value ? (int) value : (int) sysconf(_SC_NPROCESSORS_ONLN);
+			x.max_procs = 0 < x.max_procs ? x.max_procs : 1;
+			args++;
+		} else if (0 == strcmp(*args, "--")) {
+			args++;
+			break;
+		} else {
+			fprintf(stderr, "xargs: usage: xargs [-0t] [-n items] [-s bytes] [-P procs] "
+				"[--stats] [command [arg ...]]\n");
+			return EXIT_FAILURE;
+		}
+	}
+	if (!*args) {
+		args = echo;
+	}
+	if (find_loadable(args[0]) && !(find_loadable(args[0])->flags & SMSH_PIPELINE_SAFE)) {
+		/* Batches run in processes of their own */
+		fprintf(stderr, "xargs: %s: can't run in a forked process\n", args[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* The command and its initial arguments come off the top */
+	for (x.fixed = 0; args[x.fixed]; x.fixed++) {
+		x.max_space -= (long) (strlen(args[x.fixed]) + 1 + sizeof(*args));
+	}
+	x.args = grow_array(NULL, &x.args_cap, x.fixed + 1, sizeof(*x.args));
+	for (i = 0; i < x.fixed; i++) {
+		x.args[i] = args[i];
+	}
+	x.space = x.max_space;
+	if (0 >= x.max_space) {
+		fprintf(stderr, "xargs: no room for arguments\n");
+		free(x.args);
+		return EXIT_FAILURE;
+	}
+
+	if (!(buf = malloc(READ_BUFFER)) || !(x.pids = malloc(x.max_procs * sizeof(*x.pids)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	while (ok && !interrupted && 0 < (got = read_input(STDIN_FILENO, buf, READ_BUFFER))) {
+		ssize_t j;
+		for (j = 0; j < got && ok; j++) {
+			char c = buf[j];
+			bool separator = x.nul ? 0 == c : (' ' == c || '\t' == c || '\n' == c);
+
+			if (separator) {
+				if (in_item) {
+					ok = add_item(&x, start);
+					in_item = false;
+				}
+				continue;
+			}
+			if (!in_item) {
+				start = x.len;
+				in_item = true;
+			}
+			x.data = grow_array(x.data, &x.cap, x.len + 1, 1);
+			x.data[x.len++] = c;
+		}
+	}
+	if (ok && in_item) {
+		ok = add_item(&x, start);
+	}
+	if (ok) {
+		run_batch(&x);
+	}
+	while (0 < x.running) {
+		wait_batch(&x);
+	}
+
+	if (stats) {
+		gettimeofday(&after, NULL);
+		fprintf(stderr, "xargs: %lu items in %lu batches, at most %lu items and %ld of %ld bytes "
+			"per batch, %d at a time, %lu failed, %ld ms\n",
+			x.total_items, x.batches, (unsigned long) x.most_items, x.most_bytes, x.max_space,
+			x.most_running, x.failed,
+			(after.tv_sec - before.tv_sec) * 1000 + (after.tv_usec - before.tv_usec) / 1000);
+	}
+	free(buf);
+	free(x.pids);
+	free(x.data);
+	free(x.items);
+	free(x.args);
+	if (interrupted) {
+		return 128 + SIGINT;
+	}
+	return ok && 0 == x.failed ? EXIT_SUCCESS : 123;
+}